@@ -5,6 +5,7 @@
 #include "netdev.h"
 #include "skbuff.h"
 #include "utils.h"
+#include "list.h"
 
 #define ARP_ETHERNET    0x0001
 #define ARP_IPV4        0x0800
@@ -19,6 +20,11 @@
 #define ARP_WAITING     1
 #define ARP_RESOLVED    2
 
+#define ARP_CACHE_TIMEOUT   60000 /* ms a resolved entry is trusted, default of -a */
+#define ARP_RETRY_INTERVAL  1000 /* ms between requests, also the aging period */
+#define ARP_MAX_RETRIES     3
+#define ARP_MAX_QUEUED      16 /* Packets held per unresolved address */
+
 #define arp_dbg(str, hdr)                                               \
     do {                                                                \
         print_debug("ARP "str": hwtype: %hu, protype: %.4hx, "          \
@@ -72,13 +78,20 @@ struct arp_cache_entry
     uint32_t sip;
     unsigned char smac[6];
     unsigned int state;
+    uint64_t updated; /* ms, when resolved or last requested */
+    /* While waiting, what to send once resolved and how to ask again */
+    struct list_head queue;
+    uint32_t qlen;
+    uint32_t req_sip;
+    struct netdev *dev;
+    uint8_t retries;
 };
 
 void arp_init();
 void arp_rcv(struct sk_buff *skb);
 void arp_reply(struct sk_buff *skb, struct netdev *netdev);
 int arp_request(uint32_t sip, uint32_t dip, struct netdev *netdev);
-unsigned char* arp_get_hwaddr(uint32_t sip);
+int arp_neigh_output(struct sk_buff *skb, uint32_t sip, uint32_t dip);
 
 static inline struct arp_hdr *arp_hdr(struct sk_buff *skb)
 {
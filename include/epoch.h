@@ -0,0 +1,30 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include "syshead.h"
+#include "list.h"
+
+/*
+ * Epoch-based reclamation. Readers walk shared structures without locks
+ * between epoch_enter() and epoch_exit(). What writers unlink from them is
+ * handed to epoch_call() and only freed once every reader that may still
+ * see it has left its section, which is two advances of the global epoch
+ * later. Sections do not nest and must not block.
+ */
+#define EPOCH_MAX_THREADS 64
+#define EPOCH_RECLAIM_MS 10 /* Retired entries are checked on again after */
+
+struct epoch_entry {
+    struct list_head list;
+    uint64_t epoch; /* Global epoch when retired */
+    void (*fn) (struct epoch_entry *e);
+};
+
+void epoch_init();
+void epoch_enter();
+void epoch_exit();
+void epoch_call(struct epoch_entry *e, void (*fn) (struct epoch_entry *e));
+void epoch_reclaim();
+void epoch_drain();
+
+#endif
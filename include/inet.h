@@ -8,10 +8,56 @@
 int inet_create(struct socket *sock, int protocol);
 int inet_socket(struct socket *sock, int protocol);
 int inet_connect(struct socket *sock, struct sockaddr *addr, int addr_len, int flags);
-int inet_write(struct socket *sock, const void *buf, int len);
+int inet_bind(struct socket *sock, const struct sockaddr *addr, int addr_len);
+int inet_listen(struct socket *sock, int backlog);
+int inet_accept(struct socket *sock, struct socket **newsock, struct sockaddr *addr);
+int inet_write(struct socket *sock, const void *buf, int len, struct skb_buf *owner);
 int inet_read(struct socket *sock, void *buf, int len);
 int inet_close(struct socket *sock);
+int inet_setsockopt(struct socket *sock, int level, int optname,
+                    const void *optval, socklen_t optlen);
+int inet_getsockopt(struct socket *sock, int level, int optname,
+                    void *optval, socklen_t *optlen);
+int inet_poll(struct socket *sock);
 int inet_free(struct socket *sock);
+void inet_destroy(struct socket *sock);
 
+#define INET_EHASH_SIZE 16384 /* Connection buckets, a power of two */
+#define INET_EHASH_LOCKS 256 /* Writer locks striped over them */
+#define INET_LHASH_SIZE 256 /* Buckets of bound and listening sockets */
+
+/* Ephemeral port range, -p, the default of Linux */
+#define INET_PORT_LO 32768
+#define INET_PORT_HI 60999
+#define INET_PORT_PERTURB 256 /* Search offsets kept per destination hash */
+
+/* Table a sock is hashed in, sk->hashed */
+#define INET_HASHED_NONE 0
+#define INET_HASHED_EST 1
+#define INET_HASHED_BOUND 2
+
+void inet_hash_init();
+void inet_hash(struct sock *sk);
+int inet_hash_connect(struct sock *sk);
+int inet_bind_hash(struct sock *sk);
+void inet_unhash(struct sock *sk);
 struct sock *inet_lookup(struct sk_buff *skb, uint16_t sport, uint16_t dport);
+
+/*
+ * Hash of a connection 4-tuple, always given from the local end's point of
+ * view so that both directions of a flow hash alike.
+ */
+static inline uint32_t inet_flow_hash(uint32_t laddr, uint32_t raddr,
+                                      uint16_t lport, uint16_t rport)
+{
+    uint32_t h = laddr ^ (raddr * 0x9e3779b1) ^ ((uint32_t)lport << 16 | rport);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
 #endif
@@ -7,6 +7,12 @@ void *start_ipc_listener();
 #define IPC_WRITE   0x0003
 #define IPC_READ    0x0004
 #define IPC_CLOSE   0x0005
+#define IPC_SETSOCKOPT 0x0006
+#define IPC_GETSOCKOPT 0x0007
+#define IPC_BIND    0x0008
+#define IPC_LISTEN  0x0009
+#define IPC_ACCEPT  0x000A
+#define IPC_SHM     0x000B
 
 struct ipc_msg {
     uint16_t type;
@@ -32,6 +38,24 @@ struct ipc_connect {
     socklen_t addrlen;
 } __attribute__((packed));
 
+struct ipc_bind {
+    int sockfd;
+    struct sockaddr addr;
+    socklen_t addrlen;
+} __attribute__((packed));
+
+struct ipc_listen {
+    int sockfd;
+    int backlog;
+} __attribute__((packed));
+
+/* addrlen is the room for the peer's address, which the response carries */
+struct ipc_accept {
+    int sockfd;
+    struct sockaddr addr;
+    socklen_t addrlen;
+} __attribute__((packed));
+
 struct ipc_write {
     int sockfd;
     size_t len;
@@ -44,4 +68,102 @@ struct ipc_read {
     uint8_t buf[];
 } __attribute__((packed));
 
+/* optlen is the size of optval, or the room for it on a get */
+struct ipc_sockopt {
+    int sockfd;
+    int level;
+    int optname;
+    socklen_t optlen;
+    uint8_t optval[];
+} __attribute__((packed));
+
+/*
+ * Shared memory transport, which a client sets up with IPC_SHM over its
+ * UNIX socket. The message carries a memfd holding struct ipc_shm and two
+ * eventfds, one that wakes lvl-ip on submissions and one that wakes the
+ * client on completions. Requests are written to a slot in the same format
+ * as on the socket and the slot's index is pushed on the submission ring.
+ * lvl-ip writes the response over the request and pushes the index on the
+ * completion ring. A side only signals the other's eventfd when that one
+ * flagged its ring idle, so busy sides do not enter the kernel at all.
+ */
+#define IPC_SHM_SLOTS 16
+#define IPC_SHM_SLOT_SIZE 65536
+#define IPC_SHM_SPIN 2048 /* Looks at a ring before sleeping, with another CPU to wait for */
+
+struct ipc_shm_setup {
+    uint32_t slots;
+    uint32_t slot_size;
+} __attribute__((packed));
+
+/* Single producer, single consumer, deep enough for every slot */
+struct ipc_shm_ring {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t idle; /* The consumer sleeps on its eventfd */
+    uint32_t entries[IPC_SHM_SLOTS];
+} __attribute__((aligned(64)));
+
+struct ipc_shm {
+    struct ipc_shm_ring sq;
+    struct ipc_shm_ring cq;
+    uint8_t slots[IPC_SHM_SLOTS][IPC_SHM_SLOT_SIZE] __attribute__((aligned(64)));
+};
+
+static inline int ipc_ring_empty(struct ipc_shm_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) ==
+        __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline void ipc_ring_push(struct ipc_shm_ring *ring, uint32_t slot)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    ring->entries[tail % IPC_SHM_SLOTS] = slot;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* The slot at the head, or -1 if the ring is empty */
+static inline int ipc_ring_pop(struct ipc_shm_ring *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t slot;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return -1;
+
+    slot = ring->entries[head % IPC_SHM_SLOTS];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return slot;
+}
+
+/* Flags the consumer idle, unless something was pushed in the meantime.
+ * Pairs with the fence in ipc_ring_wake(). */
+static inline int ipc_ring_sleep(struct ipc_shm_ring *ring)
+{
+    __atomic_store_n(&ring->idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (ipc_ring_empty(ring)) return 1;
+
+    __atomic_store_n(&ring->idle, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Whether the consumer has to be woken for what was just pushed */
+static inline int ipc_ring_wake(struct ipc_shm_ring *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&ring->idle, __ATOMIC_RELAXED);
+}
+
+static inline void ipc_cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
 #endif
@@ -5,8 +5,23 @@
 #include "skbuff.h"
 #include "utils.h"
 
-#define BUFLEN 1500
+#define NETDEV_DEFAULT_MTU 1500
+#define NETDEV_MIN_MTU 68
+#define NETDEV_MAX_MTU 9000
+#define GSO_BUFLEN (65535 + 14)
+/* Largest frame the device receives outside of offloads */
+#define netdev_frame_len(dev) ((dev)->mtu + ETH_HDR_LEN)
 #define MAX_ADDR_LEN 32
+#define NETDEV_MAX_QUEUES 16
+#define NETDEV_RX_BURST 32
+#define NETDEV_TX_BATCH 32 /* Queued frames that force a flush */
+#define NETDEV_TX_FLUSH_USECS 50 /* Longest a queued frame waits for company */
+#define NETDEV_TX_HIST 6 /* log2 buckets of flushed batch sizes, 1 to 32 */
+
+/* Offloads the device is capable of */
+#define NETDEV_F_VNET_HDR 0x01
+#define NETDEV_F_CSUM     0x02
+#define NETDEV_F_TSO      0x04
 
 #define netdev_dbg(fmt, args...)                \
     do {                                        \
@@ -14,17 +29,57 @@
     } while (0)
 
 struct eth_hdr;
+struct netdev;
+
+/*
+ * Driver moving frames between a netdev and the outside world. rx_burst
+ * blocks until at least one frame is available and hands out up to n
+ * freshly allocated skbs. tx_burst sends up to n frames from the front of
+ * skbs and returns how many it took. Of those, *dropped could not be sent
+ * and are lost. Frames it did not take, e.g. for a full ring, are offered
+ * again by the next flush. The caller keeps ownership of the skbs, except
+ * for those whose entries the driver cleared: it frees them once sent.
+ */
+struct netdev_ops {
+    char *name;
+    int (*open) (struct netdev *dev);
+    int (*rx_burst) (struct netdev *dev, int queue, struct sk_buff **skbs, int n);
+    int (*tx_burst) (struct netdev *dev, int queue, struct sk_buff **skbs, int n,
+                     int *dropped);
+    void (*close) (struct netdev *dev);
+};
+
+/* Frames waiting to be handed to the driver in one tx_burst */
+struct netdev_txq {
+    pthread_mutex_t lock;
+    struct sk_buff *skbs[NETDEV_TX_BATCH];
+    int len;
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t hist[NETDEV_TX_HIST];
+};
 
 struct netdev {
     uint32_t addr;
     uint8_t addr_len;
     uint8_t hwaddr[6];
     uint32_t mtu;
+    uint32_t features;
+    int queues;
+    char *ifname;
+    struct netdev_ops *ops;
+    void *priv;
+    struct netdev_txq txq[NETDEV_MAX_QUEUES];
+    pthread_mutex_t tx_lock;
+    pthread_cond_t tx_kick; /* Signaled when a queue turns non-empty */
 };
 
 void netdev_init();
 int netdev_transmit(struct sk_buff *skb, uint8_t *dst, uint16_t ethertype);
-void *netdev_rx_loop();
+void netdev_tx_flush(struct netdev *dev);
+int netdev_receive(struct sk_buff *skb);
+void *netdev_rx_loop(void *arg);
+void *netdev_tx_loop(void *arg);
 void free_netdev();
 struct netdev *netdev_get(uint32_t sip);
 #endif
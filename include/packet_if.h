@@ -0,0 +1,8 @@
+#ifndef PACKET_IF_H
+#define PACKET_IF_H
+
+#include "netdev.h"
+
+extern struct netdev_ops packet_ops;
+
+#endif
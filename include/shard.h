@@ -0,0 +1,41 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include "syshead.h"
+#include "list.h"
+#include "skbuff.h"
+
+#define SHARD_MAX 16
+
+/*
+ * Protocol processing can be split over worker shards. A connection is
+ * owned by the shard its flow hash picks, and both its received frames and
+ * the application requests on it are run on that shard's thread only.
+ */
+struct shard {
+    pthread_mutex_t lock;
+    pthread_cond_t kick;
+    struct list_head rxq; /* Frames, linked through skb->list */
+    struct list_head calls;
+    struct list_head works;
+};
+
+/*
+ * Work run on a shard without its poster waiting for it. An item is
+ * queued once at a time, posting it again before it ran does nothing.
+ */
+struct shard_work {
+    struct list_head list;
+    void (*fn) (struct shard_work *work);
+    int pending;
+};
+
+void shard_init();
+void *shard_loop(void *arg);
+int shard_of(uint32_t hash);
+int shard_rx_burst(struct sk_buff **skbs, int n);
+int shard_run(int shard, int (*fn) (void *arg), void *arg);
+void shard_work_init(struct shard_work *work, void (*fn) (struct shard_work *work));
+int shard_post(int shard, struct shard_work *work);
+
+#endif
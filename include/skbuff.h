@@ -6,35 +6,142 @@
 #include "list.h"
 #include <pthread.h>
 
+/* Size classes of the per-thread sk_buff pool. Small covers ARP and pure
+ * TCP control segments, MTU covers a full Ethernet frame, jumbo a 9000 byte
+ * MTU frame and GSO covers a 64KB offloaded super-frame. */
+#define SKB_POOL_SMALL  0
+#define SKB_POOL_MTU    1
+#define SKB_POOL_JUMBO  2
+#define SKB_POOL_GSO    3
+#define SKB_POOL_CLASSES 4
+#define SKB_POOL_NONE   0xff
+
+/* Leading bytes of a fresh buffer that are zeroed for protocol headers */
+#define SKB_HDR_ROOM 128
+
+#define SKB_MAX_FRAGS 8
+
+/* Checksum state of an skb, as in the Linux kernel */
+#define CHECKSUM_NONE        0 /* Checksum is complete or must be verified */
+#define CHECKSUM_UNNECESSARY 1 /* Device has verified the checksum */
+#define CHECKSUM_PARTIAL     2 /* Only pseudo-header sum is in csum_start + csum_offset */
+
+/*
+ * Refcounted buffer that skb fragments point into, such as an IPC receive
+ * buffer. release runs when the last reference is dropped.
+ */
+struct skb_buf {
+    int refcnt;
+    void (*release) (struct skb_buf *buf);
+    uint32_t size;
+    uint8_t data[];
+};
+
+/* Payload kept outside of the skb's own buffer */
+struct skb_frag {
+    struct skb_buf *buf;
+    uint8_t *data;
+    uint32_t len;
+};
+
+struct skb_pool;
+
 struct sk_buff {
     struct list_head list;
     struct rtentry *rt;
     struct netdev *dev;
     uint16_t protocol;
-    uint32_t len;
+    uint32_t hash;
+    uint8_t pool;
+    struct skb_pool *owner; /* That the skb goes back to once freed */
+    uint8_t ip_summed;
+    uint16_t csum_start; /* From head */
+    uint16_t csum_offset; /* From csum_start */
+    uint16_t gso_size; /* Segment size when len exceeds the MSS */
+    uint32_t size;
+    uint32_t len; /* Linear part and fragments */
+    uint32_t data_len; /* Fragment bytes of len */
     uint32_t dlen;
+    uint32_t seq; /* Sequence space of a queued TCP segment */
+    uint32_t end_seq;
+    uint8_t sacked; /* The peer holds the segment, by a SACK block */
     uint8_t *tail;
     uint8_t *end;
     uint8_t *head;
     uint8_t *data;
     uint8_t *payload;
+    uint8_t nr_frags;
+    struct skb_frag frags[SKB_MAX_FRAGS];
 };
 
+/*
+ * Queue of skbs, either a list guarded by lock or, once switched with
+ * skb_queue_ring_init(), a lock-free ring for exactly one producer and one
+ * consumer at a time. Consumers of a ring that may run on several threads
+ * take lock among themselves. prod and cons are kept on separate cache
+ * lines.
+ */
 struct sk_buff_head {
     struct list_head head;
 
     uint32_t qlen;
     pthread_mutex_t lock;
+
+    struct sk_buff **ring;
+    uint32_t ring_mask;
+    uint32_t prod __attribute__((aligned(64)));
+    uint32_t cons __attribute__((aligned(64)));
+};
+
+struct skb_pool_stats {
+    uint64_t hits[SKB_POOL_CLASSES];
+    uint64_t misses[SKB_POOL_CLASSES];
+    uint64_t oversize;
 };
 
 struct sk_buff *alloc_skb(unsigned int size);
 void free_skb(struct sk_buff *skb);
 uint8_t *skb_push(struct sk_buff *skb, unsigned int len);
+uint8_t *skb_put(struct sk_buff *skb, unsigned int len);
 uint8_t *skb_head(struct sk_buff *skb);
 void *skb_reserve(struct sk_buff *skb, unsigned int len);
+void skb_checksum_help(struct sk_buff *skb);
+struct sk_buff *skb_copy(struct sk_buff *skb);
+int skb_add_frag(struct sk_buff *skb, struct skb_buf *buf, const void *data, uint32_t len);
+void skb_copy_data(struct sk_buff *skb, void *to);
+int skb_fill_iovec(struct sk_buff *skb, struct iovec *iov);
+struct skb_buf *skb_buf_alloc(uint32_t size);
+void skb_buf_put(struct skb_buf *buf);
+int skb_queue_ring_init(struct sk_buff_head *list, uint32_t size);
+void skb_queue_free(struct sk_buff_head *list);
+void skb_pool_stats(struct skb_pool_stats *stats);
+void skb_pool_dump();
+void free_skb_pools();
+
+static inline void skb_buf_get(struct skb_buf *buf)
+{
+    __atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* Bytes in the skb's own buffer */
+static inline uint32_t skb_headlen(const struct sk_buff *skb)
+{
+    return skb->len - skb->data_len;
+}
 
-static inline uint32_t skb_queue_len(const struct sk_buff_head *list)
+/* Whether the queue runs lock-free, in which case its producer takes no lock */
+static inline int skb_queue_is_ring(struct sk_buff_head *list)
 {
+    return __atomic_load_n(&list->ring, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static inline uint32_t skb_queue_len(struct sk_buff_head *list)
+{
+    if (skb_queue_is_ring(list)) {
+        return __atomic_load_n(&list->prod, __ATOMIC_ACQUIRE) -
+            __atomic_load_n(&list->cons, __ATOMIC_ACQUIRE);
+    }
+
     return list->qlen;
 }
 
@@ -43,16 +150,43 @@ static inline void skb_queue_init(struct sk_buff_head *list)
     list_init(&list->head);
     list->qlen = 0;
     pthread_mutex_init(&list->lock, NULL);
+    list->ring = NULL;
+    list->ring_mask = 0;
+    list->prod = 0;
+    list->cons = 0;
 }
 
-static inline void skb_queue_tail(struct sk_buff_head *list, struct sk_buff *new)
+/* Fails only for a full ring, the caller keeps the skb then */
+static inline int skb_queue_tail(struct sk_buff_head *list, struct sk_buff *new)
 {
+    if (skb_queue_is_ring(list)) {
+        uint32_t prod = list->prod;
+
+        if (prod - __atomic_load_n(&list->cons, __ATOMIC_ACQUIRE) > list->ring_mask) {
+            return -1;
+        }
+
+        list->ring[prod & list->ring_mask] = new;
+        __atomic_store_n(&list->prod, prod + 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
     list_add_tail(&new->list, &list->head);
     list->qlen += 1;
+
+    return 0;
 }
 
 static inline struct sk_buff *skb_dequeue(struct sk_buff_head *list)
 {
+    if (skb_queue_is_ring(list)) {
+        uint32_t cons = list->cons;
+        struct sk_buff *skb = list->ring[cons & list->ring_mask];
+
+        __atomic_store_n(&list->cons, cons + 1, __ATOMIC_RELEASE);
+        return skb;
+    }
+
     struct sk_buff *skb = list_first_entry(&list->head, struct sk_buff, list);
     list_del(&skb->list);
     list->qlen -= 1;
@@ -60,7 +194,7 @@ static inline struct sk_buff *skb_dequeue(struct sk_buff_head *list)
     return skb;
 }
 
-static inline int skb_queue_empty(const struct sk_buff_head *list)
+static inline int skb_queue_empty(struct sk_buff_head *list)
 {
     return skb_queue_len(list) < 1;
 }
@@ -68,8 +202,26 @@ static inline int skb_queue_empty(const struct sk_buff_head *list)
 static inline struct sk_buff *skb_peek(struct sk_buff_head *list)
 {
     if (skb_queue_empty(list)) return NULL;
+
+    if (skb_queue_is_ring(list)) return list->ring[list->cons & list->ring_mask];
         
     return list_first_entry(&list->head, struct sk_buff, list);
 }
 
+/* Last skb of a list queue */
+static inline struct sk_buff *skb_peek_tail(struct sk_buff_head *list)
+{
+    if (list_empty(&list->head)) return NULL;
+
+    return list_entry(list->head.prev, struct sk_buff, list);
+}
+
+/* The skb after skb in a list queue, NULL at its end */
+static inline struct sk_buff *skb_queue_next(struct sk_buff_head *list, struct sk_buff *skb)
+{
+    if (skb->list.next == &list->head) return NULL;
+
+    return list_entry(skb->list.next, struct sk_buff, list);
+}
+
 #endif
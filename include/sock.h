@@ -2,7 +2,6 @@
 #define _SOCK_H
 
 #include "socket.h"
-#include "wait.h"
 #include "skbuff.h"
 
 struct sock;
@@ -12,17 +11,26 @@ struct net_ops {
     int (*init) (struct sock *sk);
     int (*connect) (struct sock *sk, const struct sockaddr *addr, int addr_len, int flags);
     int (*disconnect) (struct sock *sk, int flags);
-    int (*write) (struct sock *sk, const void *buf, int len);
+    int (*listen) (struct sock *sk, int backlog);
+    /* NULL with err set to -EAGAIN while no connection is ready, or to
+     * another error once there is none to wait for */
+    struct sock* (*accept) (struct sock *sk, int *err);
+    int (*write) (struct sock *sk, const void *buf, int len, struct skb_buf *owner);
     int (*read) (struct sock *sk, void *buf, int len);
     int (*recv_notify) (struct sock *sk);
+    int (*poll) (struct sock *sk);
     int (*close) (struct sock *sk);
     int (*abort) (struct sock *sk);
+    void (*destroy) (struct sock *sk);
+    int (*setsockopt) (struct sock *sk, int level, int optname,
+                       const void *optval, socklen_t optlen);
+    int (*getsockopt) (struct sock *sk, int level, int optname,
+                       void *optval, socklen_t *optlen);
 };
 
 struct sock {
     struct socket *sock;
     struct net_ops *ops;
-    struct wait_lock recv_wait;
     struct sk_buff_head receive_queue;
     int protocol;
     int state;
@@ -30,9 +38,16 @@ struct sock {
     uint16_t dport;
     uint32_t saddr;
     uint32_t daddr;
+    int shard; /* Shard owning the connection, -1 when not sharded */
+    /* Guards the connection state of a socket that no shard owns */
+    pthread_mutex_t lock;
+    /* Lookup table chain, read without locks */
+    struct sock *hash_next;
+    uint8_t hashed;
 };
 
 struct sock *sk_alloc(struct net_ops *ops, int protocol);
 void sock_init_data(struct socket *sock, struct sock *sk);
+int sock_run(struct sock *sk, int (*fn) (void *arg), void *arg);
 
 #endif
@@ -2,10 +2,20 @@
 #define SOCKET_H_
 
 #include "sock.h"
-#include "wait.h"
 #include "list.h"
+#include "epoch.h"
 
 struct socket;
+struct skb_buf;
+
+/*
+ * Socket fds are numbered from SOCKET_FD_BASE, above the ones liblevelip
+ * leaves to the kernel, and kept in a table per process
+ */
+#define SOCKET_FD_BASE 4097
+#define SOCKET_FDTABLE_MIN 64 /* Slots of a new table, a multiple of 64 */
+#define SOCKET_MAX_FDS 65536 /* Per process */
+#define SOCKET_PID_BUCKETS 256
 
 enum socket_state {
     SS_FREE = 0,                    /* not allocated                */
@@ -22,37 +32,93 @@ struct sock_type {
     int protocol;
 };
 
+/*
+ * Socket operations do not block. A read without data, a write without
+ * room, an accept without a connection or a connect in its handshake
+ * returns -EAGAIN, or -EINPROGRESS and -EALREADY for connect, and the
+ * caller parks itself on the socket until poll() has the events it needs.
+ */
 struct sock_ops {
     int (*connect) (struct socket *sock, const struct sockaddr *addr,
                     int addr_len, int flags);
-    int (*write) (struct socket *sock, const void *buf, int len);
+    int (*bind) (struct socket *sock, const struct sockaddr *addr, int addr_len);
+    int (*listen) (struct socket *sock, int backlog);
+    /* Sets newsock to the accepted connection, addr to its peer */
+    int (*accept) (struct socket *sock, struct socket **newsock, struct sockaddr *addr);
+    /* owner, if not NULL, holds buf and lets it be sent without a copy */
+    int (*write) (struct socket *sock, const void *buf, int len, struct skb_buf *owner);
     int (*read) (struct socket *sock, void *buf, int len);
     int (*close) (struct socket *sock);
+    /* Tears the connection down on close, destroy frees it with the
+     * last reference */
     int (*free) (struct socket *sock);
+    void (*destroy) (struct socket *sock);
+    int (*setsockopt) (struct socket *sock, int level, int optname,
+                       const void *optval, socklen_t optlen);
+    int (*getsockopt) (struct socket *sock, int level, int optname,
+                       void *optval, socklen_t *optlen);
+    /* POLLIN and POLLOUT as far as an operation would not wait for them */
+    int (*poll) (struct socket *sock);
+};
+
+/*
+ * A request parked until its socket has one of events. socket_wake()
+ * takes it off the socket and calls wake, from the stack's threads, so
+ * wake must not block. The socket's reference passes to the request.
+ */
+struct socket_wait {
+    struct list_head list;
+    struct socket *sock;
+    short events;
+    void (*wake) (struct socket_wait *wait);
 };
 
 struct net_family {
     int (*create) (struct socket *sock, int protocol);    
 };
 
+/*
+ * Sockets are reference counted. The fd holds one reference until close,
+ * and lookups, armed timers and requests in progress hold one while they
+ * use the socket. The last reference frees it once no lockless lookup
+ * may still see it.
+ */
 struct socket {
-    struct list_head list;
+    int refcnt;
+    struct epoch_entry epoch;
     int fd;
     pid_t pid;
     enum socket_state state;
     short type;
     struct sock *sk;
     struct sock_ops *ops;
-    struct wait_lock sleep;
+    pthread_mutex_t wait_lock;
+    struct list_head waiters;
+    int nwaiters;
 };
 
-void *socket_ipc_open(void *args);
+void socket_init();
 int _socket(pid_t pid, int domain, int type, int protocol);
 int _connect(pid_t pid, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
-int _write(pid_t pid, int sockfd, const void *buf, const unsigned int count);
+int _bind(pid_t pid, int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+int _listen(pid_t pid, int sockfd, int backlog);
+int _accept(pid_t pid, int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+int _write(pid_t pid, int sockfd, const void *buf, const unsigned int count,
+           struct skb_buf *owner);
 int _read(pid_t pid, int sockfd, void *buf, const unsigned int count);
 int _close(pid_t pid, int sockfd);
-struct socket *socket_lookup(uint16_t sport, uint16_t dport);
+int _setsockopt(pid_t pid, int sockfd, int level, int optname,
+                const void *optval, socklen_t optlen);
+int _getsockopt(pid_t pid, int sockfd, int level, int optname,
+                void *optval, socklen_t *optlen);
+void socket_get(struct socket *sock);
+int socket_get_not_zero(struct socket *sock);
+void socket_put(struct socket *sock);
+struct socket *socket_new_conn(struct socket *head);
+int free_socket(struct socket *sock);
 void free_sockets();
+void socket_close_pid(pid_t pid);
+int socket_park(pid_t pid, int sockfd, struct socket_wait *wait);
+void socket_wake(struct socket *sock, short events);
 
 #endif
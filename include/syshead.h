@@ -21,5 +21,8 @@
 #include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/random.h>
 
 #endif
@@ -2,8 +2,84 @@
 #define TCP_H_
 #include "syshead.h"
 #include "ip.h"
+#include "timer.h"
+#include "shard.h"
+#include "tcp_cong.h"
 
 #define TCP_HDR_LEN sizeof(struct tcphdr)
+#define TCP_DEFAULT_MSS 536
+#define TCP_MIN_MSS 88 /* Floor for the peer's MSS option, as in Linux */
+#define TCP_RCV_RING 4096 /* Receive queue ring entries, a power of two */
+
+/* Retransmission timeout bounds in ms, RFC 6298. The minimum follows Linux
+ * rather than the RFC's conservative 1 second. */
+#define TCP_RTO_INITIAL 1000
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 60000
+#define TCP_MAX_RETRIES 15
+#define TCP_SYNACK_RETRIES 5
+
+#define TCP_FASTRETRANS_THRESH 3 /* Duplicate ACKs that signal a loss */
+
+/* Delayed ACKs, RFC 1122 4.2.3.2. The delay is the minimum Linux uses. */
+#define TCP_DELACK_TIME 40
+#define TCP_MAX_QUICKACKS 16 /* Segments ACKed at once on start and reordering */
+
+/* 2 MSL in ms as in Linux, and how long a closed socket waits for the
+ * peer's FIN in FIN-WAIT-2 */
+#define TCP_TIMEWAIT_LEN 60000
+#define TCP_FIN_TIMEOUT 60000
+
+/* Receive buffer in bytes of payload. It starts out small and grows with
+ * what the reader drains, up to tcp_rmem_max. */
+#define TCP_RCVBUF (64 * 1024)
+#define TCP_MIN_RCVBUF 4096
+#define TCP_MAX_RCVBUF (4 * 1024 * 1024) /* Default of tcp_rmem_max, -r */
+
+#define TCP_SNDBUF (256 * 1024) /* Bytes written but not acknowledged yet */
+#define TCP_MIN_SNDBUF 4096
+#define TCP_MAX_TSO 65535 /* Largest segment handed to a TSO capable device */
+
+#define TCP_SOMAXCONN 4096 /* Default of tcp_max_backlog, -b */
+
+/* tcp_syncookies, -s: whether a listener answers SYNs with cookies */
+#define TCP_SYNCOOKIES_OFF 0
+#define TCP_SYNCOOKIES_ON 1 /* Once its SYN queue is full */
+#define TCP_SYNCOOKIES_ALWAYS 2
+
+/* Nagle's algorithm is switched off by TCP_NODELAY, TCP_CORK holds back
+ * any partial segment */
+#define TCP_NAGLE_OFF 1
+#define TCP_NAGLE_CORK 2
+
+/* Loss recovery state of the sender */
+#define TCP_CA_OPEN 0
+#define TCP_CA_RECOVERY 1 /* Fast recovery after duplicate ACKs */
+#define TCP_CA_LOSS 2 /* Going back N after a retransmission timeout */
+
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_WSCALE 3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TIMESTAMP 8
+#define TCP_OPTLEN_MSS 4
+#define TCP_OPTLEN_WSCALE 3
+#define TCP_OPTLEN_SACK_PERM 2
+#define TCP_OPTLEN_SACK_BLOCK 8
+#define TCP_OPTLEN_TIMESTAMP 10
+#define TCP_OPTLEN_TS_ALIGNED 12 /* Timestamps behind two NOPs */
+#define TCP_MAX_OPTLEN 40
+
+#define TCP_MAX_WSCALE 14 /* RFC 7323 2.3 */
+#define TCP_MAX_SACKS 4 /* Blocks that fit the option space, 3 next to timestamps */
+
+/* Socket options, numbered as in Linux. <netinet/tcp.h> clashes with the
+ * definitions here. */
+#define TCP_NODELAY 1
+#define TCP_CORK 3
+#define TCP_CONGESTION 13
 
 #define TCP_FIN 0x01
 #define TCP_SYN 0x02
@@ -107,6 +183,24 @@ enum tcp_states {
                       termination request. */
 };
 
+struct tcp_sack_block {
+    uint32_t start_seq;
+    uint32_t end_seq;
+};
+
+/* Options of an incoming segment */
+struct tcp_options {
+    uint16_t mss;
+    uint8_t wscale;
+    uint8_t saw_wscale : 1,
+            sack_ok : 1,
+            saw_tstamp : 1;
+    uint32_t tsval;
+    uint32_t tsecr;
+    uint8_t num_sacks;
+    struct tcp_sack_block sacks[TCP_MAX_SACKS];
+};
+
 /* Current Segment Variables */
 struct tcp_segment {
     uint32_t seq; /* first sequence number of a segment */
@@ -119,6 +213,7 @@ struct tcp_segment {
     uint32_t up;
     uint32_t prc; /* precedence value, not used */
     uint32_t seq_last; /* last sequence number of a segment */
+    struct tcp_options opts;
 };
 
 struct tcb {
@@ -137,14 +232,173 @@ struct tcb {
     uint32_t irs;
 };
 
+/*
+ * Queues of a listening socket. Connections wait in syn until their
+ * handshake completes and in ready until accept() takes them, both up to
+ * backlog. The lock guards both, as connections on any shard use it.
+ */
+struct tcp_accept_queue {
+    pthread_mutex_t lock;
+    struct list_head syn;
+    struct list_head ready;
+    uint32_t syn_len;
+    uint32_t ready_len;
+    uint32_t backlog;
+};
+
 struct tcp_sock {
     struct sock sk;
     int fd;
     uint16_t tcp_header_len;
+    uint16_t mss; /* Largest payload the peer accepts in one segment */
+    uint16_t advmss; /* MSS announced to the peer, from the route's MTU */
     struct tcb tcb;
     uint8_t flags;
+    int err; /* Reads and writes of the closed connection fail with it */
+    /* Options agreed on in the SYN exchange */
+    uint8_t wscale_ok : 1,
+            sack_ok : 1,
+            tstamp_ok : 1;
+    uint8_t snd_wscale; /* Shift of the peer's window */
+    uint8_t rcv_wscale; /* Shift of the window we advertise */
+    uint32_t max_window; /* Largest window the peer has offered */
+    uint32_t ts_recent; /* Peer's timestamp to echo */
+    uint32_t last_ack_sent;
+    struct timer delack_timer;
+    struct shard_work delack_work;
+    uint8_t ack_pending; /* Data was received since the last ACK */
+    uint8_t quickack; /* ACKs to send without delay */
+    uint16_t rcv_mss; /* Guess of the peer's segment size */
+    /* Receive buffer. The rx thread charges rmem_alloc for queued data,
+     * the reader uncharges what it takes. */
+    uint32_t rcvbuf;
+    uint32_t rmem_alloc;
+    uint8_t rcvbuf_lock; /* Set by SO_RCVBUF, auto-tuning leaves it alone */
+    uint32_t rcv_rtt_est; /* Receiver's RTT estimate in us, 0 before a sample */
+    uint32_t rcv_rtt_seq; /* Window measured when timestamps are off */
+    uint64_t rcv_rtt_time; /* us */
+    /* Reader's side of auto-tuning */
+    uint32_t copied_seq; /* Next sequence number to be read */
+    uint32_t rcvq_space; /* Most read in one RTT so far */
+    uint32_t rcvq_seq; /* copied_seq at the start of the measurement */
+    uint64_t rcvq_time; /* us */
+    /* Received segments beyond rcv_nxt, by sequence number */
+    struct sk_buff_head ofo_queue;
+    /* Ranges of ofo_queue reported to the peer, the latest arrival first */
+    struct tcp_sack_block sacks[TCP_MAX_SACKS];
+    uint8_t num_sacks;
+    /* Segments from write until acknowledged. Its lock guards the sending
+     * side of the tcb and all the state below. */
+    struct sk_buff_head write_queue;
+    struct sk_buff *send_head; /* First segment not sent yet, if any */
+    uint32_t write_seq; /* End of the queued sequence space */
+    uint32_t sndbuf; /* Limit of write_seq - snd_una */
+    uint8_t nonagle;
+    uint8_t tso; /* The route's device segments for us */
+    uint32_t snd_max; /* Highest sequence number sent, snd_nxt rewinds on RTO */
+    uint32_t srtt; /* Smoothed RTT in us, 0 before the first sample */
+    uint32_t rttvar; /* RTT variation in us */
+    uint32_t rto; /* Retransmission timeout in ms, including backoff */
+    uint8_t backoff; /* Retransmissions of the queue's head segment */
+    uint8_t rtt_pending; /* A segment ending at rtt_seq is being timed */
+    uint32_t rtt_seq;
+    uint64_t rtt_start; /* us */
+    struct timer rto_timer;
+    struct timer persist_timer; /* Probes a zero window */
+    struct timer timewait_timer; /* Ends TIME-WAIT and FIN-WAIT-2 */
+    /* What an expired timer has its connection's shard do */
+    struct shard_work rto_work;
+    struct shard_work persist_work;
+    struct shard_work timewait_work;
+    uint8_t probes;
+    uint64_t lsndtime; /* ms, when data was last sent */
+    /* Congestion control, windows in bytes */
+    struct tcp_congestion_ops *ca_ops;
+    uint32_t snd_cwnd;
+    uint32_t snd_ssthresh;
+    uint32_t snd_cwnd_cnt; /* Bytes acknowledged towards the next increase */
+    uint8_t ca_state;
+    uint8_t dupacks;
+    uint32_t high_seq; /* snd_max when recovery started, RFC 6582 "recover" */
+    uint64_t ca_priv[TCP_CA_PRIV_SIZE];
+    /* Passive open */
+    struct tcp_accept_queue accept_queue; /* Of a listening socket */
+    struct tcp_sock *parent; /* Listener of a passive open, whose socket it holds */
+    struct list_head accept_list; /* Entry in the parent's queue, empty once out */
 };
 
+/*
+ * Sequence numbers wrap at 2^32, so they are ordered by their signed
+ * distance. Any two of them compared are less than 2^31 apart.
+ */
+static inline int before(uint32_t seq1, uint32_t seq2)
+{
+    return (int32_t)(seq1 - seq2) < 0;
+}
+
+#define after(seq2, seq1) before(seq1, seq2)
+
+/* Whether seq1 <= seq2 <= seq3 */
+static inline int between(uint32_t seq1, uint32_t seq2, uint32_t seq3)
+{
+    return seq3 - seq1 >= seq2 - seq1;
+}
+
+static inline void *tcp_ca(struct tcp_sock *tsk)
+{
+    return tsk->ca_priv;
+}
+
+extern uint64_t tcp_memory_allocated;
+
+/* Received data is charged to the socket and to the total of all sockets */
+static inline void tcp_rmem_charge(struct tcp_sock *tsk, uint32_t len)
+{
+    __atomic_add_fetch(&tsk->rmem_alloc, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tcp_memory_allocated, len, __ATOMIC_RELAXED);
+}
+
+static inline void tcp_rmem_uncharge(struct tcp_sock *tsk, uint32_t len)
+{
+    __atomic_sub_fetch(&tsk->rmem_alloc, len, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&tcp_memory_allocated, len, __ATOMIC_RELAXED);
+}
+
+/* Free receive buffer, no more than the receive ring has slots for */
+static inline uint32_t tcp_space(struct tcp_sock *tsk)
+{
+    struct sk_buff_head *queue = &tsk->sk.receive_queue;
+    uint32_t rcvbuf = __atomic_load_n(&tsk->rcvbuf, __ATOMIC_RELAXED);
+    uint32_t alloc = __atomic_load_n(&tsk->rmem_alloc, __ATOMIC_RELAXED);
+    uint32_t space = alloc < rcvbuf ? rcvbuf - alloc : 0;
+
+    if (skb_queue_is_ring(queue) && tsk->rcv_mss) {
+        uint32_t slots = queue->ring_mask + 1 - skb_queue_len(queue);
+
+        if (space > slots * tsk->rcv_mss) space = slots * tsk->rcv_mss;
+    }
+
+    return space;
+}
+
+/*
+ * States only a connection that the user closed gets to. It holds a
+ * reference on its socket until tcp_done().
+ */
+static inline int tcp_orphan(struct sock *sk)
+{
+    switch (sk->state) {
+    case TCP_FIN_WAIT_1:
+    case TCP_FIN_WAIT_2:
+    case TCP_CLOSING:
+    case TCP_LAST_ACK:
+    case TCP_TIME_WAIT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb)
 {
     return (struct tcphdr *)(skb->head + ETH_HDR_LEN + IP_HDR_LEN);
@@ -154,26 +408,55 @@ static inline struct tcphdr *tcp_hdr(const struct sk_buff *skb)
 void tcp_init();
 void tcp_in(struct sk_buff *skb);
 int tcp_checksum(struct tcp_sock *sock, struct tcphdr *thdr);
-void tcp_select_initial_window(uint32_t *rcv_wnd);
+void tcp_select_initial_window(uint32_t space, uint32_t *rcv_wnd, uint8_t *rcv_wscale);
 
 int generate_iss();
 struct sock *tcp_alloc_sock();
 int tcp_v4_init_sock(struct sock *sk);
 int tcp_init_sock(struct sock *sk);
 int tcp_v4_checksum(struct sk_buff *skb, uint32_t saddr, uint32_t daddr);
+uint16_t tcp_v4_pseudo_csum(struct sk_buff *skb, uint32_t saddr, uint32_t daddr);
 int tcp_v4_connect(struct sock *sk, const struct sockaddr *addr, int addrlen, int flags);
+void tcp_connect_init(struct sock *sk);
 int tcp_connect(struct sock *sk);
 int tcp_disconnect(struct sock *sk, int flags);
-int tcp_write(struct sock *sk, const void *buf, int len);
+int tcp_listen_start(struct sock *sk, int backlog);
+struct sock *tcp_accept(struct sock *sk, int *err);
+int tcp_write(struct sock *sk, const void *buf, int len, struct skb_buf *owner);
 int tcp_read(struct sock *sk, void *buf, int len);
 int tcp_receive(struct tcp_sock *tsk, void *buf, int len);
 int tcp_input_state(struct sock *sk, struct sk_buff *skb, struct tcp_segment *seg);
 int tcp_send_ack(struct sock *sk);
 int tcp_send_finack(struct sock *sk);
-int tcp_send(struct tcp_sock *tsk, const void *buf, int len);
+int tcp_send(struct tcp_sock *tsk, const void *buf, int len, struct skb_buf *owner);
 int tcp_send_reset(struct tcp_sock *tsk);
+int tcp_v4_send_reset(struct sk_buff *in, struct tcp_segment *seg);
+int tcp_send_synack(struct sock *sk);
+int tcp_send_synack_cookie(struct tcp_sock *listener, struct sk_buff *syn,
+                           struct tcp_segment *seg, uint32_t cookie);
+void tcp_accept_enqueue(struct tcp_sock *tsk);
+void tcp_push(struct tcp_sock *tsk);
+void tcp_retransmit_timer(struct tcp_sock *tsk);
+void tcp_probe_timer(struct tcp_sock *tsk);
+void tcp_delack_timer(struct tcp_sock *tsk);
+void tcp_retransmit_skb(struct sock *sk, struct sk_buff *skb);
+void tcp_write_xmit(struct sock *sk);
+int tcp_setsockopt(struct sock *sk, int level, int optname,
+                   const void *optval, socklen_t optlen);
+int tcp_getsockopt(struct sock *sk, int level, int optname,
+                   void *optval, socklen_t *optlen);
 int tcp_recv_notify(struct sock *sk);
+int tcp_poll(struct sock *sk);
 int tcp_close(struct sock *sk);
+void tcp_mem_dump();
+void tcp_syncookie_init();
+uint32_t tcp_syncookie_make(uint32_t laddr, uint32_t raddr, uint16_t lport, uint16_t rport,
+                            uint32_t isn, struct tcp_options *opts);
+int tcp_syncookie_check(uint32_t laddr, uint32_t raddr, uint16_t lport, uint16_t rport,
+                        uint32_t isn, uint32_t cookie, struct tcp_options *opts);
+void tcp_syncookie_dump();
 int tcp_abort(struct sock *sk);
+void tcp_done(struct tcp_sock *tsk);
+void tcp_destroy_sock(struct sock *sk);
 
 #endif
@@ -0,0 +1,40 @@
+#ifndef _TCP_CONG_H
+#define _TCP_CONG_H
+
+#include "syshead.h"
+
+#define TCP_CA_NAME_MAX 16
+#define TCP_CA_PRIV_SIZE 8 /* uint64_t words of per-connection algorithm state */
+#define TCP_INFINITE_SSTHRESH 0x7fffffff
+
+struct tcp_sock;
+
+/*
+ * Congestion control algorithm. cwnd and ssthresh are kept in bytes by
+ * the caller, loss recovery itself (fast retransmit, NewReno partial
+ * ACKs, RTO) is common to all algorithms and only asks for ssthresh.
+ */
+struct tcp_congestion_ops {
+    const char *name;
+    /* Connection established, or the algorithm switched on a live one */
+    void (*init) (struct tcp_sock *tsk);
+    /* An ACK acknowledged acked new bytes outside of loss recovery */
+    void (*cong_avoid) (struct tcp_sock *tsk, uint32_t acked);
+    /* Loss detected, returns the new slow start threshold */
+    uint32_t (*ssthresh) (struct tcp_sock *tsk);
+    /* Sending resumes after an idle period, cwnd has already been cut */
+    void (*restart) (struct tcp_sock *tsk);
+};
+
+extern struct tcp_congestion_ops tcp_newreno;
+extern struct tcp_congestion_ops tcp_cubic;
+
+struct tcp_congestion_ops *tcp_cong_find(const char *name);
+struct tcp_congestion_ops *tcp_cong_default();
+void tcp_init_congestion_control(struct tcp_sock *tsk);
+int tcp_set_congestion_control(struct tcp_sock *tsk, const char *name);
+void tcp_cwnd_restart(struct tcp_sock *tsk);
+uint32_t tcp_slow_start(struct tcp_sock *tsk, uint32_t acked);
+void tcp_cong_avoid_ai(struct tcp_sock *tsk, uint32_t w, uint32_t acked);
+
+#endif
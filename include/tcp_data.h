@@ -6,6 +6,7 @@
 int tcp_data_dequeue(struct tcp_sock *tsk, void *user_buf, int len);
 int tcp_data_queue(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th,
                    struct tcp_segment *seg);
+void tcp_ofo_purge(struct tcp_sock *tsk);
 int tcp_data_close(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th,
                    struct tcp_segment *seg);
 #endif
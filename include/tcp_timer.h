@@ -1,6 +1,32 @@
 #ifndef _TCP_TIMER_H
 #define _TCP_TIMER_H
 
+#include "syshead.h"
+
+struct sock;
+struct tcp_sock;
+
+static inline uint64_t tcp_clock_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Current time in timestamp ticks, RFC 7323 */
+static inline uint32_t tcp_time_stamp()
+{
+    return tcp_clock_us() / 1000;
+}
+
 int tcp_init_timers(struct sock *sk);
+void tcp_reset_rto_timer(struct tcp_sock *tsk);
+void tcp_stop_rto_timer(struct tcp_sock *tsk);
+void tcp_reset_persist_timer(struct tcp_sock *tsk);
+void tcp_reset_delack_timer(struct tcp_sock *tsk);
+void tcp_reset_timewait_timer(struct tcp_sock *tsk, uint32_t ms);
+void tcp_clear_timers(struct tcp_sock *tsk);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include "syshead.h"
+#include "list.h"
+
+/*
+ * Hierarchical timing wheel with a 1ms tick. Each level has 64 slots and
+ * covers 64 times the span of the one below, so four levels reach about
+ * 4.6 hours, and longer timeouts are clamped. Arming and cancelling are
+ * O(1). Timers of a higher level cascade down as the wheel turns.
+ */
+#define TIMER_LEVELS 4
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+struct timer {
+    struct list_head list; /* Empty when the timer is not armed */
+    uint64_t expires; /* Tick */
+    void (*handler) (void *arg);
+    void *arg;
+};
+
+static inline uint64_t timer_clock_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timers_init();
+void timer_init(struct timer *t, void (*handler) (void *arg), void *arg);
+int timer_add(struct timer *t, uint32_t ms);
+int timer_del(struct timer *t);
+int timer_pending(struct timer *t);
+void *timer_loop(void *arg);
+
+#endif
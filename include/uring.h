@@ -0,0 +1,55 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include "syshead.h"
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper over the raw syscalls. A ring has a single
+ * submitter and a single reaper, callers serialize access themselves.
+ */
+struct uring {
+    int fd;
+    int sqpoll;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned sq_entries;
+    unsigned sqe_tail; /* Prepared but possibly unpublished SQEs */
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+
+int uring_init(struct uring *r, unsigned entries, int sqpoll);
+void uring_free(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r, unsigned wait_nr);
+unsigned uring_unsubmit(struct uring *r);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+                                 const void *addr, unsigned len, uint64_t user_data)
+{
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = -1; /* Current file position, the tap fd is a stream */
+    sqe->user_data = user_data;
+}
+
+#endif
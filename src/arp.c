@@ -1,13 +1,20 @@
 #include "arp.h"
 #include "netdev.h"
 #include "skbuff.h"
+#include "timer.h"
 
 /*
  * https://tools.ietf.org/html/rfc826
  */
 
+extern int arp_cache_timeout;
+
 static uint8_t broadcast_hw[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 static struct arp_cache_entry arp_cache[ARP_CACHE_LEN];
+/* Every rx queue thread may update the cache */
+static pthread_mutex_t arp_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Ages resolved entries and repeats unanswered requests */
+static struct timer arp_timer;
 
 static struct sk_buff *arp_alloc_skb()
 {
@@ -26,6 +33,7 @@ static int insert_arp_translation_table(struct arp_hdr *hdr, struct arp_ipv4 *da
 
         if (entry->state == ARP_FREE) {
             entry->state = ARP_RESOLVED;
+            entry->updated = timer_clock_ms();
 
             entry->hwtype = hdr->hwtype;
             entry->sip = data->sip;
@@ -38,7 +46,21 @@ static int insert_arp_translation_table(struct arp_hdr *hdr, struct arp_ipv4 *da
     return -1;
 }
 
-static int update_arp_translation_table(struct arp_hdr *hdr, struct arp_ipv4 *data)
+/* Moves the packets waiting on a now resolved entry onto pending */
+static void arp_take_queue(struct arp_cache_entry *entry, struct list_head *pending)
+{
+    struct list_head *item, *tmp;
+
+    list_for_each_safe(item, tmp, &entry->queue) {
+        list_del(item);
+        list_add_tail(item, pending);
+    }
+
+    entry->qlen = 0;
+}
+
+static int update_arp_translation_table(struct arp_hdr *hdr, struct arp_ipv4 *data,
+                                        struct list_head *pending)
 {
     struct arp_cache_entry *entry;
 
@@ -49,6 +71,9 @@ static int update_arp_translation_table(struct arp_hdr *hdr, struct arp_ipv4 *da
 
         if (entry->hwtype == hdr->hwtype && entry->sip == data->sip) {
             memcpy(entry->smac, data->smac, 6);
+            entry->state = ARP_RESOLVED;
+            entry->updated = timer_clock_ms();
+            arp_take_queue(entry, pending);
             return 1;
         }
     }
@@ -56,9 +81,74 @@ static int update_arp_translation_table(struct arp_hdr *hdr, struct arp_ipv4 *da
     return 0;
 }
 
+static void arp_flush_pending(struct list_head *pending, unsigned char *hwaddr)
+{
+    struct list_head *item, *tmp;
+
+    list_for_each_safe(item, tmp, pending) {
+        struct sk_buff *skb = list_entry(item, struct sk_buff, list);
+
+        list_del(item);
+        netdev_transmit(skb, hwaddr, ETH_P_IP);
+    }
+}
+
+static void arp_timer_expired(void *arg)
+{
+    struct arp_cache_entry requests[ARP_CACHE_LEN];
+    struct list_head dropped;
+    struct list_head *item, *tmp;
+    uint64_t now = timer_clock_ms();
+    int nreq = 0;
+
+    list_init(&dropped);
+
+    pthread_mutex_lock(&arp_lock);
+
+    for (int i = 0; i < ARP_CACHE_LEN; i++) {
+        struct arp_cache_entry *entry = &arp_cache[i];
+
+        if (entry->state == ARP_RESOLVED && now - entry->updated >= (uint64_t)arp_cache_timeout) {
+            arpcache_dbg("expired", entry);
+            entry->state = ARP_FREE;
+        } else if (entry->state == ARP_WAITING && now - entry->updated >= ARP_RETRY_INTERVAL) {
+            if (entry->retries >= ARP_MAX_RETRIES) {
+                arpcache_dbg("unresolved", entry);
+                arp_take_queue(entry, &dropped);
+                entry->state = ARP_FREE;
+                continue;
+            }
+
+            entry->retries++;
+            entry->updated = now;
+            requests[nreq++] = *entry;
+        }
+    }
+
+    pthread_mutex_unlock(&arp_lock);
+
+    list_for_each_safe(item, tmp, &dropped) {
+        list_del(item);
+        free_skb(list_entry(item, struct sk_buff, list));
+    }
+
+    for (int i = 0; i < nreq; i++) {
+        arp_request(requests[i].req_sip, requests[i].sip, requests[i].dev);
+    }
+
+    timer_add(&arp_timer, ARP_RETRY_INTERVAL);
+}
+
 void arp_init()
 {
     memset(arp_cache, 0, ARP_CACHE_LEN * sizeof(struct arp_cache_entry));
+
+    for (int i = 0; i < ARP_CACHE_LEN; i++) {
+        list_init(&arp_cache[i].queue);
+    }
+
+    timer_init(&arp_timer, arp_timer_expired, NULL);
+    timer_add(&arp_timer, ARP_RETRY_INTERVAL);
 }
 
 void arp_rcv(struct sk_buff *skb)
@@ -66,6 +156,8 @@ void arp_rcv(struct sk_buff *skb)
     struct arp_hdr *arphdr;
     struct arp_ipv4 *arpdata;
     struct netdev *netdev;
+    struct list_head pending;
+    unsigned char hwaddr[6];
     int merge = 0;
 
     arphdr = arp_hdr(skb);
@@ -91,17 +183,27 @@ void arp_rcv(struct sk_buff *skb)
     arpdata->dip = ntohl(arpdata->dip);
     arpdata_dbg("receive", arpdata);
     
-    merge = update_arp_translation_table(arphdr, arpdata);
+    list_init(&pending);
+    memcpy(hwaddr, arpdata->smac, sizeof(hwaddr));
+
+    pthread_mutex_lock(&arp_lock);
+    merge = update_arp_translation_table(arphdr, arpdata, &pending);
 
     if (!(netdev = netdev_get(arpdata->dip))) {
+        pthread_mutex_unlock(&arp_lock);
+        arp_flush_pending(&pending, hwaddr);
         printf("ARP was not for us\n");
         goto drop_pkt;
     }
 
     if (!merge && insert_arp_translation_table(arphdr, arpdata) != 0) {
+        pthread_mutex_unlock(&arp_lock);
         print_err("ERR: No free space in ARP translation table\n");
         goto drop_pkt;
     }
+    pthread_mutex_unlock(&arp_lock);
+
+    arp_flush_pending(&pending, hwaddr);
 
     switch (arphdr->opcode) {
     case ARP_REQUEST:
@@ -185,27 +287,68 @@ void arp_reply(struct sk_buff *skb, struct netdev *netdev)
 }
 
 /*
- * Returns the HW address of the given source IP address
- * NULL if not found
+ * Sends an IP packet to dip, or holds it until dip resolves. The first
+ * packet for an unknown address sends the request, the aging timer
+ * repeats it and drops the packets when no reply comes.
  */
-unsigned char* arp_get_hwaddr(uint32_t sip)
+int arp_neigh_output(struct sk_buff *skb, uint32_t sip, uint32_t dip)
 {
-    struct arp_cache_entry *entry;
-    
-    print_debug("ARPCACHE: Searching for ARP entry with sip "
-                "%hhu.%hhu.%hhu.%hhu\n", sip >> 24, sip >> 16,
-                sip >> 8, sip >> 0);
+    struct netdev *netdev = skb->dev;
+    struct arp_cache_entry *entry, *free_entry = NULL;
+    unsigned char hwaddr[6];
+    int request = 0;
+
+    pthread_mutex_lock(&arp_lock);
 
     for (int i = 0; i < ARP_CACHE_LEN; i++) {
         entry = &arp_cache[i];
-        arpcache_dbg("entry", entry);
-
-        if (entry->state == ARP_RESOLVED && 
-            entry->sip == sip) {
 
-            return entry->smac;
+        if (entry->state == ARP_FREE) {
+            if (!free_entry) free_entry = entry;
+            continue;
         }
+
+        if (entry->sip == dip) goto found;
     }
 
-    return NULL;
+    if (!(entry = free_entry)) {
+        pthread_mutex_unlock(&arp_lock);
+        print_err("ERR: No free space in ARP translation table\n");
+        goto drop_pkt;
+    }
+
+    entry->state = ARP_WAITING;
+    entry->hwtype = ARP_ETHERNET;
+    entry->sip = dip;
+    entry->req_sip = sip;
+    entry->dev = netdev;
+    entry->retries = 0;
+    entry->updated = timer_clock_ms();
+    request = 1;
+
+found:
+    if (entry->state == ARP_RESOLVED) {
+        memcpy(hwaddr, entry->smac, sizeof(hwaddr));
+        pthread_mutex_unlock(&arp_lock);
+
+        return netdev_transmit(skb, hwaddr, ETH_P_IP);
+    }
+
+    if (entry->qlen >= ARP_MAX_QUEUED) {
+        pthread_mutex_unlock(&arp_lock);
+        goto drop_pkt;
+    }
+
+    list_add_tail(&skb->list, &entry->queue);
+    entry->qlen++;
+
+    pthread_mutex_unlock(&arp_lock);
+
+    if (request) arp_request(sip, dip, netdev);
+
+    return 0;
+
+drop_pkt:
+    free_skb(skb);
+    return -1;
 }
@@ -1,8 +1,28 @@
 #include "syshead.h"
 #include "utils.h"
 #include "cli.h"
+#include "netdev.h"
+#include "shard.h"
+#include "tcp_cong.h"
+#include "tcp.h"
+#include "inet.h"
+#include "arp.h"
 
 int debug = 0;
+char *netdev_driver = "tap";
+char *netdev_ifname = NULL;
+int netdev_queues = 1;
+int netdev_offload = 0;
+int netdev_mtu = NETDEV_DEFAULT_MTU;
+int shards = 0;
+char *tap_engine = "rw";
+char *tcp_congestion = "cubic";
+int tcp_rmem_max = TCP_MAX_RCVBUF;
+int tcp_max_backlog = TCP_SOMAXCONN;
+int tcp_syncookies = TCP_SYNCOOKIES_ON;
+int inet_port_lo = INET_PORT_LO;
+int inet_port_hi = INET_PORT_HI;
+int arp_cache_timeout = ARP_CACHE_TIMEOUT;
 
 static void usage(char *app)
 {
@@ -14,6 +34,21 @@ static void usage(char *app)
     print_err("\n");
     print_err("Options:\n");
     print_err("  -d Debug logging and tracing\n");
+    print_err("  -n <driver> Netdev driver, tap (default) or packet\n");
+    print_err("  -i <ifname> Interface for the packet driver to bind to, e.g. a veth\n");
+    print_err("  -e <engine> Tap I/O engine, rw (default), uring or sqpoll (uring with SQPOLL)\n");
+    print_err("  -o Enable tap checksum and segmentation offloads (IFF_VNET_HDR)\n");
+    print_err("  -m <mtu> MTU of the netdev, %d to %d (default %d)\n",
+              NETDEV_MIN_MTU, NETDEV_MAX_MTU, NETDEV_DEFAULT_MTU);
+    print_err("  -q <n> Amount of netdev queues and rx threads (max %d)\n", NETDEV_MAX_QUEUES);
+    print_err("  -w <n> Shard TCP processing over n worker threads by flow (max %d)\n", SHARD_MAX);
+    print_err("  -c <algo> Default TCP congestion control, cubic (default) or newreno\n");
+    print_err("  -r <bytes> Ceiling of TCP receive buffer auto-tuning (default %d)\n", TCP_MAX_RCVBUF);
+    print_err("  -b <n> Largest listen() backlog (default %d)\n", TCP_SOMAXCONN);
+    print_err("  -s <n> SYN cookies, 0 off, 1 once a SYN queue is full (default), 2 always\n");
+    print_err("  -p <lo>-<hi> Ephemeral port range of connect() (default %d-%d)\n",
+              INET_PORT_LO, INET_PORT_HI);
+    print_err("  -a <ms> How long a resolved ARP entry is trusted (default %d)\n", ARP_CACHE_TIMEOUT);
     print_err("  -h Print usage\n");
     print_err("\n");
     exit(1);
@@ -25,11 +60,61 @@ static int parse_opts(int *argc, char*** argv)
 {
     int opt;
 
-    while ((opt = getopt(*argc, *argv, "hd")) != -1) {
+    while ((opt = getopt(*argc, *argv, "hdn:i:e:m:oq:w:c:r:b:s:p:a:")) != -1) {
         switch (opt) {
         case 'd':
             debug = 1;
             break;
+        case 'n':
+            netdev_driver = optarg;
+            break;
+        case 'i':
+            netdev_ifname = optarg;
+            break;
+        case 'e':
+            tap_engine = optarg;
+            break;
+        case 'o':
+            netdev_offload = 1;
+            break;
+        case 'm':
+            netdev_mtu = atoi(optarg);
+            if (netdev_mtu < NETDEV_MIN_MTU || netdev_mtu > NETDEV_MAX_MTU) usage(*argv[0]);
+            break;
+        case 'q':
+            netdev_queues = atoi(optarg);
+            if (netdev_queues < 1 || netdev_queues > NETDEV_MAX_QUEUES) usage(*argv[0]);
+            break;
+        case 'w':
+            shards = atoi(optarg);
+            if (shards < 1 || shards > SHARD_MAX) usage(*argv[0]);
+            break;
+        case 'c':
+            tcp_congestion = optarg;
+            if (!tcp_cong_find(tcp_congestion)) usage(*argv[0]);
+            break;
+        case 'r':
+            tcp_rmem_max = atoi(optarg);
+            if (tcp_rmem_max < TCP_MIN_RCVBUF) usage(*argv[0]);
+            break;
+        case 'b':
+            tcp_max_backlog = atoi(optarg);
+            if (tcp_max_backlog < 1) usage(*argv[0]);
+            break;
+        case 's':
+            tcp_syncookies = atoi(optarg);
+            if (tcp_syncookies < TCP_SYNCOOKIES_OFF || tcp_syncookies > TCP_SYNCOOKIES_ALWAYS) usage(*argv[0]);
+            break;
+        case 'p':
+            if (sscanf(optarg, "%d-%d", &inet_port_lo, &inet_port_hi) != 2 ||
+                inet_port_lo < 1 || inet_port_lo > inet_port_hi || inet_port_hi > 65535) {
+                usage(*argv[0]);
+            }
+            break;
+        case 'a':
+            arp_cache_timeout = atoi(optarg);
+            if (arp_cache_timeout < 1) usage(*argv[0]);
+            break;
         case 'h':
         default:
             usage(*argv[0]);
@@ -0,0 +1,147 @@
+#include "syshead.h"
+#include "utils.h"
+#include "epoch.h"
+#include "timer.h"
+
+/* Epoch a thread entered its section in, 0 outside of one. Padded so
+ * that readers do not share cache lines. */
+struct epoch_record {
+    uint64_t active;
+    uint8_t pad[56];
+};
+
+static struct epoch_record records[EPOCH_MAX_THREADS];
+static int nrecords = 0;
+static __thread struct epoch_record *self = NULL;
+
+static uint64_t global_epoch = 1;
+
+static LIST_HEAD(retired);
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer reclaim_timer;
+
+static void epoch_reclaim_expired(void *arg)
+{
+    epoch_reclaim();
+}
+
+void epoch_init()
+{
+    timer_init(&reclaim_timer, epoch_reclaim_expired, NULL);
+}
+
+/* Threads take a record on their first section and keep it */
+static struct epoch_record *epoch_register()
+{
+    int i = __atomic_fetch_add(&nrecords, 1, __ATOMIC_RELAXED);
+
+    if (i >= EPOCH_MAX_THREADS) {
+        print_err("Out of epoch records, at most %d threads may read\n", EPOCH_MAX_THREADS);
+        exit(1);
+    }
+
+    return &records[i];
+}
+
+void epoch_enter()
+{
+    if (!self) self = epoch_register();
+
+    __atomic_store_n(&self->active, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    /* Pointers are not loaded before the epoch is announced */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit()
+{
+    __atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+}
+
+/* Runs fn on e once no reader can see what e is embedded in anymore */
+void epoch_call(struct epoch_entry *e, void (*fn) (struct epoch_entry *e))
+{
+    e->fn = fn;
+
+    pthread_mutex_lock(&retire_lock);
+    e->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    list_add_tail(&e->list, &retired);
+    pthread_mutex_unlock(&retire_lock);
+
+    epoch_reclaim();
+}
+
+/*
+ * Advances the global epoch if every reader in a section has seen the
+ * current one, and runs the entries retired two epochs ago or earlier.
+ * Entries that are left are tried again from the timer.
+ */
+void epoch_reclaim()
+{
+    struct list_head done, *item, *tmp;
+    uint64_t epoch;
+    int n, pending;
+
+    list_init(&done);
+
+    pthread_mutex_lock(&retire_lock);
+
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    n = __atomic_load_n(&nrecords, __ATOMIC_RELAXED);
+    if (n > EPOCH_MAX_THREADS) n = EPOCH_MAX_THREADS;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < n; i++) {
+        uint64_t active = __atomic_load_n(&records[i].active, __ATOMIC_ACQUIRE);
+
+        if (active && active != epoch) goto collect;
+    }
+
+    __atomic_store_n(&global_epoch, ++epoch, __ATOMIC_RELEASE);
+
+collect:
+    list_for_each_safe(item, tmp, &retired) {
+        struct epoch_entry *e = list_entry(item, struct epoch_entry, list);
+
+        /* Retired in order, so the rest is younger */
+        if (e->epoch + 2 > epoch) break;
+
+        list_del(item);
+        list_add_tail(item, &done);
+    }
+
+    pending = !list_empty(&retired);
+
+    pthread_mutex_unlock(&retire_lock);
+
+    list_for_each_safe(item, tmp, &done) {
+        struct epoch_entry *e = list_entry(item, struct epoch_entry, list);
+
+        list_del(item);
+        e->fn(e);
+    }
+
+    if (pending && !timer_pending(&reclaim_timer)) timer_add(&reclaim_timer, EPOCH_RECLAIM_MS);
+}
+
+/* Runs everything retired, once no thread reads anymore */
+void epoch_drain()
+{
+    struct epoch_entry *e;
+
+    timer_del(&reclaim_timer);
+
+    pthread_mutex_lock(&retire_lock);
+
+    while (!list_empty(&retired)) {
+        e = list_first_entry(&retired, struct epoch_entry, list);
+        list_del(&e->list);
+
+        pthread_mutex_unlock(&retire_lock);
+        e->fn(e);
+        pthread_mutex_lock(&retire_lock);
+    }
+
+    pthread_mutex_unlock(&retire_lock);
+}
@@ -3,7 +3,6 @@
 #include "socket.h"
 #include "sock.h"
 #include "tcp.h"
-#include "wait.h"
 
 extern struct net_ops tcp_ops;
 
@@ -18,10 +17,17 @@ struct net_family inet = {
 
 static struct sock_ops inet_stream_ops = {
     .connect = &inet_stream_connect,
+    .bind = &inet_bind,
+    .listen = &inet_listen,
+    .accept = &inet_accept,
     .write = &inet_write,
     .read = &inet_read,
     .close = &inet_close,
     .free = &inet_free,
+    .destroy = &inet_destroy,
+    .setsockopt = &inet_setsockopt,
+    .getsockopt = &inet_getsockopt,
+    .poll = &inet_poll,
 };
 
 static struct sock_type inet_ops[] = {
@@ -56,6 +62,11 @@ int inet_create(struct socket *sock, int protocol)
     sk->protocol = protocol;
     
     sock_init_data(sock, sk);
+
+    if (sk->ops->init && sk->ops->init(sk) != 0) {
+        print_err("Could not initialize socket\n");
+        return 1;
+    }
     
     return 0;
 }
@@ -95,8 +106,13 @@ static int inet_stream_connect(struct socket *sock, const struct sockaddr *addr,
         err = -EISCONN;
         goto out;
     case SS_CONNECTING:
-        err = -EALREADY;
-        goto out;
+        /* Called again once the handshake is over, for its outcome */
+        if (sk->state == TCP_SYN_SENT) {
+            err = -EALREADY;
+            goto out;
+        }
+
+        break;
     case SS_UNCONNECTED:
         err = -EISCONN;
         if (sk->state != TCP_CLOSE) {
@@ -104,7 +120,6 @@ static int inet_stream_connect(struct socket *sock, const struct sockaddr *addr,
         }
 
         err = sk->ops->connect(sk, addr, addr_len, flags);
-        wait_sleep(&sock->sleep);
 
         if (err < 0) {
             goto out;
@@ -112,9 +127,24 @@ static int inet_stream_connect(struct socket *sock, const struct sockaddr *addr,
 
         sock->state = SS_CONNECTING;
 
-        err = -EINPROGRESS;
+        /* The SYN-ACK may be in before we get here */
+        if (sk->state == TCP_SYN_SENT) {
+            err = -EINPROGRESS;
+            goto out;
+        }
+
         break;
     }
+
+    /* Only a failed handshake leaves the socket closed, the peer may have
+     * closed its side since */
+    if (sk->state == TCP_CLOSE) {
+        sock->state = SS_UNCONNECTED;
+        err = -ECONNREFUSED;
+        goto out;
+    }
+
+    sock->state = SS_CONNECTED;
     
     return 0;
 
@@ -122,11 +152,73 @@ out:
     return err;
 }
 
-int inet_write(struct socket *sock, const void *buf, int len)
+int inet_bind(struct socket *sock, const struct sockaddr *addr, int addr_len)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    struct sock *sk = sock->sk;
+    uint16_t port;
+    int err;
+
+    if (addr_len < sizeof(struct sockaddr_in) || sin->sin_family != AF_INET) return -EINVAL;
+    if (sk->sport) return -EINVAL;
+
+    port = ntohs(sin->sin_port);
+
+    /* Port 0 is left for inet_bind_hash() to pick */
+    sk->sport = port;
+    /* TODO: Do not hardcode lvl-ip local interface */
+    sk->saddr = sin->sin_addr.s_addr == htonl(INADDR_ANY) ?
+        parse_ipv4_string("10.0.0.4") : ntohl(sin->sin_addr.s_addr);
+
+    if ((err = inet_bind_hash(sk)) < 0) {
+        sk->sport = 0;
+        sk->saddr = 0;
+    }
+
+    return err;
+}
+
+int inet_listen(struct socket *sock, int backlog)
 {
     struct sock *sk = sock->sk;
 
-    return sk->ops->write(sk, buf, len);
+    if (sock->state != SS_UNCONNECTED || !sk->sport) return -EINVAL;
+
+    return sk->ops->listen(sk, backlog);
+}
+
+int inet_accept(struct socket *sock, struct socket **newsock, struct sockaddr *addr)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    struct sock *sk = sock->sk;
+    struct sock *newsk;
+    int err;
+
+    while ((newsk = sk->ops->accept(sk, &err)) != NULL) {
+        /* Handshakes that failed are of no use to anyone */
+        if (newsk->state != TCP_CLOSE) break;
+
+        free_socket(newsk->sock);
+    }
+
+    if (newsk == NULL) return err;
+
+    *newsock = newsk->sock;
+    (*newsock)->state = SS_CONNECTED;
+
+    memset(sin, 0, sizeof(struct sockaddr_in));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(newsk->dport);
+    sin->sin_addr.s_addr = htonl(newsk->daddr);
+
+    return 0;
+}
+
+int inet_write(struct socket *sock, const void *buf, int len, struct skb_buf *owner)
+{
+    struct sock *sk = sock->sk;
+
+    return sk->ops->write(sk, buf, len, owner);
 }
 
 int inet_read(struct socket *sock, void *buf, int len)
@@ -136,12 +228,20 @@ int inet_read(struct socket *sock, void *buf, int len)
     return sk->ops->read(sk, buf, len);
 }
 
-struct sock *inet_lookup(struct sk_buff *skb, uint16_t sport, uint16_t dport)
+int inet_setsockopt(struct socket *sock, int level, int optname,
+                    const void *optval, socklen_t optlen)
 {
-    struct socket *sock = socket_lookup(sport, dport);
-    if (sock == NULL) return NULL;
-    
-    return sock->sk;
+    struct sock *sk = sock->sk;
+
+    return sk->ops->setsockopt(sk, level, optname, optval, optlen);
+}
+
+int inet_getsockopt(struct socket *sock, int level, int optname,
+                    void *optval, socklen_t *optlen)
+{
+    struct sock *sk = sock->sk;
+
+    return sk->ops->getsockopt(sk, level, optname, optval, optlen);
 }
 
 int inet_close(struct socket *sock)
@@ -157,16 +257,46 @@ int inet_close(struct socket *sock)
     }
 
     sock->state = SS_DISCONNECTING;
-    wait_sleep(&sock->sleep);
 
     return 0;
 }
 
+int inet_poll(struct socket *sock)
+{
+    struct sock *sk = sock->sk;
+
+    return sk->ops->poll(sk);
+}
+
 int inet_free(struct socket *sock)
 {
     struct sock *sk = sock->sk;
+    struct sock *newsk;
+    int err;
+
+    /* A connection that closes in order leaves the hash once done */
+    if (sk->ops->close && sk->ops->close(sk) == 0) return 0;
+
+    /* Segments no longer find the socket, those under way hold a reference */
+    inet_unhash(sk);
     sk->ops->abort(sk);
 
-    free(sock->sk);
+    /* Connections of a listener that were not accepted go along with it */
+    if (sk->ops->accept) {
+        while ((newsk = sk->ops->accept(sk, &err)) != NULL) {
+            free_socket(newsk->sock);
+        }
+    }
+
     return 0;
 }
+
+void inet_destroy(struct socket *sock)
+{
+    struct sock *sk = sock->sk;
+
+    if (sk->ops->destroy) sk->ops->destroy(sk);
+
+    skb_queue_free(&sk->receive_queue);
+    free(sk);
+}
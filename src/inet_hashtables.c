@@ -0,0 +1,332 @@
+#include "syshead.h"
+#include "utils.h"
+#include "inet.h"
+#include "ip.h"
+#include "tcp.h"
+#include "epoch.h"
+
+extern int inet_port_lo;
+extern int inet_port_hi;
+
+/*
+ * Sockets are found by the segments they receive through two tables.
+ * Connections are hashed by their 4-tuple, and bound or listening sockets
+ * by their local port. The rx path walks the chains without locks inside
+ * an epoch section, and takes a reference on the socket it matches.
+ * Writers serialize on the bucket's lock and publish with release stores,
+ * and a socket that is unhashed keeps its chain pointer, so that a reader
+ * standing on it still finds its way to the end.
+ *
+ * Chains end in a marker naming their table and bucket rather than in
+ * NULL, as Linux's hlist_nulls. A socket that moves to another chain
+ * takes the readers standing on it along, and they tell by the marker at
+ * the end that they walked the wrong chain and start over.
+ */
+#define INET_EHASH_NULLS(bucket) ((struct sock *)(((uintptr_t)(bucket) << 2) | 1))
+#define INET_LHASH_NULLS(bucket) ((struct sock *)(((uintptr_t)(bucket) << 2) | 3))
+
+static struct sock *ehash[INET_EHASH_SIZE];
+static pthread_mutex_t ehash_locks[INET_EHASH_LOCKS];
+
+static struct sock *lhash[INET_LHASH_SIZE];
+static pthread_mutex_t lhash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Local ports claimed by bind, which connections leave alone */
+static uint64_t bound_ports[65536 / 64];
+
+/* Ephemeral ports, RFC 6056 3.3.5: each destination starts its search at
+ * a secret hash of it, moved on by a perturbation as ports are taken */
+static uint32_t port_secret;
+static uint32_t port_perturb[INET_PORT_PERTURB];
+static uint32_t bind_perturb;
+
+static inline int inet_is_nulls(struct sock *sk)
+{
+    return (uintptr_t)sk & 1;
+}
+
+void inet_hash_init()
+{
+    for (int i = 0; i < INET_EHASH_LOCKS; i++) {
+        pthread_mutex_init(&ehash_locks[i], NULL);
+    }
+
+    for (int i = 0; i < INET_EHASH_SIZE; i++) {
+        ehash[i] = INET_EHASH_NULLS(i);
+    }
+
+    for (int i = 0; i < INET_LHASH_SIZE; i++) {
+        lhash[i] = INET_LHASH_NULLS(i);
+    }
+
+    if (getrandom(&port_secret, sizeof(port_secret), 0) != sizeof(port_secret)) {
+        port_secret = (uint32_t)time(NULL) * rand();
+    }
+}
+
+static inline uint32_t inet_ehashfn(uint32_t laddr, uint32_t raddr, uint16_t lport, uint16_t rport)
+{
+    return inet_flow_hash(laddr, raddr, lport, rport) & (INET_EHASH_SIZE - 1);
+}
+
+static inline uint32_t inet_lhashfn(uint16_t lport)
+{
+    return lport & (INET_LHASH_SIZE - 1);
+}
+
+static inline pthread_mutex_t *inet_ehash_lock(uint32_t bucket)
+{
+    return &ehash_locks[bucket & (INET_EHASH_LOCKS - 1)];
+}
+
+/* Caller holds the bucket's lock. Readers may stand on a socket that moves */
+static void inet_chain_add(struct sock **head, struct sock *sk)
+{
+    __atomic_store_n(&sk->hash_next, *head, __ATOMIC_RELEASE);
+    __atomic_store_n(head, sk, __ATOMIC_RELEASE);
+}
+
+/* Caller holds the bucket's lock */
+static void inet_chain_del(struct sock **head, struct sock *sk)
+{
+    struct sock **pp = head;
+
+    while (!inet_is_nulls(*pp) && *pp != sk) pp = &(*pp)->hash_next;
+
+    if (*pp == sk) __atomic_store_n(pp, sk->hash_next, __ATOMIC_RELEASE);
+}
+
+/* Makes a connection with its 4-tuple set visible to received segments */
+void inet_hash(struct sock *sk)
+{
+    uint32_t bucket = inet_ehashfn(sk->saddr, sk->daddr, sk->sport, sk->dport);
+    pthread_mutex_t *lock = inet_ehash_lock(bucket);
+
+    pthread_mutex_lock(lock);
+    inet_chain_add(&ehash[bucket], sk);
+    sk->hashed = INET_HASHED_EST;
+    pthread_mutex_unlock(lock);
+}
+
+/* Caller holds the bucket's lock */
+static int inet_ehash_used(uint32_t bucket, uint32_t laddr, uint32_t raddr,
+                           uint16_t lport, uint16_t rport)
+{
+    for (struct sock *sk = ehash[bucket]; !inet_is_nulls(sk); sk = sk->hash_next) {
+        if (sk->sport == lport && sk->dport == rport &&
+            sk->saddr == laddr && sk->daddr == raddr) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline int inet_port_bound(uint16_t port)
+{
+    return !!(__atomic_load_n(&bound_ports[port / 64], __ATOMIC_RELAXED) & (1ULL << (port % 64)));
+}
+
+/*
+ * Moves a bound socket that connects from its port's chain to its 4-tuple's,
+ * unless a connection has that 4-tuple already. The port is not bound
+ * anymore from then on.
+ */
+static int inet_hash_bound_connect(struct sock *sk)
+{
+    uint32_t bucket = inet_ehashfn(sk->saddr, sk->daddr, sk->sport, sk->dport);
+    pthread_mutex_t *lock = inet_ehash_lock(bucket);
+
+    pthread_mutex_lock(lock);
+
+    if (inet_ehash_used(bucket, sk->saddr, sk->daddr, sk->sport, sk->dport)) {
+        pthread_mutex_unlock(lock);
+        return -EADDRNOTAVAIL;
+    }
+
+    pthread_mutex_lock(&lhash_lock);
+    inet_chain_del(&lhash[inet_lhashfn(sk->sport)], sk);
+    __atomic_and_fetch(&bound_ports[sk->sport / 64], ~(1ULL << (sk->sport % 64)),
+                       __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lhash_lock);
+
+    /* Lookups still on the port's chain end at this chain's marker */
+    inet_chain_add(&ehash[bucket], sk);
+    sk->hashed = INET_HASHED_EST;
+
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+/*
+ * Picks an ephemeral port for a connection and hashes it, in one step
+ * under the bucket's lock so that its 4-tuple is unique. A port is shared
+ * by connections to different destinations, and each try costs one
+ * bucket walk. A bound socket keeps its port.
+ */
+int inet_hash_connect(struct sock *sk)
+{
+    uint32_t range = inet_port_hi - inet_port_lo + 1;
+    uint32_t hash = inet_flow_hash(sk->saddr, sk->daddr ^ port_secret, 0, sk->dport);
+    uint32_t *perturb = &port_perturb[hash & (INET_PORT_PERTURB - 1)];
+    uint32_t offset = hash + __atomic_load_n(perturb, __ATOMIC_RELAXED);
+
+    if (sk->hashed == INET_HASHED_BOUND) return inet_hash_bound_connect(sk);
+
+    for (uint32_t i = 0; i < range; i++) {
+        uint16_t port = inet_port_lo + (offset + i) % range;
+        uint32_t bucket;
+        pthread_mutex_t *lock;
+
+        if (inet_port_bound(port)) continue;
+
+        bucket = inet_ehashfn(sk->saddr, sk->daddr, port, sk->dport);
+        lock = inet_ehash_lock(bucket);
+
+        pthread_mutex_lock(lock);
+
+        if (inet_ehash_used(bucket, sk->saddr, sk->daddr, port, sk->dport)) {
+            pthread_mutex_unlock(lock);
+            continue;
+        }
+
+        sk->sport = port;
+        inet_chain_add(&ehash[bucket], sk);
+        sk->hashed = INET_HASHED_EST;
+
+        pthread_mutex_unlock(lock);
+
+        /* The next connection to this destination starts further on */
+        __atomic_add_fetch(perturb, i + 2, __ATOMIC_RELAXED);
+
+        return 0;
+    }
+
+    return -EADDRNOTAVAIL;
+}
+
+/* A port of the ephemeral range that no socket is bound to, for a bind
+ * to port 0, or 0 if there is none. Caller holds lhash_lock. */
+static uint16_t inet_bind_port()
+{
+    uint32_t range = inet_port_hi - inet_port_lo + 1;
+    uint32_t offset = port_secret + bind_perturb;
+
+    for (uint32_t i = 0; i < range; i++) {
+        uint16_t port = inet_port_lo + (offset + i) % range;
+
+        if (inet_port_bound(port)) continue;
+
+        bind_perturb += i + 1;
+        return port;
+    }
+
+    return 0;
+}
+
+/* Claims the local port of a bound socket, unless another socket has it.
+ * A socket bound to port 0 is given one of the ephemeral range. */
+int inet_bind_hash(struct sock *sk)
+{
+    uint32_t bucket;
+    struct sock *other;
+
+    pthread_mutex_lock(&lhash_lock);
+
+    if (!sk->sport && (sk->sport = inet_bind_port()) == 0) {
+        pthread_mutex_unlock(&lhash_lock);
+        return -EADDRINUSE;
+    }
+
+    bucket = inet_lhashfn(sk->sport);
+
+    for (other = lhash[bucket]; !inet_is_nulls(other); other = other->hash_next) {
+        if (other->sport == sk->sport) {
+            pthread_mutex_unlock(&lhash_lock);
+            return -EADDRINUSE;
+        }
+    }
+
+    inet_chain_add(&lhash[bucket], sk);
+    sk->hashed = INET_HASHED_BOUND;
+    __atomic_or_fetch(&bound_ports[sk->sport / 64], 1ULL << (sk->sport % 64), __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&lhash_lock);
+
+    return 0;
+}
+
+void inet_unhash(struct sock *sk)
+{
+    uint32_t bucket;
+    pthread_mutex_t *lock;
+
+    switch (sk->hashed) {
+    case INET_HASHED_EST:
+        bucket = inet_ehashfn(sk->saddr, sk->daddr, sk->sport, sk->dport);
+        lock = inet_ehash_lock(bucket);
+
+        pthread_mutex_lock(lock);
+        inet_chain_del(&ehash[bucket], sk);
+        pthread_mutex_unlock(lock);
+        break;
+    case INET_HASHED_BOUND:
+        bucket = inet_lhashfn(sk->sport);
+
+        pthread_mutex_lock(&lhash_lock);
+        inet_chain_del(&lhash[bucket], sk);
+        __atomic_and_fetch(&bound_ports[sk->sport / 64], ~(1ULL << (sk->sport % 64)),
+                           __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lhash_lock);
+        break;
+    }
+
+    sk->hashed = INET_HASHED_NONE;
+}
+
+/*
+ * The socket a received segment belongs to, a connection before a
+ * listener. It is returned with a reference that the caller puts.
+ */
+struct sock *inet_lookup(struct sk_buff *skb, uint16_t sport, uint16_t dport)
+{
+    struct iphdr *iph = ip_hdr(skb);
+    uint32_t ebucket = inet_ehashfn(iph->daddr, iph->saddr, dport, sport);
+    uint32_t lbucket = inet_lhashfn(dport);
+    struct sock *sk;
+
+    epoch_enter();
+
+ebegin:
+    sk = __atomic_load_n(&ehash[ebucket], __ATOMIC_ACQUIRE);
+
+    for (; !inet_is_nulls(sk); sk = __atomic_load_n(&sk->hash_next, __ATOMIC_ACQUIRE)) {
+        if (sk->sport == dport && sk->dport == sport &&
+            sk->saddr == iph->daddr && sk->daddr == iph->saddr &&
+            socket_get_not_zero(sk->sock)) {
+            goto out;
+        }
+    }
+
+    if (sk != INET_EHASH_NULLS(ebucket)) goto ebegin;
+
+lbegin:
+    sk = __atomic_load_n(&lhash[lbucket], __ATOMIC_ACQUIRE);
+
+    for (; !inet_is_nulls(sk); sk = __atomic_load_n(&sk->hash_next, __ATOMIC_ACQUIRE)) {
+        if (sk->sport == dport && sk->state == TCP_LISTEN &&
+            sk->saddr == iph->daddr && socket_get_not_zero(sk->sock)) {
+            goto out;
+        }
+    }
+
+    if (sk != INET_LHASH_NULLS(lbucket)) goto lbegin;
+
+    sk = NULL;
+
+out:
+    epoch_exit();
+
+    return sk;
+}
@@ -16,9 +16,10 @@ int ip_output(struct sock *sk, struct sk_buff *skb)
     struct rtentry *rt;
     struct iphdr *ihdr = ip_hdr(skb);
 
-    rt = route_lookup(ihdr->daddr);
+    rt = route_lookup(sk->daddr);
 
-    if (!rt) {
+    /* Nothing takes frames routed to the loopback device */
+    if (!rt || !rt->dev->ops) {
         // Raise error
         // TODO: dest_unreachable
         free_skb(skb);
@@ -1,25 +1,175 @@
+#define _GNU_SOURCE
 #include "syshead.h"
 #include "utils.h"
 #include "ipc.h"
 #include "socket.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define IPC_BUFLEN 4096
+#define IPC_RECVLEN 8192
+#define IPC_MAX_FDS 3
+#define IPC_WORKERS 4 /* Threads that serve all clients between them */
 
-// TODO: dynamic socket pool
-static pthread_t sockets[256];
-static int cur_th = 0;
+/*
+ * Returned by a handler whose socket is not ready. The request is parked
+ * on the socket, and run again once it is ready.
+ */
+#define IPC_PARK 1
 
-static int ipc_write_rc(int sockfd, pid_t pid, uint16_t type, int rc)
+/*
+ * Where a request's response goes: written to the client's UNIX socket,
+ * or left in the shared memory slot the request came in. A response takes
+ * the place of the request in its slot, so handlers read what they need
+ * from the request before they build the response, and leave the request
+ * as it was when they park it.
+ */
+struct ipc_reply {
+    int sockfd;
+    uint8_t *slot;
+    uint32_t size; /* Room for the response in the slot */
+    uint32_t done; /* Progress of a request that parked, bytes written */
+    int parkfd; /* Socket to park on, and what for */
+    short events;
+};
+
+#define ipc_response(reply, len) \
+    ((struct ipc_msg *)((reply)->slot ? (reply)->slot : alloca(len)))
+
+/* A client that switched to shared memory */
+struct ipc_shm_conn {
+    struct ipc_shm *shm;
+    int sq_event; /* Signaled by the client on submissions */
+    int cq_event; /* Signaled for the client on completions */
+};
+
+/* What an epoll event is for, registrations point at one of these */
+enum ipc_event_type {
+    IPC_EV_LISTEN,
+    IPC_EV_CLIENT, /* A client's socket */
+    IPC_EV_SQ, /* A client's submission eventfd */
+    IPC_EV_RESUME, /* Parked requests were woken */
+};
+
+struct ipc_event {
+    enum ipc_event_type type;
+};
+
+/*
+ * A connected process. Its registrations with epoll hold a reference
+ * each, and so does each of its requests that parked, so that it stays
+ * until the last of them is done with it.
+ */
+struct ipc_client {
+    struct ipc_event ev;
+    struct ipc_event sq_ev;
+    struct list_head list; /* In clients */
+    pthread_mutex_t lock; /* Guards completions and dead */
+    int refcnt;
+    int dead; /* The process closed its socket */
+    int sockfd;
+    pid_t pid; /* Of its first request */
+    struct skb_buf *buf; /* Requests over the socket are received in */
+    struct ipc_shm_conn conn;
+};
+
+/* A request being served, on the stack of a worker until it first parks */
+struct ipc_call {
+    struct socket_wait wait;
+    struct list_head list; /* In resumed, once woken */
+    struct ipc_client *client;
+    struct ipc_reply reply;
+    struct ipc_msg *msg;
+    int msglen;
+    struct skb_buf *buf;
+    int slot; /* -1 for a request over the socket */
+    int parked; /* Moved to the heap */
+    /* While it runs on its socket, in running. Requests queued behind it
+     * are on pending, by their list. */
+    struct list_head running;
+    struct list_head pending;
+    pid_t pid;
+    int fd; /* Of the socket, which the response may overwrite in a slot */
+    int owner; /* Handed the socket by the request before it */
+};
+
+/*
+ * Clients are served by a pool of workers on one epoll instance. All fds
+ * are registered one-shot, so that an event goes to one worker, which
+ * arms the fd again once done with it.
+ */
+static int epfd;
+static int listen_fd;
+static struct ipc_event listen_ev = { .type = IPC_EV_LISTEN };
+static pthread_t workers[IPC_WORKERS];
+/* Spinning on the only CPU keeps the client from running */
+static int spins;
+
+static LIST_HEAD(clients);
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Woken requests, to be run again by the worker that gets resume_event */
+static LIST_HEAD(resumed);
+static pthread_mutex_t resume_lock = PTHREAD_MUTEX_INITIALIZER;
+static int resume_event;
+static struct ipc_event resume_ev = { .type = IPC_EV_RESUME };
+
+/*
+ * Requests on the same socket run one at a time, as the stack expects of
+ * them. A request parked on its socket is not running. There are no more
+ * running requests than workers, so a list does for looking them up.
+ */
+static LIST_HEAD(running);
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ipc_arm(int op, int fd, struct ipc_event *ev)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLONESHOT,
+        .data.ptr = ev,
+    };
+
+    if (epoll_ctl(epfd, op, fd, &event) == -1) {
+        perror("IPC epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ipc_respond(struct ipc_reply *reply, struct ipc_msg *response, int resplen)
+{
+    if (reply->slot) return 0;
+
+    /* A client that exited meanwhile is none of our concern */
+    if (send(reply->sockfd, (char *)response, resplen, MSG_NOSIGNAL) == -1) {
+        perror("Error on writing IPC response");
+    }
+
+    return 0;
+}
+
+static int ipc_park(struct ipc_reply *reply, int sockfd, short events)
+{
+    reply->parkfd = sockfd;
+    reply->events = events;
+
+    return IPC_PARK;
+}
+
+static int ipc_write_rc(struct ipc_reply *reply, pid_t pid, uint16_t type, int rc)
 {
     int resplen = sizeof(struct ipc_msg) + sizeof(struct ipc_err);
-    struct ipc_msg *response = alloca(resplen);
+    struct ipc_msg *response = ipc_response(reply, resplen);
 
     if (response == NULL) {
         print_err("Could not allocate memory for IPC write response\n");
         return -1;
     }
 
-    printf("pid %d, sockfd %d, type %4x, rc %d\n", pid, sockfd, type, rc);
+    printf("pid %d, sockfd %d, type %4x, rc %d\n", pid, reply->sockfd, type, rc);
     response->type = type;
     response->pid = pid;
 
@@ -35,30 +185,22 @@ static int ipc_write_rc(int sockfd, pid_t pid, uint16_t type, int rc)
     
     memcpy(response->data, &err, sizeof(struct ipc_err));
 
-    if (write(sockfd, (char *)response, resplen) == -1) {
-        perror("Error on writing IPC write response");
-    }
-
-    return 0;
+    return ipc_respond(reply, response, resplen);
 }
 
-static int ipc_read(int sockfd, struct ipc_msg *msg)
+static int ipc_read(struct ipc_reply *reply, struct ipc_msg *msg)
 {
     struct ipc_read *requested = (struct ipc_read *) msg->data;
+    int hdrlen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) + sizeof(struct ipc_read);
+    int sockfd = requested->sockfd;
+    size_t len = requested->len;
     pid_t pid = msg->pid;
     int rlen = -1;
-    char rbuf[requested->len];
-    memset(rbuf, 0, requested->len);
 
-    rlen = _read(pid, requested->sockfd, rbuf, requested->len);
-
-    if (rlen < 0 || requested->len < rlen) {
-        printf("Error on IPC read, requested len %lu, actual len %d, sockfd %d, pid %d\n",
-               requested->len, rlen, requested->sockfd, pid);
-    }
+    /* A read from shared memory returns what fits in the slot */
+    if (reply->slot && len > reply->size - hdrlen) len = reply->size - hdrlen;
 
-    int resplen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) + sizeof(struct ipc_read) + rlen;
-    struct ipc_msg *response = alloca(resplen);
+    struct ipc_msg *response = ipc_response(reply, hdrlen + len);
     struct ipc_err *error = (struct ipc_err *) response->data;
     struct ipc_read *actual = (struct ipc_read *) error->data;
 
@@ -66,6 +208,16 @@ static int ipc_read(int sockfd, struct ipc_msg *msg)
         print_err("Could not allocate memory for IPC read response\n");
         return -1;
     }
+
+    /* Straight into the response, behind its headers */
+    rlen = _read(pid, sockfd, actual->buf, len);
+
+    if (rlen == -EAGAIN) return ipc_park(reply, sockfd, POLLIN);
+
+    if (rlen < 0 || len < rlen) {
+        printf("Error on IPC read, requested len %lu, actual len %d, sockfd %d, pid %d\n",
+               len, rlen, sockfd, pid);
+    }
     
     response->type = IPC_READ;
     response->pid = pid;
@@ -73,40 +225,116 @@ static int ipc_read(int sockfd, struct ipc_msg *msg)
     error->rc = rlen < 0 ? -1 : rlen;
     error->err = rlen < 0 ? -rlen : 0;
 
-    actual->sockfd = requested->sockfd;
+    actual->sockfd = sockfd;
     actual->len = rlen;
-    memcpy(actual->buf, rbuf, rlen > 0 ? rlen : 0);
-
-    if (write(sockfd, (char *)response, resplen) == -1) {
-        perror("Error on writing IPC write response");
-    }
 
-    return 0;
+    return ipc_respond(reply, response, hdrlen + (rlen > 0 ? rlen : 0));
 }
 
-static int ipc_write(int sockfd, struct ipc_msg *msg)
+static int ipc_write(struct ipc_reply *reply, struct ipc_msg *msg, int msglen,
+                     struct skb_buf *buf)
 {
     struct ipc_write *payload = (struct ipc_write *) msg->data;
+    int hdrlen = sizeof(struct ipc_msg) + sizeof(struct ipc_write);
+    int sockfd = payload->sockfd;
+    uint32_t len = payload->len;
     pid_t pid = msg->pid;
     int rc = -1;
 
-    rc = _write(pid, payload->sockfd, payload->buf, payload->len);
+    if (msglen < hdrlen || len > msglen - hdrlen) {
+        return ipc_write_rc(reply, pid, IPC_WRITE, -EMSGSIZE);
+    }
+
+    /* The payload is sent straight out of the IPC receive buffer, or
+     * copied out of a shared memory slot that the client reuses. What does
+     * not fit in the send buffer waits for acknowledgments to make room. */
+    do {
+        rc = _write(pid, sockfd, payload->buf + reply->done, len - reply->done, buf);
+
+        if (rc == -EAGAIN) return ipc_park(reply, sockfd, POLLOUT);
+        if (rc <= 0) break;
+
+        reply->done += rc;
+    } while (reply->done < len);
 
-    return ipc_write_rc(sockfd, pid, IPC_WRITE, rc);
+    return ipc_write_rc(reply, pid, IPC_WRITE, reply->done ? reply->done : rc);
 }
 
-static int ipc_connect(int sockfd, struct ipc_msg *msg)
+static int ipc_connect(struct ipc_reply *reply, struct ipc_msg *msg)
 {
     struct ipc_connect *payload = (struct ipc_connect *)msg->data;
+    int sockfd = payload->sockfd;
+    pid_t pid = msg->pid;
+    int rc = -1;
+
+    rc = _connect(pid, sockfd, &payload->addr, payload->addrlen);
+
+    /* Called again once the handshake is over */
+    if (rc == -EINPROGRESS || rc == -EALREADY) return ipc_park(reply, sockfd, POLLOUT);
+
+    return ipc_write_rc(reply, pid, IPC_CONNECT, rc);
+}
+
+static int ipc_bind(struct ipc_reply *reply, struct ipc_msg *msg)
+{
+    struct ipc_bind *payload = (struct ipc_bind *)msg->data;
+    struct sockaddr addr = payload->addr;
+    pid_t pid = msg->pid;
+    int rc = -1;
+
+    rc = _bind(pid, payload->sockfd, &addr, payload->addrlen);
+
+    return ipc_write_rc(reply, pid, IPC_BIND, rc);
+}
+
+static int ipc_listen(struct ipc_reply *reply, struct ipc_msg *msg)
+{
+    struct ipc_listen *payload = (struct ipc_listen *)msg->data;
+    pid_t pid = msg->pid;
+    int rc = -1;
+
+    rc = _listen(pid, payload->sockfd, payload->backlog);
+
+    return ipc_write_rc(reply, pid, IPC_LISTEN, rc);
+}
+
+static int ipc_accept(struct ipc_reply *reply, struct ipc_msg *msg)
+{
+    struct ipc_accept *requested = (struct ipc_accept *)msg->data;
+    int resplen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) + sizeof(struct ipc_accept);
+    int sockfd = requested->sockfd;
+    struct sockaddr addr;
+    socklen_t addrlen = sizeof(struct sockaddr);
     pid_t pid = msg->pid;
     int rc = -1;
 
-    rc = _connect(pid, payload->sockfd, &payload->addr, payload->addrlen);
+    if (requested->addrlen < addrlen) addrlen = requested->addrlen;
 
-    return ipc_write_rc(sockfd, pid, IPC_CONNECT, rc);
+    rc = _accept(pid, sockfd, &addr, &addrlen);
+
+    if (rc == -EAGAIN) return ipc_park(reply, sockfd, POLLIN);
+
+    if (rc < 0) addrlen = 0;
+
+    struct ipc_msg *response = ipc_response(reply, resplen);
+    struct ipc_err *error = (struct ipc_err *) response->data;
+    struct ipc_accept *actual = (struct ipc_accept *) error->data;
+
+    response->type = IPC_ACCEPT;
+    response->pid = pid;
+
+    error->rc = rc < 0 ? -1 : rc;
+    error->err = rc < 0 ? -rc : 0;
+
+    actual->sockfd = sockfd;
+    memset(&actual->addr, 0, sizeof(struct sockaddr));
+    memcpy(&actual->addr, &addr, addrlen);
+    actual->addrlen = addrlen;
+
+    return ipc_respond(reply, response, resplen);
 }
 
-static int ipc_socket(int sockfd, struct ipc_msg *msg)
+static int ipc_socket(struct ipc_reply *reply, struct ipc_msg *msg)
 {
     struct ipc_socket *sock = (struct ipc_socket *)msg->data;
     pid_t pid = msg->pid;
@@ -114,39 +342,147 @@ static int ipc_socket(int sockfd, struct ipc_msg *msg)
 
     rc = _socket(pid, sock->domain, sock->type, sock->protocol);
 
-    return ipc_write_rc(sockfd, pid, IPC_SOCKET, rc);
+    return ipc_write_rc(reply, pid, IPC_SOCKET, rc);
 }
 
-static int ipc_close(int sockfd, struct ipc_msg *msg)
+static int ipc_close(struct ipc_reply *reply, struct ipc_msg *msg)
 {
-    int fd = *msg->data;
+    int fd = *(int *)msg->data;
     pid_t pid = msg->pid;
     int rc = -1;
 
     rc = _close(pid, fd);
 
-    return ipc_write_rc(sockfd, pid, IPC_CLOSE, rc);
+    return ipc_write_rc(reply, pid, IPC_CLOSE, rc);
 }
 
-static int demux_ipc_socket_call(int sockfd, char *cmdbuf, int blen)
+static int ipc_setsockopt(struct ipc_reply *reply, struct ipc_msg *msg)
 {
-    struct ipc_msg *msg = (struct ipc_msg *)cmdbuf;
+    struct ipc_sockopt *opts = (struct ipc_sockopt *)msg->data;
+    pid_t pid = msg->pid;
+    int rc = -1;
+
+    rc = _setsockopt(pid, opts->sockfd, opts->level, opts->optname,
+                     opts->optval, opts->optlen);
+
+    return ipc_write_rc(reply, pid, IPC_SETSOCKOPT, rc);
+}
+
+static int ipc_getsockopt(struct ipc_reply *reply, struct ipc_msg *msg)
+{
+    struct ipc_sockopt *opts = (struct ipc_sockopt *)msg->data;
+    int sockfd = opts->sockfd;
+    int level = opts->level;
+    int optname = opts->optname;
+    pid_t pid = msg->pid;
+    socklen_t optlen = opts->optlen;
+    int rc = -1;
+
+    if (optlen > IPC_BUFLEN) optlen = IPC_BUFLEN;
+
+    uint8_t optval[optlen];
+
+    rc = _getsockopt(pid, sockfd, level, optname, optval, &optlen);
+
+    if (rc < 0) optlen = 0;
+
+    int resplen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) +
+        sizeof(struct ipc_sockopt) + optlen;
+    struct ipc_msg *response = ipc_response(reply, resplen);
+    struct ipc_err *error = (struct ipc_err *) response->data;
+    struct ipc_sockopt *actual = (struct ipc_sockopt *) error->data;
+
+    response->type = IPC_GETSOCKOPT;
+    response->pid = pid;
+
+    error->rc = rc < 0 ? -1 : rc;
+    error->err = rc < 0 ? -rc : 0;
+
+    actual->sockfd = sockfd;
+    actual->level = level;
+    actual->optname = optname;
+    actual->optlen = optlen;
+    memcpy(actual->optval, optval, optlen);
+
+    return ipc_respond(reply, response, resplen);
+}
 
+/*
+ * Maps the client's shared memory and takes its eventfds. The response
+ * still goes over the socket, the client switches after it.
+ */
+static int ipc_shm_open(struct ipc_reply *reply, struct ipc_msg *msg, int *fds, int nfds,
+                        struct ipc_shm_conn *conn)
+{
+    struct ipc_shm_setup *setup = (struct ipc_shm_setup *)msg->data;
+    pid_t pid = msg->pid;
+    struct stat st;
+    void *shm;
+    int rc = -EINVAL;
+
+    if (conn->shm || nfds != IPC_MAX_FDS || setup->slots != IPC_SHM_SLOTS ||
+        setup->slot_size != IPC_SHM_SLOT_SIZE) {
+        goto out;
+    }
+
+    if (fstat(fds[0], &st) == -1 || st.st_size < sizeof(struct ipc_shm)) goto out;
+
+    shm = mmap(NULL, sizeof(struct ipc_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm == MAP_FAILED) {
+        perror("IPC shm mmap");
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    /* Drained by whichever worker gets its event, which may find it read */
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    conn->shm = shm;
+    conn->sq_event = fds[1];
+    conn->cq_event = fds[2];
+    close(fds[0]);
+
+    return ipc_write_rc(reply, pid, IPC_SHM, 0);
+
+out:
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+
+    return ipc_write_rc(reply, pid, IPC_SHM, rc);
+}
+
+static int demux_ipc_call(struct ipc_reply *reply, struct ipc_msg *msg, int msglen,
+                          struct skb_buf *buf)
+{
     switch (msg->type) {
     case IPC_SOCKET:
-        return ipc_socket(sockfd, msg);
+        return ipc_socket(reply, msg);
         break;
     case IPC_CONNECT:
-        return ipc_connect(sockfd, msg);
+        return ipc_connect(reply, msg);
         break;
     case IPC_WRITE:
-        return ipc_write(sockfd, msg);
+        return ipc_write(reply, msg, msglen, buf);
         break;
     case IPC_READ:
-        return ipc_read(sockfd, msg);
+        return ipc_read(reply, msg);
         break;
     case IPC_CLOSE:
-        return ipc_close(sockfd, msg);
+        return ipc_close(reply, msg);
+        break;
+    case IPC_SETSOCKOPT:
+        return ipc_setsockopt(reply, msg);
+        break;
+    case IPC_GETSOCKOPT:
+        return ipc_getsockopt(reply, msg);
+        break;
+    case IPC_BIND:
+        return ipc_bind(reply, msg);
+        break;
+    case IPC_LISTEN:
+        return ipc_listen(reply, msg);
+        break;
+    case IPC_ACCEPT:
+        return ipc_accept(reply, msg);
         break;
     default:
         print_err("No such IPC type %d\n", msg->type);
@@ -156,33 +492,519 @@ static int demux_ipc_socket_call(int sockfd, char *cmdbuf, int blen)
     return 0;
 }
 
-void *socket_ipc_open(void *args) {
-    int blen = 8192;
-    char buf[blen];
-    int sockfd = *(int *)args;
-    int rc = -1;
+/* Reads a request, and the descriptors IPC_SHM passes along with it */
+static int ipc_recv(int sockfd, struct skb_buf *buf, int blen, int *fds, int *nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * IPC_MAX_FDS)];
+    } control;
+    struct iovec iov = { .iov_base = buf->data, .iov_len = blen };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    int rc;
 
-    printf("socket ipc opened\n");
+    *nfds = 0;
 
-    while ((rc = read(sockfd, buf, blen)) > 0) {
-        rc = demux_ipc_socket_call(sockfd, buf, blen);
+    if ((rc = recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT)) <= 0) return rc;
 
-        if (rc == -1) {
-            printf("Error on demuxing IPC socket call\n");
-            return NULL;
-        };
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
     }
 
-    if (rc == -1) {
-        perror("socket ipc read");
+    return rc;
+}
+
+static void ipc_client_get(struct ipc_client *client)
+{
+    __atomic_add_fetch(&client->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void ipc_client_put(struct ipc_client *client)
+{
+    if (__atomic_sub_fetch(&client->refcnt, 1, __ATOMIC_ACQ_REL)) return;
+
+    if (client->conn.shm) {
+        munmap(client->conn.shm, sizeof(struct ipc_shm));
+        close(client->conn.sq_event);
+        close(client->conn.cq_event);
     }
-    
+
+    close(client->sockfd);
+    skb_buf_put(client->buf);
+    free(client);
+}
+
+/* Hands a slot back to the client, with the response in it */
+static void ipc_shm_complete(struct ipc_client *client, int slot)
+{
+    struct ipc_shm *shm = client->conn.shm;
+    uint64_t one = 1;
+
+    /* Requests that were parked complete from other workers than the one
+     * draining the ring */
+    pthread_mutex_lock(&client->lock);
+    ipc_ring_push(&shm->cq, slot);
+    pthread_mutex_unlock(&client->lock);
+
+    if (ipc_ring_wake(&shm->cq) && write(client->conn.cq_event, &one, sizeof(one)) == -1) {
+        perror("IPC shm completion event");
+    }
+}
+
+/* Has a worker run the request again */
+static void ipc_call_resume(struct ipc_call *call)
+{
+    uint64_t one = 1;
+    int first;
+
+    pthread_mutex_lock(&resume_lock);
+    first = list_empty(&resumed);
+    list_add_tail(&call->list, &resumed);
+    pthread_mutex_unlock(&resume_lock);
+
+    if (first && write(resume_event, &one, sizeof(one)) == -1) {
+        perror("IPC resume event");
+    }
+}
+
+/* Called by the stack as the socket a request parked on becomes ready */
+static void ipc_call_wake(struct socket_wait *wait)
+{
+    ipc_call_resume(list_entry(wait, struct ipc_call, wait));
+}
+
+/*
+ * Moves a request to the heap, where it stays until it is answered. It
+ * keeps the client and the buffer its payload is in meanwhile.
+ */
+static struct ipc_call *ipc_call_keep(struct ipc_call *call)
+{
+    struct ipc_call *kept;
+
+    if (call->parked) return call;
+
+    kept = malloc(sizeof(struct ipc_call));
+    *kept = *call;
+    kept->parked = 1;
+    kept->wait.wake = ipc_call_wake;
+
+    ipc_client_get(kept->client);
+    if (kept->buf) skb_buf_get(kept->buf);
+
+    return kept;
+}
+
+/* The socket fd a request is for, -1 if it is for none */
+static int ipc_call_sockfd(struct ipc_call *call)
+{
+    switch (call->msg->type) {
+    case IPC_CONNECT:
+    case IPC_WRITE:
+    case IPC_READ:
+    case IPC_CLOSE:
+    case IPC_SETSOCKOPT:
+    case IPC_GETSOCKOPT:
+    case IPC_BIND:
+    case IPC_LISTEN:
+    case IPC_ACCEPT:
+        /* The fd leads the payload of all of them */
+        return *(int *)call->msg->data;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Takes the request's socket for it to run on. Returns the request, or
+ * NULL if another request runs on the socket, behind which it is queued
+ * on the heap until that one hands the socket over.
+ */
+static struct ipc_call *ipc_call_enter(struct ipc_call *call)
+{
+    struct list_head *item;
+
+    list_init(&call->running);
+    list_init(&call->pending);
+    call->pid = call->msg->pid;
+    call->fd = ipc_call_sockfd(call);
+
+    if (call->fd < 0) return call;
+
+    pthread_mutex_lock(&running_lock);
+
+    list_for_each(item, &running) {
+        struct ipc_call *other = list_entry(item, struct ipc_call, running);
+
+        if (other->pid != call->pid || other->fd != call->fd) continue;
+
+        call = ipc_call_keep(call);
+        list_add_tail(&call->list, &other->pending);
+        pthread_mutex_unlock(&running_lock);
+
+        return NULL;
+    }
+
+    list_add_tail(&call->running, &running);
+    pthread_mutex_unlock(&running_lock);
+
+    return call;
+}
+
+/* Gives up the request's socket, to the request queued first behind it */
+static void ipc_call_leave(struct ipc_call *call)
+{
+    struct ipc_call *next = NULL;
+    struct list_head *item, *tmp;
+
+    call->owner = 0;
+
+    if (list_empty(&call->running)) return;
+
+    pthread_mutex_lock(&running_lock);
+
+    list_del(&call->running);
+    list_init(&call->running);
+
+    if (!list_empty(&call->pending)) {
+        next = list_first_entry(&call->pending, struct ipc_call, list);
+        list_del(&next->list);
+
+        /* The rest stays queued behind it */
+        list_init(&next->pending);
+        list_for_each_safe(item, tmp, &call->pending) {
+            list_del(item);
+            list_add_tail(item, &next->pending);
+        }
+
+        list_add_tail(&next->running, &running);
+        next->owner = 1;
+    }
+
+    pthread_mutex_unlock(&running_lock);
+
+    if (next) ipc_call_resume(next);
+}
+
+/*
+ * Runs a request until it is answered. A request whose socket is not
+ * ready is moved to the heap and parked on it, and a worker runs it again
+ * once the socket is woken. It leaves the socket to other requests while
+ * parked.
+ */
+static void ipc_call_run(struct ipc_call *call)
+{
+    if (!call->owner && (call = ipc_call_enter(call)) == NULL) return;
+
+    while (demux_ipc_call(&call->reply, call->msg, call->msglen, call->buf) == IPC_PARK) {
+        ipc_call_leave(call);
+
+        call = ipc_call_keep(call);
+        call->wait.events = call->reply.events;
+
+        /* Not ours anymore once parked, it may be running on another worker */
+        if (socket_park(call->msg->pid, call->reply.parkfd, &call->wait) == 0) return;
+
+        /* The socket was ready already, and its reference put */
+        call->wait.sock = NULL;
+
+        if ((call = ipc_call_enter(call)) == NULL) return;
+    }
+
+    ipc_call_leave(call);
+
+    if (call->slot >= 0) ipc_shm_complete(call->client, call->slot);
+
+    if (call->parked) {
+        if (call->buf) skb_buf_put(call->buf);
+        ipc_client_put(call->client);
+        free(call);
+    }
+}
+
+static void ipc_resume_calls()
+{
+    struct list_head calls, *item, *tmp;
+    uint64_t n;
+
+    if (read(resume_event, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        perror("IPC resume event");
+    }
+
+    list_init(&calls);
+
+    pthread_mutex_lock(&resume_lock);
+    list_for_each_safe(item, tmp, &resumed) {
+        list_del(item);
+        list_add_tail(item, &calls);
+    }
+    pthread_mutex_unlock(&resume_lock);
+
+    /* What is woken meanwhile goes to other workers */
+    ipc_arm(EPOLL_CTL_MOD, resume_event, &resume_ev);
+
+    list_for_each_safe(item, tmp, &calls) {
+        struct ipc_call *call = list_entry(item, struct ipc_call, list);
+
+        list_del(item);
+
+        /* The reference the socket was parked with, if it was woken */
+        if (call->wait.sock) socket_put(call->wait.sock);
+        call->wait.sock = NULL;
+
+        ipc_call_run(call);
+    }
+}
+
+static void ipc_shm_call(struct ipc_client *client, uint32_t slot)
+{
+    struct ipc_call call = {
+        .client = client,
+        .reply = {
+            .sockfd = -1,
+            .slot = client->conn.shm->slots[slot],
+            .size = IPC_SHM_SLOT_SIZE,
+        },
+        .msg = (struct ipc_msg *)client->conn.shm->slots[slot],
+        .msglen = IPC_SHM_SLOT_SIZE,
+        .slot = slot,
+    };
+
+    ipc_call_run(&call);
+}
+
+/*
+ * Drains a client's submission ring. The ring is polled for a while once
+ * empty, and only after it is marked idle is the eventfd armed again, so
+ * that the client signals what it submits from then on.
+ */
+static void ipc_shm_serve(struct ipc_client *client)
+{
+    struct ipc_shm *shm = client->conn.shm;
+    uint64_t n;
+    int slot, spin = 0, dead;
+
+    if (read(client->conn.sq_event, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+        perror("IPC shm submission event");
+    }
+
+    __atomic_store_n(&shm->sq.idle, 0, __ATOMIC_RELAXED);
+
+    for (;;) {
+        if ((slot = ipc_ring_pop(&shm->sq)) >= 0) {
+            if (slot < IPC_SHM_SLOTS) ipc_shm_call(client, slot);
+            spin = 0;
+            continue;
+        }
+
+        if (++spin < spins) {
+            ipc_cpu_relax();
+            continue;
+        }
+
+        if (ipc_ring_sleep(&shm->sq)) break;
+    }
+
+    /* A client that went away has its eventfd signaled to get here */
+    pthread_mutex_lock(&client->lock);
+    dead = client->dead;
+    if (!dead) ipc_arm(EPOLL_CTL_MOD, client->conn.sq_event, &client->sq_ev);
+    pthread_mutex_unlock(&client->lock);
+
+    if (dead) ipc_client_put(client);
+}
+
+/*
+ * The client closed its socket, most likely on exit. The sockets of its
+ * process are closed too, unless the process still has another client.
+ */
+static void ipc_client_close(struct ipc_client *client)
+{
+    struct list_head *item;
+    uint64_t one = 1;
+    int others = 0;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->sockfd, NULL);
+
+    pthread_mutex_lock(&client->lock);
+    client->dead = 1;
+    pthread_mutex_unlock(&client->lock);
+
+    if (client->conn.shm && write(client->conn.sq_event, &one, sizeof(one)) == -1) {
+        perror("IPC shm submission event");
+    }
+
+    pthread_mutex_lock(&clients_lock);
+
+    list_del(&client->list);
+
+    list_for_each(item, &clients) {
+        struct ipc_client *other = list_entry(item, struct ipc_client, list);
+
+        if (other->pid == client->pid) others = 1;
+    }
+
+    pthread_mutex_unlock(&clients_lock);
+
+    if (client->pid && !others) socket_close_pid(client->pid);
+
+    printf("socket ipc closed\n");
+
+    ipc_client_put(client);
+}
+
+/* Serves a request on the client's socket */
+static void ipc_client_recv(struct ipc_client *client)
+{
+    struct ipc_call call = {
+        .client = client,
+        .slot = -1,
+    };
+    struct ipc_msg *msg;
+    int fds[IPC_MAX_FDS], nfds;
+    uint64_t one = 1;
+    int rc;
+
+    /* Written payload may still wait for transmit in the buffer */
+    if (client->buf->refcnt > 1) {
+        skb_buf_put(client->buf);
+        client->buf = skb_buf_alloc(IPC_RECVLEN);
+    }
+
+    rc = ipc_recv(client->sockfd, client->buf, IPC_RECVLEN, fds, &nfds);
+
+    if (rc == -1 && (errno == EAGAIN || errno == EINTR)) goto rearm;
+
+    if (rc <= 0) {
+        if (rc == -1) perror("socket ipc read");
+
+        ipc_client_close(client);
+        return;
+    }
+
+    msg = (struct ipc_msg *)client->buf->data;
+
+    if (!client->pid) client->pid = msg->pid;
+
+    if (msg->type == IPC_SHM) {
+        call.reply.sockfd = client->sockfd;
+        ipc_shm_open(&call.reply, msg, fds, nfds, &client->conn);
+
+        /* Its ring has a registration of its own from now on. The ring
+         * is not idle yet, so its first submissions are not signaled. */
+        if (client->conn.shm) {
+            ipc_client_get(client);
+
+            if (write(client->conn.sq_event, &one, sizeof(one)) == -1 ||
+                ipc_arm(EPOLL_CTL_ADD, client->conn.sq_event, &client->sq_ev) < 0) {
+                ipc_client_put(client);
+            }
+        }
+
+        goto rearm;
+    }
+
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+
+    call.reply.sockfd = client->sockfd;
+    call.msg = msg;
+    call.msglen = rc;
+    call.buf = client->buf;
+
+    ipc_call_run(&call);
+
+rearm:
+    ipc_arm(EPOLL_CTL_MOD, client->sockfd, &client->ev);
+}
+
+static void ipc_accept_clients()
+{
+    struct ipc_client *client;
+    int sockfd;
+
+    while ((sockfd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+        client = calloc(1, sizeof(struct ipc_client));
+        client->ev.type = IPC_EV_CLIENT;
+        client->sq_ev.type = IPC_EV_SQ;
+        pthread_mutex_init(&client->lock, NULL);
+        client->refcnt = 1;
+        client->sockfd = sockfd;
+        client->buf = skb_buf_alloc(IPC_RECVLEN);
+
+        pthread_mutex_lock(&clients_lock);
+        list_add_tail(&client->list, &clients);
+        pthread_mutex_unlock(&clients_lock);
+
+        printf("socket ipc opened\n");
+
+        if (ipc_arm(EPOLL_CTL_ADD, sockfd, &client->ev) < 0) ipc_client_close(client);
+    }
+
+    if (errno != EAGAIN && errno != EINTR) perror("IPC accept");
+
+    ipc_arm(EPOLL_CTL_MOD, listen_fd, &listen_ev);
+}
+
+static void *ipc_worker(void *arg)
+{
+    struct epoll_event event;
+    struct ipc_event *ev;
+    int rc;
+
+    for (;;) {
+        /* Cancelled in between events only, with no request halfway */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        rc = epoll_wait(epfd, &event, 1, -1);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+
+            perror("IPC epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        ev = event.data.ptr;
+
+        switch (ev->type) {
+        case IPC_EV_LISTEN:
+            ipc_accept_clients();
+            break;
+        case IPC_EV_CLIENT:
+            ipc_client_recv(list_entry(ev, struct ipc_client, ev));
+            break;
+        case IPC_EV_SQ:
+            ipc_shm_serve(list_entry(ev, struct ipc_client, sq_ev));
+            break;
+        case IPC_EV_RESUME:
+            ipc_resume_calls();
+            break;
+        }
+    }
+
     return NULL;
 }
 
+static void ipc_stop_workers(void *arg)
+{
+    for (int i = 1; i < IPC_WORKERS; i++) {
+        pthread_cancel(workers[i]);
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/* Runs the first worker, the thread is cancelled to stop all of them */
 void *start_ipc_listener()
 {
-    int fd, rc, datasock;
+    int fd, rc;
     struct sockaddr_un un;
     char *sockname = "/tmp/lvlip.socket";
 
@@ -194,7 +1016,7 @@ void *start_ipc_listener()
         exit(-1);
     }
         
-    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("IPC listener UNIX socket");
         exit(EXIT_FAILURE);
     }
@@ -210,26 +1032,39 @@ void *start_ipc_listener()
         exit(EXIT_FAILURE);
     }
 
-    rc = listen(fd, 20);
+    /* Short-lived processes connect in bursts */
+    rc = listen(fd, SOMAXCONN);
 
     if (rc == -1) {
         perror("IPC listen");
         exit(EXIT_FAILURE);
     }
 
-    for (;;) {
-        datasock = accept(fd, NULL, NULL);
-        if (datasock == -1) {
-            perror("IPC accept");
-            exit(EXIT_FAILURE);
-        }
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        (resume_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("IPC epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    listen_fd = fd;
+    spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? IPC_SHM_SPIN : 0;
 
-        if (pthread_create(&sockets[cur_th++], NULL, &socket_ipc_open, &datasock) != 0) {
-            printf("Error on socket thread creation\n");
+    if (ipc_arm(EPOLL_CTL_ADD, listen_fd, &listen_ev) < 0 ||
+        ipc_arm(EPOLL_CTL_ADD, resume_event, &resume_ev) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < IPC_WORKERS; i++) {
+        if (pthread_create(&workers[i], NULL, &ipc_worker, NULL) != 0) {
+            print_err("Could not create IPC worker thread\n");
             exit(1);
-        };
+        }
     }
 
+    pthread_cleanup_push(ipc_stop_workers, NULL);
+    ipc_worker(NULL);
+    pthread_cleanup_pop(0);
+
     close(fd);
 
     unlink(sockname);
@@ -1,27 +1,35 @@
 #include "syshead.h"
 #include "basic.h"
 #include "cli.h"
-#include "tuntap_if.h"
 #include "utils.h"
 #include "ipc.h"
 #include "route.h"
 #include "ethernet.h"
 #include "arp.h"
 #include "tcp.h"
+#include "timer.h"
 #include "netdev.h"
 #include "ip.h"
+#include "skbuff.h"
+#include "shard.h"
+#include "inet.h"
+#include "epoch.h"
 
 #define MAX_CMD_LENGTH 6
 
 typedef void (*sighandler_t)(int);
 
-#define THREAD_CORE 0
-#define THREAD_IPC 1
-#define THREAD_SIGNAL 2
-static pthread_t threads[3];
+#define THREAD_IPC 0
+#define THREAD_SIGNAL 1
+#define THREAD_TX 2
+#define THREAD_TIMER 3
+#define THREAD_CORE 4 /* One rx thread per netdev queue, then the shards */
+static pthread_t threads[THREAD_CORE + NETDEV_MAX_QUEUES + SHARD_MAX];
 
 int running = 1;
 sigset_t mask;
+extern int netdev_queues;
+extern int shards;
 
 static void *stop_stack_handler(void *arg)
 {
@@ -38,8 +46,17 @@ static void *stop_stack_handler(void *arg)
         case SIGQUIT:
             running = 0;
             pthread_cancel(threads[THREAD_IPC]);
-            pthread_cancel(threads[THREAD_CORE]);
+            pthread_cancel(threads[THREAD_TX]);
+            pthread_cancel(threads[THREAD_TIMER]);
+            for (int i = 0; i < netdev_queues + shards; i++) {
+                pthread_cancel(threads[THREAD_CORE + i]);
+            }
             return 0;
+        case SIGUSR1:
+            skb_pool_dump();
+            tcp_mem_dump();
+            tcp_syncookie_dump();
+            break;
         default:
             printf("Unexpected signal %d\n", signo);
         }
@@ -53,6 +70,7 @@ static void init_signals()
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGUSR1);
 
     if ((err = pthread_sigmask(SIG_BLOCK, &mask, NULL)) != 0) {
         print_err("SIG_BLOCK error\n");
@@ -62,19 +80,45 @@ static void init_signals()
 
 static void init_stack()
 {
-    tun_init();
+    timers_init();
+    epoch_init();
     netdev_init();
     route_init();
     arp_init();
+    socket_init();
+    inet_hash_init();
     tcp_init();
+    shard_init();
 }
 
 static void run_threads()
 {
-    if (pthread_create(&threads[THREAD_CORE], NULL,
-                       netdev_rx_loop, NULL) != 0) {
-        print_err("Could not create netdev rx loop thread\n");
-        return; 
+    for (intptr_t i = 0; i < shards; i++) {
+        if (pthread_create(&threads[THREAD_CORE + netdev_queues + i], NULL,
+                           shard_loop, (void *)i) != 0) {
+            print_err("Could not create shard thread\n");
+            return;
+        }
+    }
+
+    for (intptr_t i = 0; i < netdev_queues; i++) {
+        if (pthread_create(&threads[THREAD_CORE + i], NULL,
+                           netdev_rx_loop, (void *)i) != 0) {
+            print_err("Could not create netdev rx loop thread\n");
+            return; 
+        }
+    }
+
+    if (pthread_create(&threads[THREAD_TX], NULL,
+                       netdev_tx_loop, NULL) != 0) {
+        print_err("Could not create netdev tx flush thread\n");
+        return;
+    }
+
+    if (pthread_create(&threads[THREAD_TIMER], NULL,
+                       timer_loop, NULL) != 0) {
+        print_err("Could not create timer thread\n");
+        return;
     }
 
     if (pthread_create(&threads[THREAD_IPC], NULL,
@@ -91,7 +135,7 @@ static void run_threads()
 
 static void wait_for_threads()
 {
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < THREAD_CORE + netdev_queues + shards; i++) {
         if (pthread_join(threads[i], NULL) != 0) {
             print_err("Error when joining threads\n");
             exit(1);
@@ -104,9 +148,14 @@ static void wait_for_threads()
 void free_stack()
 {
     free_sockets();
+    /* No thread is left to look sockets up */
+    epoch_drain();
     free_routes();
     free_netdev();
-    free_tun();
+    skb_pool_dump();
+    tcp_mem_dump();
+    tcp_syncookie_dump();
+    free_skb_pools();
 }
 
 int main(int argc, char** argv)
@@ -6,15 +6,29 @@
 #include "arp.h"
 #include "ip.h"
 #include "tuntap_if.h"
+#include "packet_if.h"
 #include "basic.h"
+#include "shard.h"
 
 struct netdev *loop;
 struct netdev *netdev;
 extern int running;
 
+extern char *netdev_driver;
+extern char *netdev_ifname;
+extern int netdev_queues;
+extern int netdev_offload;
+extern int netdev_mtu;
+extern int shards;
+
+static struct netdev_ops *drivers[] = {
+    &tap_ops,
+    &packet_ops,
+};
+
 static struct netdev *netdev_alloc(char *addr, char *hwaddr, uint32_t mtu)
 {
-    struct netdev *dev = malloc(sizeof(struct netdev));
+    struct netdev *dev = calloc(1, sizeof(struct netdev));
 
     dev->addr = ip_parse(addr);
 
@@ -27,20 +41,127 @@ static struct netdev *netdev_alloc(char *addr, char *hwaddr, uint32_t mtu)
 
     dev->addr_len = 6;
     dev->mtu = mtu;
+    dev->features = 0;
+    dev->queues = 1;
+    dev->ifname = NULL;
+    dev->ops = NULL;
+    dev->priv = NULL;
+
+    for (int i = 0; i < NETDEV_MAX_QUEUES; i++) {
+        pthread_mutex_init(&dev->txq[i].lock, NULL);
+    }
+
+    pthread_mutex_init(&dev->tx_lock, NULL);
+    pthread_cond_init(&dev->tx_kick, NULL);
 
     return dev;
 }
 
-void netdev_init(char *addr, char *hwaddr)
+static struct netdev_ops *netdev_find_driver(char *name)
+{
+    for (int i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++) {
+        if (strcmp(drivers[i]->name, name) == 0) return drivers[i];
+    }
+
+    return NULL;
+}
+
+void netdev_init()
+{
+    /* The loopback device only holds its address, it has no driver */
+    loop = netdev_alloc("127.0.0.1", "00:00:00:00:00:00", netdev_mtu);
+    netdev = netdev_alloc("10.0.0.4", "00:0c:29:6d:50:25", netdev_mtu);
+
+    if ((netdev->ops = netdev_find_driver(netdev_driver)) == NULL) {
+        print_err("No such netdev driver: %s\n", netdev_driver);
+        exit(1);
+    }
+
+    netdev->queues = netdev_queues;
+    netdev->ifname = netdev_ifname;
+
+    if (netdev_offload) {
+        netdev->features |= NETDEV_F_VNET_HDR;
+    }
+
+    if (netdev->ops->open(netdev) != 0) {
+        print_err("Could not open netdev with driver %s\n", netdev_driver);
+        exit(1);
+    }
+}
+
+static int netdev_tx_hist_bucket(int n)
 {
-    loop = netdev_alloc("127.0.0.1", "00:00:00:00:00:00", 1500);
-    netdev = netdev_alloc("10.0.0.4", "00:0c:29:6d:50:25", 1500);
+    int bucket = 0;
+
+    while (n >>= 1) bucket++;
+
+    return bucket < NETDEV_TX_HIST ? bucket : NETDEV_TX_HIST - 1;
+}
+
+/*
+ * Caller holds txq->lock, which also keeps the frames of a queue in order.
+ * Frames the driver cannot take yet stay at the head of the queue.
+ */
+static void netdev_txq_flush(struct netdev *dev, int queue)
+{
+    struct netdev_txq *txq = &dev->txq[queue];
+    int taken, dropped = 0;
+
+    if (txq->len == 0) return;
+
+    taken = dev->ops->tx_burst(dev, queue, txq->skbs, txq->len, &dropped);
+
+    if (dropped) {
+        print_err("Netdev dropped %d frames on queue %d\n", dropped, queue);
+        txq->dropped += dropped;
+    }
+
+    if (taken) {
+        txq->frames += taken;
+        txq->hist[netdev_tx_hist_bucket(taken)]++;
+    }
+
+    /* Frames written asynchronously are the driver's */
+    for (int i = 0; i < taken; i++) {
+        if (txq->skbs[i]) free_skb(txq->skbs[i]);
+    }
+
+    txq->len -= taken;
+    memmove(txq->skbs, txq->skbs + taken, txq->len * sizeof(struct sk_buff *));
+}
+
+void netdev_tx_flush(struct netdev *dev)
+{
+    int cancelstate;
+
+    /* Threads are cancelled on shutdown, which must not leave a queue locked */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+
+    for (int i = 0; i < dev->queues; i++) {
+        struct netdev_txq *txq = &dev->txq[i];
+
+        pthread_mutex_lock(&txq->lock);
+        netdev_txq_flush(dev, i);
+        pthread_mutex_unlock(&txq->lock);
+    }
+
+    pthread_setcancelstate(cancelstate, NULL);
 }
 
+/*
+ * Queues the skb on the device's transmit queue. The queue is flushed to the
+ * driver when it fills up, when the rx burst being processed ends or at the
+ * latest after NETDEV_TX_FLUSH_USECS by netdev_tx_loop. A queue the driver
+ * cannot drain drops what comes on top of it.
+ */
 int netdev_transmit(struct sk_buff *skb, uint8_t *dst_hw, uint16_t ethertype)
 {
     struct netdev *dev;
+    struct netdev_txq *txq;
     struct eth_hdr *hdr;
+    int queue;
+    int cancelstate;
     int ret = 0;
 
     dev = skb->dev;
@@ -55,14 +176,45 @@ int netdev_transmit(struct sk_buff *skb, uint8_t *dst_hw, uint16_t ethertype)
     eth_dbg("OUTPUT", hdr);
     hdr->ethertype = htons(ethertype);
 
-    ret = tun_write((char *)skb->data, skb->len);
+    if (skb->ip_summed == CHECKSUM_PARTIAL && !(dev->features & NETDEV_F_CSUM)) {
+        skb_checksum_help(skb);
+    }
+
+    /* Transmitting a flow on a fixed queue makes a multi-queue tap device
+     * steer the flow's incoming frames to the same queue and rx thread */
+    queue = skb->hash % dev->queues;
+    txq = &dev->txq[queue];
+    ret = skb->len;
 
-    free_skb(skb);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+    pthread_mutex_lock(&txq->lock);
+
+    /* Frames the driver left in a full queue get another chance first */
+    if (txq->len == NETDEV_TX_BATCH) netdev_txq_flush(dev, queue);
+
+    if (txq->len == NETDEV_TX_BATCH) {
+        txq->dropped++;
+        free_skb(skb);
+        ret = -1;
+    } else {
+        txq->skbs[txq->len++] = skb;
+
+        if (txq->len == NETDEV_TX_BATCH) {
+            netdev_txq_flush(dev, queue);
+        } else if (txq->len == 1) {
+            pthread_mutex_lock(&dev->tx_lock);
+            pthread_cond_signal(&dev->tx_kick);
+            pthread_mutex_unlock(&dev->tx_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&txq->lock);
+    pthread_setcancelstate(cancelstate, NULL);
 
     return ret;
 }
 
-static int netdev_receive(struct sk_buff *skb)
+int netdev_receive(struct sk_buff *skb)
 {
     struct eth_hdr *hdr = eth_hdr(skb);
 
@@ -85,18 +237,64 @@ static int netdev_receive(struct sk_buff *skb)
     return 0;
 }
 
-void *netdev_rx_loop()
+void *netdev_rx_loop(void *arg)
 {
+    int queue = (intptr_t)arg;
+    struct sk_buff *skbs[NETDEV_RX_BURST];
+    int n;
+
     while (running) {
-        struct sk_buff *skb = alloc_skb(BUFLEN);
-        
-        if (tun_read((char *)skb->data, BUFLEN) < 0) { 
-            perror("ERR: Read from tun_fd");
-            free_skb(skb);
+        if ((n = netdev->ops->rx_burst(netdev, queue, skbs, NETDEV_RX_BURST)) < 0) {
+            perror("ERR: Read from netdev");
             return NULL;
         }
 
-        netdev_receive(skb);
+        /* TCP frames go to the shard owning their connection */
+        if (shards) {
+            n = shard_rx_burst(skbs, n);
+        }
+
+        for (int i = 0; i < n; i++) {
+            netdev_receive(skbs[i]);
+        }
+
+        /* Replies to the burst leave together */
+        netdev_tx_flush(netdev);
+    }
+
+    return NULL;
+}
+
+static int netdev_tx_pending(struct netdev *dev)
+{
+    for (int i = 0; i < dev->queues; i++) {
+        if (dev->txq[i].len) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Flushes frames that were queued outside of an rx burst, e.g. by
+ * application writes, after giving them a moment to batch up.
+ */
+void *netdev_tx_loop(void *arg)
+{
+    struct netdev *dev = netdev;
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = NETDEV_TX_FLUSH_USECS * 1000 };
+
+    while (running) {
+        pthread_mutex_lock(&dev->tx_lock);
+        pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &dev->tx_lock);
+
+        while (!netdev_tx_pending(dev)) {
+            pthread_cond_wait(&dev->tx_kick, &dev->tx_lock);
+        }
+
+        pthread_cleanup_pop(1);
+
+        nanosleep(&delay, NULL);
+        netdev_tx_flush(dev);
     }
 
     return NULL;
@@ -111,8 +309,26 @@ struct netdev* netdev_get(uint32_t sip)
     }
 }
 
+static void netdev_tx_dump(struct netdev *dev)
+{
+    for (int i = 0; i < dev->queues; i++) {
+        struct netdev_txq *txq = &dev->txq[i];
+
+        print_debug("NETDEV: txq %d: %lu frames, %lu dropped, batches", i,
+                    txq->frames, txq->dropped);
+
+        for (int b = 0; b < NETDEV_TX_HIST; b++) {
+            print_debug(" %d+: %lu", 1 << b, txq->hist[b]);
+        }
+
+        print_debug("\n");
+    }
+}
+
 void free_netdev()
 {
+    netdev_tx_dump(netdev);
+    netdev->ops->close(netdev);
     free(loop);
     free(netdev);
 }
@@ -0,0 +1,343 @@
+#include "syshead.h"
+#include "utils.h"
+#include "basic.h"
+#include "netdev.h"
+#include "skbuff.h"
+#include "packet_if.h"
+#include <linux/if_packet.h>
+#include <sys/mman.h>
+
+/*
+ * AF_PACKET driver over PACKET_MMAP TPACKET_V3 rings, meant to be bound to
+ * one end of a veth pair. Received frames are picked from the shared RX
+ * ring without a syscall, and transmitted frames are placed on the shared
+ * TX ring and handed to the kernel with a single send per burst.
+ *
+ * See https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
+ */
+
+#define PACKET_BLOCK_SIZE (1 << 18)
+#define PACKET_MIN_FRAME_SIZE 2048
+#define PACKET_RX_BLOCKS 64
+#define PACKET_TX_BLOCKS 16
+#define PACKET_RX_RETIRE_MS 1
+
+/* TX frame data starts right after the aligned frame header */
+#define PACKET_TX_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct packet_queue {
+    int fd;
+    uint8_t *map;
+    size_t maplen;
+    struct tpacket_req3 rxreq;
+    struct tpacket_req3 txreq;
+
+    /* RX ring block being consumed */
+    unsigned int rx_block;
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *ppd;
+    uint32_t left;
+
+    unsigned int tx_frame;
+    pthread_mutex_t tx_lock;
+};
+
+struct packet_priv {
+    int ifindex;
+    struct packet_queue queues[NETDEV_MAX_QUEUES];
+};
+
+static int packet_ifindex(int fd, char *ifname)
+{
+    struct ifreq ifr;
+
+    CLEAR(ifr);
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        perror("ERR: Could not get packet interface index");
+        return -1;
+    }
+
+    return ifr.ifr_ifindex;
+}
+
+/* TX ring slots are fixed size, so they are made to fit a full MTU frame */
+static unsigned int packet_frame_size(struct netdev *dev)
+{
+    unsigned int size = PACKET_MIN_FRAME_SIZE;
+
+    while (size < PACKET_TX_DATA_OFF + netdev_frame_len(dev)) size <<= 1;
+
+    return size;
+}
+
+static void packet_ring_req(struct tpacket_req3 *req, unsigned int blocks,
+                            unsigned int frame_size)
+{
+    memset(req, 0, sizeof(struct tpacket_req3));
+
+    req->tp_block_size = PACKET_BLOCK_SIZE;
+    req->tp_block_nr = blocks;
+    req->tp_frame_size = frame_size;
+    req->tp_frame_nr = (PACKET_BLOCK_SIZE / frame_size) * blocks;
+}
+
+static int packet_queue_open(struct netdev *dev, struct packet_queue *q)
+{
+    struct packet_priv *priv = dev->priv;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    int version = TPACKET_V3;
+
+    if ((q->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+        perror("ERR: Could not open packet socket");
+        return -1;
+    }
+
+    if (setsockopt(q->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("ERR: Could not set TPACKET_V3");
+        return -1;
+    }
+
+    packet_ring_req(&q->rxreq, PACKET_RX_BLOCKS, packet_frame_size(dev));
+    q->rxreq.tp_retire_blk_tov = PACKET_RX_RETIRE_MS;
+
+    /* Block transmit is not supported by TPACKET_V3, so the TX ring is
+     * used frame by frame and must not ask for block retiring */
+    packet_ring_req(&q->txreq, PACKET_TX_BLOCKS, packet_frame_size(dev));
+
+    if (setsockopt(q->fd, SOL_PACKET, PACKET_RX_RING, &q->rxreq, sizeof(q->rxreq)) < 0 ||
+        setsockopt(q->fd, SOL_PACKET, PACKET_TX_RING, &q->txreq, sizeof(q->txreq)) < 0) {
+        perror("ERR: Could not set up packet rings");
+        return -1;
+    }
+
+    /* RX ring is mapped first, the TX ring follows it */
+    q->maplen = (size_t)PACKET_BLOCK_SIZE * (PACKET_RX_BLOCKS + PACKET_TX_BLOCKS);
+    q->map = mmap(NULL, q->maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  q->fd, 0);
+
+    if (q->map == MAP_FAILED) {
+        perror("ERR: Could not mmap packet rings");
+        return -1;
+    }
+
+    CLEAR(sll);
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = priv->ifindex;
+
+    if (bind(q->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        perror("ERR: Could not bind packet socket");
+        return -1;
+    }
+
+    /* Our hardware address is not the one of the interface */
+    CLEAR(mreq);
+    mreq.mr_ifindex = priv->ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+
+    if (setsockopt(q->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("ERR: Could not set packet interface promiscuous");
+        return -1;
+    }
+
+    /* Spread flows over the queues by their hash, like a multi-queue NIC */
+    if (dev->queues > 1) {
+        int fanout = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+
+        if (setsockopt(q->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+            perror("ERR: Could not join packet fanout group");
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&q->tx_lock, NULL);
+
+    return 0;
+}
+
+static void packet_close(struct netdev *dev)
+{
+    struct packet_priv *priv = dev->priv;
+
+    for (int i = 0; i < dev->queues; i++) {
+        struct packet_queue *q = &priv->queues[i];
+
+        if (q->map && q->map != MAP_FAILED) munmap(q->map, q->maplen);
+        if (q->fd > 0) close(q->fd);
+    }
+
+    free(priv);
+    dev->priv = NULL;
+}
+
+static int packet_open(struct netdev *dev)
+{
+    struct packet_priv *priv;
+    int fd, ifindex;
+
+    if (!dev->ifname) {
+        print_err("Packet driver needs an interface to bind to\n");
+        return -1;
+    }
+
+    if (dev->features) {
+        print_err("Packet driver does not support offloads, disabling them\n");
+        dev->features = 0;
+    }
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("ERR: Could not open ioctl socket");
+        return -1;
+    }
+
+    ifindex = packet_ifindex(fd, dev->ifname);
+    close(fd);
+
+    if (ifindex < 0) return -1;
+
+    priv = calloc(1, sizeof(struct packet_priv));
+    priv->ifindex = ifindex;
+    dev->priv = priv;
+
+    /* The peer end of the link has to agree on the MTU */
+    if (run_cmd("ip link set dev %s mtu %u", dev->ifname, dev->mtu) != 0) {
+        print_err("ERROR when setting mtu for if\n");
+    }
+
+    if (run_cmd("ip link set dev %s up", dev->ifname) != 0) {
+        print_err("ERROR when setting up if\n");
+    }
+
+    for (int i = 0; i < dev->queues; i++) {
+        if (packet_queue_open(dev, &priv->queues[i]) != 0) {
+            print_err("ERROR when opening packet queue %d\n", i);
+            /* Unmaps and closes the queues opened so far */
+            packet_close(dev);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static struct tpacket_block_desc *packet_rx_block(struct packet_queue *q, unsigned int i)
+{
+    return (struct tpacket_block_desc *)(q->map + (size_t)i * q->rxreq.tp_block_size);
+}
+
+static struct tpacket3_hdr *packet_tx_frame(struct packet_queue *q, unsigned int i)
+{
+    uint8_t *ring = q->map + (size_t)q->rxreq.tp_block_size * q->rxreq.tp_block_nr;
+
+    return (struct tpacket3_hdr *)(ring + (size_t)i * q->txreq.tp_frame_size);
+}
+
+static int packet_rx_burst(struct netdev *dev, int queue, struct sk_buff **skbs, int n)
+{
+    struct packet_priv *priv = dev->priv;
+    struct packet_queue *q = &priv->queues[queue];
+    struct pollfd pfd = { .fd = q->fd, .events = POLLIN | POLLERR };
+    int count = 0;
+
+    while (count < n) {
+        if (!q->block) {
+            struct tpacket_block_desc *bd = packet_rx_block(q, q->rx_block);
+
+            if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+                if (count) break;
+
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+                continue;
+            }
+
+            q->block = bd;
+            q->left = bd->hdr.bh1.num_pkts;
+            q->ppd = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        }
+
+        while (q->left && count < n) {
+            struct tpacket3_hdr *ppd = q->ppd;
+            struct sockaddr_ll *sll = (struct sockaddr_ll *)
+                ((uint8_t *)ppd + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+            /* Our own transmissions are looped back to the socket. Frames
+             * aggregated by GRO on the interface can exceed the MTU. */
+            if (sll->sll_pkttype != PACKET_OUTGOING && ppd->tp_snaplen <= GSO_BUFLEN) {
+                struct sk_buff *skb = alloc_skb(ppd->tp_snaplen > netdev_frame_len(dev) ?
+                                                ppd->tp_snaplen : netdev_frame_len(dev));
+
+                memcpy(skb->data, (uint8_t *)ppd + ppd->tp_mac, ppd->tp_snaplen);
+                skb->len = ppd->tp_snaplen;
+                skbs[count++] = skb;
+            }
+
+            q->ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+            q->left--;
+        }
+
+        if (!q->left) {
+            /* Hand the whole block back to the kernel */
+            __atomic_store_n(&q->block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                             __ATOMIC_RELEASE);
+            q->block = NULL;
+            q->rx_block = (q->rx_block + 1) % q->rxreq.tp_block_nr;
+        }
+    }
+
+    return count;
+}
+
+static int packet_tx_burst(struct netdev *dev, int queue, struct sk_buff **skbs, int n,
+                           int *dropped)
+{
+    struct packet_priv *priv = dev->priv;
+    struct packet_queue *q = &priv->queues[queue];
+    int count;
+
+    pthread_mutex_lock(&q->tx_lock);
+
+    for (count = 0; count < n; count++) {
+        struct tpacket3_hdr *hdr = packet_tx_frame(q, q->tx_frame);
+        struct sk_buff *skb = skbs[count];
+
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+            (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+            /* Ring is full */
+            break;
+        }
+
+        if (skb->len > q->txreq.tp_frame_size - PACKET_TX_DATA_OFF) {
+            /* Taken, but never sent */
+            print_err("Frame of %u bytes does not fit the packet TX ring\n", skb->len);
+            (*dropped)++;
+            continue;
+        }
+
+        skb_copy_data(skb, (uint8_t *)hdr + PACKET_TX_DATA_OFF);
+        hdr->tp_len = skb->len;
+        hdr->tp_next_offset = 0;
+
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        q->tx_frame = (q->tx_frame + 1) % q->txreq.tp_frame_nr;
+    }
+
+    if (count > *dropped && sendto(q->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN) {
+        perror("ERR: Packet TX ring kick");
+    }
+
+    pthread_mutex_unlock(&q->tx_lock);
+
+    return count;
+}
+
+struct netdev_ops packet_ops = {
+    .name = "packet",
+    .open = &packet_open,
+    .rx_burst = &packet_rx_burst,
+    .tx_burst = &packet_tx_burst,
+    .close = &packet_close,
+};
@@ -0,0 +1,254 @@
+#include "syshead.h"
+#include "utils.h"
+#include "shard.h"
+#include "netdev.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "inet.h"
+
+extern int running;
+extern int shards;
+extern struct netdev *netdev;
+
+static struct shard shard_table[SHARD_MAX];
+static __thread int shard_self = -1;
+
+/* Request run on a shard on behalf of another thread, which waits for it */
+struct shard_call {
+    struct list_head list;
+    int (*fn) (void *arg);
+    void *arg;
+    int rc;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+};
+
+void shard_init()
+{
+    for (int i = 0; i < shards; i++) {
+        struct shard *s = &shard_table[i];
+
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->kick, NULL);
+        list_init(&s->rxq);
+        list_init(&s->calls);
+        list_init(&s->works);
+    }
+}
+
+int shard_of(uint32_t hash)
+{
+    return shards ? hash % shards : -1;
+}
+
+/* Owning shard of a received frame, or -1 for frames processed in place */
+static int shard_of_frame(struct sk_buff *skb)
+{
+    struct eth_hdr *eh = (struct eth_hdr *)skb->data;
+    uint8_t *ip = eh->payload;
+    int ihl;
+
+    /* Headers are still in network byte order here */
+    if (skb->len < ETH_HDR_LEN + IP_HDR_LEN) return -1;
+    if (ntohs(eh->ethertype) != ETH_P_IP) return -1;
+
+    /* Left to the IP layer to drop */
+    if ((ip[0] >> 4) != 4 || (ihl = (ip[0] & 0x0f) * 4) < IP_HDR_LEN) return -1;
+    if (ip[9] != IP_TCP) return -1;
+    if (skb->len < ETH_HDR_LEN + ihl + 4) return -1;
+
+    uint8_t *th = ip + ihl;
+
+    /* The local end is the destination of a received frame */
+    return shard_of(inet_flow_hash(ntohl(*(uint32_t *)(ip + 16)),
+                                   ntohl(*(uint32_t *)(ip + 12)),
+                                   ntohs(*(uint16_t *)(th + 2)),
+                                   ntohs(*(uint16_t *)th)));
+}
+
+/*
+ * Hands the TCP frames of an rx burst to their shards, taking each shard's
+ * lock once. The remaining frames are moved to the front of skbs for the
+ * caller to process, and their count is returned.
+ */
+int shard_rx_burst(struct sk_buff **skbs, int n)
+{
+    struct list_head steered[SHARD_MAX];
+    int left = 0;
+
+    for (int i = 0; i < shards; i++) {
+        list_init(&steered[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int shard = shard_of_frame(skbs[i]);
+
+        if (shard < 0) {
+            skbs[left++] = skbs[i];
+        } else {
+            list_add_tail(&skbs[i]->list, &steered[shard]);
+        }
+    }
+
+    for (int i = 0; i < shards; i++) {
+        struct shard *s = &shard_table[i];
+
+        if (list_empty(&steered[i])) continue;
+
+        pthread_mutex_lock(&s->lock);
+
+        /* Splice the burst onto the shard's queue */
+        s->rxq.prev->next = steered[i].next;
+        steered[i].next->prev = s->rxq.prev;
+        steered[i].prev->next = &s->rxq;
+        s->rxq.prev = steered[i].prev;
+
+        pthread_cond_signal(&s->kick);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return left;
+}
+
+/*
+ * Runs fn on the given shard and returns its result. Runs it in place when
+ * sharding is off, on the shard itself, or once the stack is stopping.
+ */
+int shard_run(int shard, int (*fn) (void *arg), void *arg)
+{
+    struct shard_call call;
+    struct shard *s;
+
+    if (shard < 0 || shard == shard_self || !running) return fn(arg);
+
+    s = &shard_table[shard];
+
+    call.fn = fn;
+    call.arg = arg;
+    call.done = 0;
+    pthread_mutex_init(&call.lock, NULL);
+    pthread_cond_init(&call.done_cond, NULL);
+
+    pthread_mutex_lock(&s->lock);
+    list_add_tail(&call.list, &s->calls);
+    pthread_cond_signal(&s->kick);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&call.lock);
+    while (!call.done) {
+        pthread_cond_wait(&call.done_cond, &call.lock);
+    }
+    pthread_mutex_unlock(&call.lock);
+
+    pthread_cond_destroy(&call.done_cond);
+    pthread_mutex_destroy(&call.lock);
+
+    return call.rc;
+}
+
+void shard_work_init(struct shard_work *work, void (*fn) (struct shard_work *work))
+{
+    list_init(&work->list);
+    work->fn = fn;
+    work->pending = 0;
+}
+
+/*
+ * Queues work on the given shard and returns 0, or 1 if it was queued
+ * already. Runs it in place when sharding is off, on the shard itself, or
+ * once the stack is stopping.
+ */
+int shard_post(int shard, struct shard_work *work)
+{
+    struct shard *s;
+
+    if (shard < 0 || shard == shard_self || !running) {
+        work->fn(work);
+        return 0;
+    }
+
+    if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL)) return 1;
+
+    s = &shard_table[shard];
+
+    pthread_mutex_lock(&s->lock);
+    list_add_tail(&work->list, &s->works);
+    pthread_cond_signal(&s->kick);
+    pthread_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+static void shard_unlock(void *arg)
+{
+    pthread_mutex_unlock(arg);
+}
+
+void *shard_loop(void *arg)
+{
+    struct shard *s = &shard_table[(intptr_t)arg];
+    struct list_head rxq, calls, works;
+    struct list_head *item, *tmp;
+
+    shard_self = (intptr_t)arg;
+
+    while (running) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cleanup_push(shard_unlock, &s->lock);
+
+        while (list_empty(&s->rxq) && list_empty(&s->calls) && list_empty(&s->works)) {
+            pthread_cond_wait(&s->kick, &s->lock);
+        }
+
+        /* Take over everything queued so far and let producers go on */
+        list_init(&rxq);
+        list_init(&calls);
+        list_init(&works);
+        list_for_each_safe(item, tmp, &s->rxq) {
+            list_del(item);
+            list_add_tail(item, &rxq);
+        }
+        list_for_each_safe(item, tmp, &s->calls) {
+            list_del(item);
+            list_add_tail(item, &calls);
+        }
+        list_for_each_safe(item, tmp, &s->works) {
+            list_del(item);
+            list_add_tail(item, &works);
+        }
+
+        pthread_cleanup_pop(1);
+
+        list_for_each_safe(item, tmp, &rxq) {
+            list_del(item);
+            netdev_receive(list_entry(item, struct sk_buff, list));
+        }
+
+        list_for_each_safe(item, tmp, &calls) {
+            struct shard_call *call = list_entry(item, struct shard_call, list);
+
+            list_del(item);
+            call->rc = call->fn(call->arg);
+
+            pthread_mutex_lock(&call->lock);
+            call->done = 1;
+            pthread_cond_signal(&call->done_cond);
+            pthread_mutex_unlock(&call->lock);
+        }
+
+        list_for_each_safe(item, tmp, &works) {
+            struct shard_work *work = list_entry(item, struct shard_work, list);
+
+            list_del(item);
+            /* Cleared first, the work may post itself again */
+            __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+            work->fn(work);
+        }
+
+        /* Replies to the batch leave together */
+        netdev_tx_flush(netdev);
+    }
+
+    return NULL;
+}
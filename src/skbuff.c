@@ -1,14 +1,221 @@
 #include "syshead.h"
 #include "skbuff.h"
 #include "list.h"
+#include "utils.h"
+
+/*
+ * sk_buffs are carved from per-thread pools. The struct and its data buffer
+ * live in one allocation, and freed buffers go back to the pool that
+ * allocated them for reuse by its next alloc_skb of the same size class.
+ * Buffers freed on other threads, such as received data that a reader
+ * consumed, are pushed on the owner's lock-free return stack, which the
+ * owner drains once its free list runs dry.
+ */
+
+static const unsigned int skb_class_size[SKB_POOL_CLASSES] = {
+    [SKB_POOL_SMALL] = 256,
+    [SKB_POOL_MTU] = 2048,
+    [SKB_POOL_JUMBO] = 9216 + 128,
+    [SKB_POOL_GSO] = 65536 + 128,
+};
+
+static const unsigned int skb_class_depth[SKB_POOL_CLASSES] = {
+    [SKB_POOL_SMALL] = 256,
+    [SKB_POOL_MTU] = 256,
+    [SKB_POOL_JUMBO] = 64,
+    [SKB_POOL_GSO] = 16,
+};
+
+/*
+ * A pool outlives its thread, skbs it allocated may still be around. It is
+ * taken over by the next thread that needs a pool.
+ */
+struct skb_pool {
+    struct list_head list;
+    struct list_head free[SKB_POOL_CLASSES];
+    uint32_t nfree[SKB_POOL_CLASSES];
+    /* skbs returned by other threads, linked through list.next */
+    struct list_head *remote;
+    int owned; /* By a thread, guarded by pools_lock */
+    struct skb_pool_stats stats; /* Written by the owner only */
+};
+
+static LIST_HEAD(pools);
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+/* Counters that free_skb_pools() took out of the pools */
+static struct skb_pool_stats retired;
+static __thread struct skb_pool *local_pool;
+
+/* Single writer, but read from other threads */
+static inline void skb_stat_inc(uint64_t *counter)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+}
+
+/* Called on any thread but the pool's owner */
+static void skb_pool_return(struct skb_pool *pool, struct sk_buff *skb)
+{
+    struct list_head *head = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+
+    do {
+        skb->list.next = head;
+    } while (!__atomic_compare_exchange_n(&pool->remote, &head, &skb->list, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Moves what other threads returned to the free lists, as deep as they go */
+static void skb_pool_reclaim(struct skb_pool *pool)
+{
+    struct list_head *item = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (item) {
+        struct sk_buff *skb = list_entry(item, struct sk_buff, list);
+        uint8_t cls = skb->pool;
+
+        item = item->next;
+
+        if (pool->nfree[cls] >= skb_class_depth[cls]) {
+            free(skb);
+            continue;
+        }
+
+        list_add(&skb->list, &pool->free[cls]);
+        pool->nfree[cls]++;
+    }
+}
+
+static void skb_pool_drain(struct skb_pool *pool)
+{
+    struct list_head *item, *tmp;
+
+    skb_pool_reclaim(pool);
+
+    for (int i = 0; i < SKB_POOL_CLASSES; i++) {
+        list_for_each_safe(item, tmp, &pool->free[i]) {
+            list_del(item);
+            free(list_entry(item, struct sk_buff, list));
+        }
+
+        pool->nfree[i] = 0;
+    }
+}
+
+static void skb_stats_add(struct skb_pool_stats *dst, struct skb_pool_stats *src)
+{
+    for (int i = 0; i < SKB_POOL_CLASSES; i++) {
+        dst->hits[i] += __atomic_load_n(&src->hits[i], __ATOMIC_RELAXED);
+        dst->misses[i] += __atomic_load_n(&src->misses[i], __ATOMIC_RELAXED);
+    }
+
+    dst->oversize += __atomic_load_n(&src->oversize, __ATOMIC_RELAXED);
+}
+
+static void skb_pool_release(void *arg)
+{
+    struct skb_pool *pool = arg;
+
+    skb_pool_drain(pool);
+
+    pthread_mutex_lock(&pools_lock);
+    pool->owned = 0;
+    pthread_mutex_unlock(&pools_lock);
+
+    local_pool = NULL;
+}
+
+static void skb_pool_key_init()
+{
+    pthread_key_create(&pool_key, skb_pool_release);
+}
+
+static struct skb_pool *skb_pool_get()
+{
+    struct skb_pool *pool = local_pool;
+    struct list_head *item;
+
+    if (pool) return pool;
+
+    pthread_once(&pool_key_once, skb_pool_key_init);
+
+    pthread_mutex_lock(&pools_lock);
+
+    /* Take over the pool of a thread that exited */
+    list_for_each(item, &pools) {
+        struct skb_pool *p = list_entry(item, struct skb_pool, list);
+
+        if (!p->owned) {
+            pool = p;
+            break;
+        }
+    }
+
+    if (!pool) {
+        pool = calloc(1, sizeof(struct skb_pool));
+
+        for (int i = 0; i < SKB_POOL_CLASSES; i++) {
+            list_init(&pool->free[i]);
+        }
+
+        list_add_tail(&pool->list, &pools);
+    }
+
+    pool->owned = 1;
+    pthread_mutex_unlock(&pools_lock);
+
+    pthread_setspecific(pool_key, pool);
+    local_pool = pool;
+
+    return pool;
+}
+
+static uint8_t skb_size_class(unsigned int size)
+{
+    for (uint8_t i = 0; i < SKB_POOL_CLASSES; i++) {
+        if (size <= skb_class_size[i]) return i;
+    }
+
+    return SKB_POOL_NONE;
+}
 
 struct sk_buff *alloc_skb(unsigned int size)
 {
-    struct sk_buff *skb = malloc(sizeof(struct sk_buff));
+    struct skb_pool *pool = skb_pool_get();
+    uint8_t cls = skb_size_class(size);
+    unsigned int bufsize = size;
+    struct sk_buff *skb;
+
+    if (cls != SKB_POOL_NONE && list_empty(&pool->free[cls]) &&
+        __atomic_load_n(&pool->remote, __ATOMIC_RELAXED)) {
+        skb_pool_reclaim(pool);
+    }
+
+    if (cls == SKB_POOL_NONE) {
+        skb = malloc(sizeof(struct sk_buff) + size);
+        skb_stat_inc(&pool->stats.oversize);
+    } else if (!list_empty(&pool->free[cls])) {
+        skb = list_first_entry(&pool->free[cls], struct sk_buff, list);
+        list_del(&skb->list);
+        pool->nfree[cls]--;
+        skb_stat_inc(&pool->stats.hits[cls]);
+        bufsize = skb_class_size[cls];
+    } else {
+        bufsize = skb_class_size[cls];
+        skb = malloc(sizeof(struct sk_buff) + bufsize);
+        skb_stat_inc(&pool->stats.misses[cls]);
+    }
 
     memset(skb, 0, sizeof(struct sk_buff));
-    skb->data = malloc(size);
-    memset(skb->data, 0, size);
+    skb->pool = cls;
+    skb->owner = pool;
+    skb->size = bufsize;
+
+    skb->data = (uint8_t *)(skb + 1);
+    /* Payload is always overwritten by its producer, only zero headers */
+    memset(skb->data, 0, size < SKB_HDR_ROOM ? size : SKB_HDR_ROOM);
     
     skb->head = skb->data;
     skb->tail = skb->data;
@@ -21,8 +228,30 @@ struct sk_buff *alloc_skb(unsigned int size)
 
 void free_skb(struct sk_buff *skb)
 {
-    free(skb->head);
-    free(skb);
+    struct skb_pool *pool = skb->owner;
+    uint8_t cls = skb->pool;
+
+    for (int i = 0; i < skb->nr_frags; i++) {
+        skb_buf_put(skb->frags[i].buf);
+    }
+
+    if (cls == SKB_POOL_NONE) {
+        free(skb);
+        return;
+    }
+
+    if (pool != local_pool) {
+        skb_pool_return(pool, skb);
+        return;
+    }
+
+    if (pool->nfree[cls] >= skb_class_depth[cls]) {
+        free(skb);
+        return;
+    }
+
+    list_add(&skb->list, &pool->free[cls]);
+    pool->nfree[cls]++;
 }
 
 void *skb_reserve(struct sk_buff *skb, unsigned int len)
@@ -41,7 +270,248 @@ uint8_t *skb_push(struct sk_buff *skb, unsigned int len)
     return skb->data;
 }
 
+/* Extends the linear part at its tail, returns where the new bytes go */
+uint8_t *skb_put(struct sk_buff *skb, unsigned int len)
+{
+    uint8_t *tmp = skb->tail;
+
+    skb->tail += len;
+    skb->len += len;
+
+    return tmp;
+}
+
 uint8_t *skb_head(struct sk_buff *skb)
 {
     return skb->head;
 }
+
+/*
+ * Completes a CHECKSUM_PARTIAL checksum in software, for devices that
+ * cannot offload it. The checksum field already holds the pseudo-header sum.
+ */
+void skb_checksum_help(struct sk_buff *skb)
+{
+    uint8_t *start = skb->head + skb->csum_start;
+    uint16_t *csum = (uint16_t *)(start + skb->csum_offset);
+    int len = skb->data + skb_headlen(skb) - start;
+    uint32_t sum = sum_every_16bits(start, len);
+
+    for (int i = 0; i < skb->nr_frags; i++) {
+        uint32_t fsum = sum_every_16bits(skb->frags[i].data, skb->frags[i].len);
+
+        while (fsum >> 16) fsum = (fsum & 0xffff) + (fsum >> 16);
+
+        /* A fragment starting at an odd offset has its bytes swapped */
+        if (len & 1) fsum = ((fsum & 0xff) << 8) | (fsum >> 8);
+
+        sum += fsum;
+        len += skb->frags[i].len;
+    }
+
+    *csum = checksum(NULL, 0, sum);
+    skb->ip_summed = CHECKSUM_NONE;
+}
+
+/*
+ * Copy of an skb that shares its fragments. Only the skb's own buffer is
+ * duplicated, so that the original can be transmitted again later.
+ */
+struct sk_buff *skb_copy(struct sk_buff *skb)
+{
+    unsigned int size = skb->end - skb->head;
+    struct sk_buff *n = alloc_skb(size);
+
+    memcpy(n->head, skb->head, size);
+
+    n->rt = skb->rt;
+    n->dev = skb->dev;
+    n->protocol = skb->protocol;
+    n->hash = skb->hash;
+    n->ip_summed = skb->ip_summed;
+    n->csum_start = skb->csum_start;
+    n->csum_offset = skb->csum_offset;
+    n->gso_size = skb->gso_size;
+    n->len = skb->len;
+    n->data_len = skb->data_len;
+    n->dlen = skb->dlen;
+    n->seq = skb->seq;
+    n->end_seq = skb->end_seq;
+    n->sacked = skb->sacked;
+    n->data = n->head + (skb->data - skb->head);
+    n->tail = n->head + (skb->tail - skb->head);
+    n->payload = skb->payload ? n->head + (skb->payload - skb->head) : NULL;
+
+    for (int i = 0; i < skb->nr_frags; i++) {
+        n->frags[i] = skb->frags[i];
+        skb_buf_get(n->frags[i].buf);
+    }
+
+    n->nr_frags = skb->nr_frags;
+
+    return n;
+}
+
+/*
+ * Appends payload that lives in buf as a fragment, without copying it.
+ * The skb holds a reference on buf until it is freed.
+ */
+int skb_add_frag(struct sk_buff *skb, struct skb_buf *buf, const void *data, uint32_t len)
+{
+    struct skb_frag *frag;
+
+    if (skb->nr_frags >= SKB_MAX_FRAGS) return -1;
+
+    frag = &skb->frags[skb->nr_frags++];
+    frag->buf = buf;
+    frag->data = (uint8_t *)data;
+    frag->len = len;
+
+    skb_buf_get(buf);
+    skb->len += len;
+    skb->data_len += len;
+
+    return 0;
+}
+
+/* Copies the whole frame out, for drivers that cannot gather fragments */
+void skb_copy_data(struct sk_buff *skb, void *to)
+{
+    uint8_t *ptr = to;
+
+    memcpy(ptr, skb->data, skb_headlen(skb));
+    ptr += skb_headlen(skb);
+
+    for (int i = 0; i < skb->nr_frags; i++) {
+        memcpy(ptr, skb->frags[i].data, skb->frags[i].len);
+        ptr += skb->frags[i].len;
+    }
+}
+
+/* Describes the frame for writev, iov needs room for 1 + SKB_MAX_FRAGS */
+int skb_fill_iovec(struct sk_buff *skb, struct iovec *iov)
+{
+    iov[0].iov_base = skb->data;
+    iov[0].iov_len = skb_headlen(skb);
+
+    for (int i = 0; i < skb->nr_frags; i++) {
+        iov[i + 1].iov_base = skb->frags[i].data;
+        iov[i + 1].iov_len = skb->frags[i].len;
+    }
+
+    return skb->nr_frags + 1;
+}
+
+static void skb_buf_free(struct skb_buf *buf)
+{
+    free(buf);
+}
+
+struct skb_buf *skb_buf_alloc(uint32_t size)
+{
+    struct skb_buf *buf = malloc(sizeof(struct skb_buf) + size);
+
+    buf->refcnt = 1;
+    buf->release = skb_buf_free;
+    buf->size = size;
+
+    return buf;
+}
+
+void skb_buf_put(struct skb_buf *buf)
+{
+    if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        buf->release(buf);
+    }
+}
+
+/*
+ * Switches an empty queue to a lock-free ring of size entries, a power of
+ * two. Done under the queue lock, so that a reader in list mode is not
+ * caught halfway.
+ */
+int skb_queue_ring_init(struct sk_buff_head *list, uint32_t size)
+{
+    struct sk_buff **ring;
+
+    if (size & (size - 1)) return -1;
+
+    if ((ring = calloc(size, sizeof(struct sk_buff *))) == NULL) return -1;
+
+    pthread_mutex_lock(&list->lock);
+
+    if (list->ring || !list_empty(&list->head)) {
+        pthread_mutex_unlock(&list->lock);
+        free(ring);
+        return -1;
+    }
+
+    list->ring_mask = size - 1;
+    list->prod = 0;
+    list->cons = 0;
+    __atomic_store_n(&list->ring, ring, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&list->lock);
+
+    return 0;
+}
+
+/* Frees whatever is left on a queue nobody uses anymore */
+void skb_queue_free(struct sk_buff_head *list)
+{
+    while (!skb_queue_empty(list)) {
+        free_skb(skb_dequeue(list));
+    }
+
+    free(list->ring);
+    list->ring = NULL;
+}
+
+void skb_pool_stats(struct skb_pool_stats *stats)
+{
+    struct list_head *item;
+
+    memset(stats, 0, sizeof(struct skb_pool_stats));
+
+    pthread_mutex_lock(&pools_lock);
+
+    skb_stats_add(stats, &retired);
+
+    list_for_each(item, &pools) {
+        skb_stats_add(stats, &list_entry(item, struct skb_pool, list)->stats);
+    }
+
+    pthread_mutex_unlock(&pools_lock);
+}
+
+void skb_pool_dump()
+{
+    struct skb_pool_stats stats;
+
+    skb_pool_stats(&stats);
+
+    for (int i = 0; i < SKB_POOL_CLASSES; i++) {
+        print_debug("SKBPOOL: class %d (%u bytes): hits %lu, misses %lu\n", i,
+                    skb_class_size[i], stats.hits[i], stats.misses[i]);
+    }
+
+    print_debug("SKBPOOL: oversize %lu\n", stats.oversize);
+}
+
+/* Frees the cached buffers of all pools, which start counting anew */
+void free_skb_pools()
+{
+    struct list_head *item;
+    struct skb_pool *pool;
+
+    pthread_mutex_lock(&pools_lock);
+
+    list_for_each(item, &pools) {
+        pool = list_entry(item, struct skb_pool, list);
+        skb_stats_add(&retired, &pool->stats);
+        memset(&pool->stats, 0, sizeof(struct skb_pool_stats));
+        skb_pool_drain(pool);
+    }
+
+    pthread_mutex_unlock(&pools_lock);
+}
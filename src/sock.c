@@ -1,6 +1,7 @@
 #include "syshead.h"
 #include "sock.h"
 #include "socket.h"
+#include "shard.h"
 
 struct sock *sk_alloc(struct net_ops *ops, int protocol)
 {
@@ -15,9 +16,34 @@ struct sock *sk_alloc(struct net_ops *ops, int protocol)
 
 void sock_init_data(struct socket *sock, struct sock *sk)
 {
+    pthread_mutexattr_t attr;
+
     sock->sk = sk;
     sk->sock = sock;
+    sk->shard = -1;
+
+    /* Taken again by what runs under it, such as an abort on a reset */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sk->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 
-    wait_init(&sk->recv_wait);
     skb_queue_init(&sk->receive_queue);
 }
+
+/*
+ * Runs fn on the socket's connection state: on the shard that owns it, or
+ * under the socket's lock when no shard does, as with sharding off.
+ */
+int sock_run(struct sock *sk, int (*fn) (void *arg), void *arg)
+{
+    int rc;
+
+    if (sk->shard >= 0) return shard_run(sk->shard, fn, arg);
+
+    pthread_mutex_lock(&sk->lock);
+    rc = fn(arg);
+    pthread_mutex_unlock(&sk->lock);
+
+    return rc;
+}
@@ -2,10 +2,9 @@
 #include "utils.h"
 #include "socket.h"
 #include "inet.h"
-#include "wait.h"
 
 static int sock_amount = 0;
-static LIST_HEAD(sockets);
+static struct list_head fdtables[SOCKET_PID_BUCKETS];
 static pthread_mutex_t slock = PTHREAD_MUTEX_INITIALIZER;
 
 extern struct net_family inet;
@@ -14,93 +13,407 @@ static struct net_family *families[128] = {
     [AF_INET] = &inet,
 };
 
-static struct socket *alloc_socket(pid_t pid)
+/*
+ * Descriptors of a process. Slot i holds fd SOCKET_FD_BASE + i, and
+ * open_fds has its bit set while the slot is taken. New fds get the lowest
+ * free slot, as the kernel's do, which is searched from next_fd: no slot
+ * below it is free. All tables are guarded by slock.
+ */
+struct fdtable {
+    struct list_head list; /* In its pid's bucket */
+    pid_t pid;
+    int size;
+    int count;
+    int next_fd;
+    struct socket **sockets;
+    uint64_t *open_fds;
+};
+
+void socket_init()
 {
-    // TODO: Figure out a way to not shadow kernel file descriptors.
-    // Now, we'll just expect the fds for a process to never exceed this.
-    static int fd = 4097;
-    struct socket *sock = malloc(sizeof (struct socket));
-    list_init(&sock->list);
+    for (int i = 0; i < SOCKET_PID_BUCKETS; i++) {
+        list_init(&fdtables[i]);
+    }
+}
+
+static struct list_head *fdtable_bucket(pid_t pid)
+{
+    return &fdtables[(uint32_t)pid % SOCKET_PID_BUCKETS];
+}
+
+/* Caller holds slock */
+static struct fdtable *fdtable_find(pid_t pid)
+{
+    struct list_head *item, *bucket = fdtable_bucket(pid);
+
+    list_for_each(item, bucket) {
+        struct fdtable *fdt = list_entry(item, struct fdtable, list);
+
+        if (fdt->pid == pid) return fdt;
+    }
+
+    return NULL;
+}
+
+/* Caller holds slock */
+static struct fdtable *fdtable_get(pid_t pid)
+{
+    struct fdtable *fdt = fdtable_find(pid);
+
+    if (fdt) return fdt;
+
+    fdt = calloc(1, sizeof(struct fdtable));
+    fdt->pid = pid;
+    list_add_tail(&fdt->list, fdtable_bucket(pid));
+
+    return fdt;
+}
+
+/* Caller holds slock */
+static int fdtable_grow(struct fdtable *fdt)
+{
+    int size = fdt->size ? fdt->size * 2 : SOCKET_FDTABLE_MIN;
+    struct socket **sockets;
+    uint64_t *open_fds;
+
+    if (fdt->size >= SOCKET_MAX_FDS) return -EMFILE;
+
+    sockets = realloc(fdt->sockets, size * sizeof(struct socket *));
+    open_fds = realloc(fdt->open_fds, size / 64 * sizeof(uint64_t));
+
+    if (sockets) fdt->sockets = sockets;
+    if (open_fds) fdt->open_fds = open_fds;
+    if (!sockets || !open_fds) return -ENOMEM;
+
+    memset(fdt->sockets + fdt->size, 0, (size - fdt->size) * sizeof(struct socket *));
+    memset(fdt->open_fds + fdt->size / 64, 0, (size - fdt->size) / 64 * sizeof(uint64_t));
+    fdt->size = size;
+
+    return 0;
+}
+
+/* Gives the socket the lowest free fd of the process, caller holds slock */
+static int fd_install(pid_t pid, struct socket *sock)
+{
+    struct fdtable *fdt = fdtable_get(pid);
+    int word, slot, err;
+
+    for (word = fdt->next_fd / 64; word < fdt->size / 64; word++) {
+        if (~fdt->open_fds[word]) break;
+    }
+
+    if (word == fdt->size / 64 && (err = fdtable_grow(fdt)) < 0) {
+        if (!fdt->count) {
+            list_del(&fdt->list);
+            free(fdt->sockets);
+            free(fdt->open_fds);
+            free(fdt);
+        }
+
+        return err;
+    }
+
+    slot = word * 64 + __builtin_ctzll(~fdt->open_fds[word]);
+
+    fdt->open_fds[word] |= 1ULL << (slot % 64);
+    fdt->sockets[slot] = sock;
+    fdt->count++;
+    fdt->next_fd = slot + 1;
+    sock_amount++;
 
     sock->pid = pid;
-    sock->fd = fd++;
+    sock->fd = SOCKET_FD_BASE + slot;
+
+    return sock->fd;
+}
+
+/* Frees the socket's fd for reuse, caller holds slock */
+static void fd_release(struct socket *sock)
+{
+    struct fdtable *fdt = fdtable_find(sock->pid);
+    int slot = sock->fd - SOCKET_FD_BASE;
+
+    sock->fd = -1;
+
+    if (!fdt) return;
+
+    fdt->open_fds[slot / 64] &= ~(1ULL << (slot % 64));
+    fdt->sockets[slot] = NULL;
+    fdt->count--;
+    if (slot < fdt->next_fd) fdt->next_fd = slot;
+    sock_amount--;
+
+    /* Processes come and go, their tables with them */
+    if (!fdt->count) {
+        list_del(&fdt->list);
+        free(fdt->sockets);
+        free(fdt->open_fds);
+        free(fdt);
+    }
+}
+
+static struct socket *alloc_socket()
+{
+    struct socket *sock = malloc(sizeof (struct socket));
+
+    /* The fd's reference, the fd itself is installed once the socket is
+     * handed to a process */
+    sock->refcnt = 1;
+    sock->pid = 0;
+    sock->fd = -1;
     sock->state = SS_UNCONNECTED;
     sock->ops = NULL;
-    wait_init(&sock->sleep);
+    sock->sk = NULL;
+    pthread_mutex_init(&sock->wait_lock, NULL);
+    list_init(&sock->waiters);
+    sock->nwaiters = 0;
     
     return sock;
 }
 
-static int free_socket(struct socket *sock)
+void socket_get(struct socket *sock)
 {
-    if (sock->ops) {
-        sock->ops->free(sock);
+    __atomic_add_fetch(&sock->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* For lockless lookups, which may find a socket on its way out */
+int socket_get_not_zero(struct socket *sock)
+{
+    int refcnt = __atomic_load_n(&sock->refcnt, __ATOMIC_RELAXED);
+
+    while (refcnt) {
+        if (__atomic_compare_exchange_n(&sock->refcnt, &refcnt, refcnt + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
     }
 
+    return 0;
+}
+
+static void socket_destroy(struct epoch_entry *e)
+{
+    struct socket *sock = list_entry(e, struct socket, epoch);
+
+    if (sock->ops && sock->ops->destroy) sock->ops->destroy(sock);
+
+    free(sock);
+}
+
+void socket_put(struct socket *sock)
+{
+    if (__atomic_sub_fetch(&sock->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        /* Lookups that started before the socket was unhashed may still
+         * be looking at it */
+        epoch_call(&sock->epoch, socket_destroy);
+    }
+}
+
+/*
+ * Closes the socket and drops the fd's reference. Its fd is released
+ * first, so that no new request finds it, and only once.
+ */
+int free_socket(struct socket *sock)
+{
     pthread_mutex_lock(&slock);
 
-    list_del(&sock->list);
-    sock_amount--;
+    if (sock->state == SS_FREE) {
+        pthread_mutex_unlock(&slock);
+        return -EBADF;
+    }
+
+    sock->state = SS_FREE;
+    if (sock->fd >= 0) fd_release(sock);
 
     pthread_mutex_unlock(&slock);
+
+    if (sock->ops) {
+        sock->ops->free(sock);
+    }
+
+    /* Requests parked on the socket find it closed */
+    socket_wake(sock, POLLIN | POLLOUT);
+
+    socket_put(sock);
     
     return 0;
 }
 
+/* Caller holds slock */
+static struct socket *first_socket()
+{
+    for (int i = 0; i < SOCKET_PID_BUCKETS; i++) {
+        struct fdtable *fdt;
+
+        if (list_empty(&fdtables[i])) continue;
+
+        fdt = list_first_entry(&fdtables[i], struct fdtable, list);
+
+        for (int slot = 0; slot < fdt->size; slot++) {
+            if (fdt->sockets[slot]) return fdt->sockets[slot];
+        }
+    }
+
+    return NULL;
+}
+
 void free_sockets() {
-    struct list_head *item, *tmp;
     struct socket *sock;
 
     pthread_mutex_lock(&slock);
     
-    list_for_each_safe(item, tmp, &sockets) {
-        sock = list_entry(item, struct socket, list);
-        list_del(item);
-        sock->ops->free(sock);
-        free(sock);
+    /* Freeing a listener frees the connections it holds as well */
+    while ((sock = first_socket()) != NULL) {
+        pthread_mutex_unlock(&slock);
+        free_socket(sock);
+        pthread_mutex_lock(&slock);
     }
     
     pthread_mutex_unlock(&slock);
 }
 
+/* Closes what a process left open, once it went away */
+void socket_close_pid(pid_t pid)
+{
+    struct socket *sock = NULL;
+    struct fdtable *fdt;
+
+    pthread_mutex_lock(&slock);
+
+    /* The table goes away with the last of its fds */
+    while ((fdt = fdtable_find(pid)) != NULL) {
+        for (int slot = 0; slot < fdt->size; slot++) {
+            if ((sock = fdt->sockets[slot]) != NULL) break;
+        }
+
+        socket_get(sock);
+        pthread_mutex_unlock(&slock);
+
+        free_socket(sock);
+        socket_put(sock);
+
+        pthread_mutex_lock(&slock);
+    }
+
+    pthread_mutex_unlock(&slock);
+}
+
+/* Returns the socket with a reference, which the caller puts */
 static struct socket *get_socket(pid_t pid, int fd)
 {
-    struct list_head *item;
     struct socket *sock = NULL;
+    struct fdtable *fdt;
+    int slot = fd - SOCKET_FD_BASE;
+
+    pthread_mutex_lock(&slock);
 
-    list_for_each(item, &sockets) {
-        sock = list_entry(item, struct socket, list);
-        if (sock->pid == pid && sock->fd == fd) return sock;
+    if ((fdt = fdtable_find(pid)) != NULL && slot >= 0 && slot < fdt->size &&
+        (sock = fdt->sockets[slot]) != NULL) {
+        socket_get(sock);
     }
+
+    pthread_mutex_unlock(&slock);
     
-    return NULL;
+    return sock;
 }
 
-struct socket *socket_lookup(uint16_t remoteport, uint16_t localport)
+/*
+ * Parks wait on the socket until it has one of wait->events, returns 0.
+ * Returns 1 without parking if it has one already, and -EBADF if there is
+ * no such socket. The waiter is added before the socket is polled, and the
+ * side that makes it ready polls for waiters after it did, so that one of
+ * the two sees the other.
+ */
+int socket_park(pid_t pid, int sockfd, struct socket_wait *wait)
 {
-    struct list_head *item;
-    struct socket *sock = NULL;
-    struct sock *sk = NULL;
+    struct socket *sock;
+
+    if ((sock = get_socket(pid, sockfd)) == NULL) return -EBADF;
 
-    list_for_each(item, &sockets) {
-        sock = list_entry(item, struct socket, list);
+    wait->sock = sock;
 
-        if (sock == NULL || sock->sk == NULL) continue;
+    pthread_mutex_lock(&sock->wait_lock);
 
-        sk = sock->sk;
+    list_add_tail(&wait->list, &sock->waiters);
+    __atomic_store_n(&sock->nwaiters, sock->nwaiters + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-        if (sk->sport == localport && sk->dport == remoteport) return sock;
+    if (__atomic_load_n(&sock->state, __ATOMIC_RELAXED) == SS_FREE ||
+        (sock->ops->poll(sock) & wait->events)) {
+        list_del(&wait->list);
+        __atomic_store_n(&sock->nwaiters, sock->nwaiters - 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sock->wait_lock);
+
+        socket_put(sock);
+        return 1;
+    }
+
+    pthread_mutex_unlock(&sock->wait_lock);
+
+    return 0;
+}
+
+/* Wakes those parked on the socket for one of events, after it got them */
+void socket_wake(struct socket *sock, short events)
+{
+    struct list_head woken, *item, *tmp;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&sock->nwaiters, __ATOMIC_RELAXED)) return;
+
+    list_init(&woken);
+
+    pthread_mutex_lock(&sock->wait_lock);
+
+    list_for_each_safe(item, tmp, &sock->waiters) {
+        struct socket_wait *wait = list_entry(item, struct socket_wait, list);
+
+        if (!(wait->events & events)) continue;
+
+        list_del(item);
+        list_add_tail(item, &woken);
+        sock->nwaiters--;
+    }
+
+    pthread_mutex_unlock(&sock->wait_lock);
+
+    /* A woken request may be done and gone before the next is woken */
+    list_for_each_safe(item, tmp, &woken) {
+        struct socket_wait *wait = list_entry(item, struct socket_wait, list);
+
+        list_del(item);
+        wait->wake(wait);
     }
-    
-    return NULL;
+}
+
+/*
+ * A connection arriving on a listening socket. It has no fd until
+ * accept() hands it to a process, and is found by its 4-tuple only.
+ */
+struct socket *socket_new_conn(struct socket *head)
+{
+    struct socket *sock;
+
+    if ((sock = alloc_socket()) == NULL) return NULL;
+
+    sock->type = head->type;
+
+    if (inet.create(sock, head->sk->protocol) != 0) {
+        free(sock);
+        return NULL;
+    }
+
+    return sock;
 }
 
 int _socket(pid_t pid, int domain, int type, int protocol)
 {
     struct socket *sock;
     struct net_family *family;
+    int rc;
 
-    if ((sock = alloc_socket(pid)) == NULL) {
+    if ((sock = alloc_socket()) == NULL) {
         print_err("Could not alloc socket\n");
         return -1;
     }
@@ -125,13 +438,12 @@ int _socket(pid_t pid, int domain, int type, int protocol)
     }
 
     pthread_mutex_lock(&slock);
-    
-    list_add_tail(&sock->list, &sockets);
-    sock_amount++;
-
+    rc = fd_install(pid, sock);
     pthread_mutex_unlock(&slock);
 
-    return sock->fd;
+    if (rc < 0) free_socket(sock);
+
+    return rc;
 
 abort_socket:
     free_socket(sock);
@@ -141,47 +453,163 @@ abort_socket:
 int _connect(pid_t pid, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
     struct socket *sock;
+    int rc;
 
     if ((sock = get_socket(pid, sockfd)) == NULL) {
         print_err("Connect: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
         return -1;
     }
 
-    return sock->ops->connect(sock, addr, addrlen, 0);
+    rc = sock->ops->connect(sock, addr, addrlen, 0);
+    socket_put(sock);
+
+    return rc;
 }
 
-int _write(pid_t pid, int sockfd, const void *buf, const unsigned int count)
+int _bind(pid_t pid, int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
     struct socket *sock;
+    int rc;
+
+    if ((sock = get_socket(pid, sockfd)) == NULL) {
+        print_err("Bind: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
+        return -EBADF;
+    }
+
+    rc = sock->ops->bind(sock, addr, addrlen);
+    socket_put(sock);
+
+    return rc;
+}
+
+int _listen(pid_t pid, int sockfd, int backlog)
+{
+    struct socket *sock;
+    int rc;
+
+    if ((sock = get_socket(pid, sockfd)) == NULL) {
+        print_err("Listen: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
+        return -EBADF;
+    }
+
+    rc = sock->ops->listen(sock, backlog);
+    socket_put(sock);
+
+    return rc;
+}
+
+/* Returns the fd of the accepted connection, now owned by the caller */
+int _accept(pid_t pid, int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    struct socket *sock, *newsock;
+    struct sockaddr_storage peer;
+    int rc;
+
+    if ((sock = get_socket(pid, sockfd)) == NULL) {
+        print_err("Accept: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
+        return -EBADF;
+    }
+
+    rc = sock->ops->accept(sock, &newsock, (struct sockaddr *)&peer);
+    socket_put(sock);
+
+    if (rc < 0) return rc;
+
+    pthread_mutex_lock(&slock);
+    rc = fd_install(pid, newsock);
+    pthread_mutex_unlock(&slock);
+
+    if (rc < 0) {
+        free_socket(newsock);
+        return rc;
+    }
+
+    if (*addrlen > sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+    memcpy(addr, &peer, *addrlen);
+    *addrlen = sizeof(struct sockaddr_in);
+
+    return rc;
+}
+
+int _write(pid_t pid, int sockfd, const void *buf, const unsigned int count,
+           struct skb_buf *owner)
+{
+    struct socket *sock;
+    int rc;
 
     if ((sock = get_socket(pid, sockfd)) == NULL) {
         print_err("Write: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
         return -1;
     }
 
-    return sock->ops->write(sock, buf, count);
+    rc = sock->ops->write(sock, buf, count, owner);
+    socket_put(sock);
+
+    return rc;
 }
 
 int _read(pid_t pid, int sockfd, void *buf, const unsigned int count)
 {
     struct socket *sock;
+    int rc;
 
     if ((sock = get_socket(pid, sockfd)) == NULL) {
         print_err("Read: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
         return -1;
     }
 
-    return sock->ops->read(sock, buf, count);
+    rc = sock->ops->read(sock, buf, count);
+    socket_put(sock);
+
+    return rc;
+}
+
+int _setsockopt(pid_t pid, int sockfd, int level, int optname,
+                const void *optval, socklen_t optlen)
+{
+    struct socket *sock;
+    int rc;
+
+    if ((sock = get_socket(pid, sockfd)) == NULL) {
+        print_err("Setsockopt: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
+        return -1;
+    }
+
+    rc = sock->ops->setsockopt(sock, level, optname, optval, optlen);
+    socket_put(sock);
+
+    return rc;
+}
+
+int _getsockopt(pid_t pid, int sockfd, int level, int optname,
+                void *optval, socklen_t *optlen)
+{
+    struct socket *sock;
+    int rc;
+
+    if ((sock = get_socket(pid, sockfd)) == NULL) {
+        print_err("Getsockopt: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
+        return -1;
+    }
+
+    rc = sock->ops->getsockopt(sock, level, optname, optval, optlen);
+    socket_put(sock);
+
+    return rc;
 }
 
 int _close(pid_t pid, int sockfd)
 {
     struct socket *sock;
+    int rc;
 
     if ((sock = get_socket(pid, sockfd)) == NULL) {
         print_err("Close: could not find socket (fd %d) for connection (pid %d)\n", sockfd, pid);
         return -1;
     }
 
-    return free_socket(sock);
+    rc = free_socket(sock);
+    socket_put(sock);
+
+    return rc;
 }
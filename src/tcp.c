@@ -5,23 +5,50 @@
 #include "sock.h"
 #include "utils.h"
 #include "tcp_timer.h"
-#include "wait.h"
+#include "shard.h"
+#include "tcp_data.h"
+
+extern int tcp_rmem_max;
+extern int tcp_max_backlog;
+
+/* Received data held by all sockets, in bytes */
+uint64_t tcp_memory_allocated = 0;
+
+/* Arguments of a write run on the connection's shard */
+struct tcp_write_call {
+    struct tcp_sock *tsk;
+    const void *buf;
+    int len;
+    struct skb_buf *owner;
+};
+
+/* Arguments of a congestion control switch run on the connection's shard */
+struct tcp_cong_call {
+    struct tcp_sock *tsk;
+    const char *name;
+};
 
 struct net_ops tcp_ops = {
     .alloc_sock = &tcp_alloc_sock,
     .init = &tcp_v4_init_sock,
     .connect = &tcp_v4_connect,
     .disconnect = &tcp_disconnect,
+    .listen = &tcp_listen_start,
+    .accept = &tcp_accept,
     .write = &tcp_write,
     .read = &tcp_read,
     .recv_notify = &tcp_recv_notify,
+    .poll = &tcp_poll,
     .close = &tcp_close,
     .abort = &tcp_abort,
+    .destroy = &tcp_destroy_sock,
+    .setsockopt = &tcp_setsockopt,
+    .getsockopt = &tcp_getsockopt,
 };
 
 void tcp_init()
 {
-    
+    tcp_syncookie_init();
 }
 
 static void tcp_init_segment(struct tcphdr *th, struct iphdr *ih, struct tcp_segment *seg)
@@ -73,19 +100,35 @@ void tcp_in(struct sk_buff *skb)
     /*     goto discard; */
     /* } */
         
+    /* A socket no shard owns is guarded by its lock, its state is shared
+     * with readers, writers and the timer thread */
+    int unowned = sk->shard < 0;
+
+    if (unowned) pthread_mutex_lock(&sk->lock);
     tcp_input_state(sk, skb, &seg);
-    return;
+    if (unowned) pthread_mutex_unlock(&sk->lock);
+
+    /* The reference of the lookup */
+    socket_put(sk->sock);
 }
 
-int tcp_udp_checksum(uint32_t saddr, uint32_t daddr, uint8_t proto,
-                     uint8_t *data, uint16_t len)
+static uint32_t tcp_udp_pseudo_sum(uint32_t saddr, uint32_t daddr, uint8_t proto,
+                                   uint16_t len)
 {
     uint32_t sum = 0;
 
-    sum += saddr;
-    sum += daddr;
+    sum += (saddr >> 16) + (saddr & 0xffff);
+    sum += (daddr >> 16) + (daddr & 0xffff);
     sum += htons(proto);
     sum += htons(len);
+
+    return sum;
+}
+
+int tcp_udp_checksum(uint32_t saddr, uint32_t daddr, uint8_t proto,
+                     uint8_t *data, uint16_t len)
+{
+    uint32_t sum = tcp_udp_pseudo_sum(saddr, daddr, proto, len);
     
     return checksum(data, len, sum);
 }
@@ -95,6 +138,17 @@ int tcp_v4_checksum(struct sk_buff *skb, uint32_t saddr, uint32_t daddr)
     return tcp_udp_checksum(saddr, daddr, IP_TCP, skb->data, skb->len);
 }
 
+/*
+ * Folded but not inverted pseudo-header sum, for the device or
+ * skb_checksum_help() to complete.
+ */
+uint16_t tcp_v4_pseudo_csum(struct sk_buff *skb, uint32_t saddr, uint32_t daddr)
+{
+    uint32_t sum = tcp_udp_pseudo_sum(saddr, daddr, IP_TCP, skb->len);
+
+    return ~checksum(NULL, 0, sum);
+}
+
 struct sock *tcp_alloc_sock()
 {
     struct tcp_sock *tsk = malloc(sizeof(struct tcp_sock));
@@ -114,35 +168,162 @@ int tcp_v4_init_sock(struct sock *sk)
 
 int tcp_init_sock(struct sock *sk)
 {
+    struct tcp_sock *tsk = tcp_sk(sk);
+
+    skb_queue_init(&tsk->ofo_queue);
+    skb_queue_init(&tsk->write_queue);
+    pthread_mutex_init(&tsk->accept_queue.lock, NULL);
+    list_init(&tsk->accept_queue.syn);
+    list_init(&tsk->accept_queue.ready);
+    list_init(&tsk->accept_list);
+    tsk->sndbuf = TCP_SNDBUF;
+    tsk->rcvbuf = TCP_RCVBUF < tcp_rmem_max ? TCP_RCVBUF : tcp_rmem_max;
+    tsk->rto = TCP_RTO_INITIAL;
+    tsk->ca_ops = tcp_cong_default();
+
     tcp_init_timers(sk);
     return 0;
 }
 
-static uint16_t generate_port()
-{
-    return 10000 + (time(NULL) % 3000);
-}
-
 int generate_iss()
 {
     /* TODO: Generate a proper ISS */
     return (int)time(NULL) * rand();
 }
 
+static int tcp_connect_call(void *arg)
+{
+    return tcp_connect(arg);
+}
+
+static int tcp_write_call(void *arg)
+{
+    struct tcp_write_call *call = arg;
+
+    return tcp_send(call->tsk, call->buf, call->len, call->owner);
+}
+
+/* Stops a listener, inet_free() takes the connections left in its queues */
+static void tcp_listen_stop(struct tcp_sock *tsk)
+{
+    struct tcp_accept_queue *queue = &tsk->accept_queue;
+
+    pthread_mutex_lock(&queue->lock);
+
+    tsk->sk.state = TCP_CLOSE;
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* A connection is closed before accept() took it */
+static void tcp_accept_unlink(struct tcp_sock *tsk)
+{
+    struct tcp_accept_queue *queue = &tsk->parent->accept_queue;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (list_empty(&tsk->accept_list)) goto unlock;
+
+    if (tsk->sk.state == TCP_SYN_RECEIVED) {
+        queue->syn_len--;
+    } else {
+        queue->ready_len--;
+    }
+
+    list_del(&tsk->accept_list);
+    list_init(&tsk->accept_list);
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int tcp_abort_call(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+
+    if (tsk->sk.state == TCP_LISTEN) {
+        tcp_listen_stop(tsk);
+        return 0;
+    }
+
+    if (tsk->parent) tcp_accept_unlink(tsk);
+
+    tcp_clear_timers(tsk);
+    tcp_ofo_purge(tsk);
+    /* What the reader left is freed along with the socket */
+    tcp_rmem_uncharge(tsk, tsk->rmem_alloc);
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+    skb_queue_free(&tsk->write_queue);
+    tsk->send_head = NULL;
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+
+    tsk->sk.state = TCP_CLOSE;
+
+    return tcp_send_reset(tsk);
+}
+
+/*
+ * The end of a connection the user closed: it leaves the hash, and drops
+ * the reference it kept its socket with.
+ */
+void tcp_done(struct tcp_sock *tsk)
+{
+    struct sock *sk = &tsk->sk;
+
+    tcp_clear_timers(tsk);
+    tcp_ofo_purge(tsk);
+    tcp_rmem_uncharge(tsk, tsk->rmem_alloc);
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+    skb_queue_free(&tsk->write_queue);
+    tsk->send_head = NULL;
+    sk->state = TCP_CLOSE;
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+
+    inet_unhash(sk);
+    socket_put(sk->sock);
+}
+
+/* Frees what segments that raced with the abort may have left behind */
+void tcp_destroy_sock(struct sock *sk)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+
+    tcp_ofo_purge(tsk);
+    tcp_rmem_uncharge(tsk, tsk->rmem_alloc);
+    skb_queue_free(&tsk->write_queue);
+
+    if (tsk->parent) socket_put(tsk->parent->sk.sock);
+}
+
 int tcp_v4_connect(struct sock *sk, const struct sockaddr *addr, int addrlen, int flags)
 {
     uint16_t dport = ((struct sockaddr_in *)addr)->sin_port;
     uint32_t daddr = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
 
     sk->dport = ntohs(dport);
-    sk->sport = generate_port();
     sk->daddr = ntohl(daddr);
-    /* TODO: Do not hardcode lvl-ip local interface */
-    sk->saddr = parse_ipv4_string("10.0.0.4"); 
+
+    /* Hashed before the SYN goes out, so that the SYN-ACK finds the socket.
+     * A bound socket keeps its address, but is found by its 4-tuple now. */
+    if (!sk->sport) {
+        /* TODO: Do not hardcode lvl-ip local interface */
+        sk->saddr = parse_ipv4_string("10.0.0.4");
+    }
+
+    if (inet_hash_connect(sk) < 0) {
+        print_err("No local port left to %hhu.%hhu.%hhu.%hhu:%d\n", addr->sa_data[2],
+                  addr->sa_data[3], addr->sa_data[4], addr->sa_data[5], sk->dport);
+        return -EADDRNOTAVAIL;
+    }
 
     printf("Connecting socket to %hhu.%hhu.%hhu.%hhu:%d\n", addr->sa_data[2], addr->sa_data[3], addr->sa_data[4], addr->sa_data[5], sk->dport);
 
-    return tcp_connect(sk);
+    /* The 4-tuple is known, from now on the connection lives on its shard */
+    sk->shard = shard_of(inet_flow_hash(sk->saddr, sk->daddr, sk->sport, sk->dport));
+
+    return sock_run(sk, tcp_connect_call, sk);
 }
 
 int tcp_disconnect(struct sock *sk, int flags)
@@ -150,23 +331,120 @@ int tcp_disconnect(struct sock *sk, int flags)
     return 0;
 }
 
-int tcp_write(struct sock *sk, const void *buf, int len)
+int tcp_listen_start(struct sock *sk, int backlog)
 {
     struct tcp_sock *tsk = tcp_sk(sk);
-    int ret = -1;
 
+    if (sk->state != TCP_CLOSE && sk->state != TCP_LISTEN) return -EINVAL;
+
+    /* As in Linux, the backlog is bounded rather than refused */
+    if (backlog < 1) backlog = 1;
+    if (backlog > tcp_max_backlog) backlog = tcp_max_backlog;
+
+    pthread_mutex_lock(&tsk->accept_queue.lock);
+    tsk->accept_queue.backlog = backlog;
+    sk->state = TCP_LISTEN;
+    pthread_mutex_unlock(&tsk->accept_queue.lock);
+
+    return 0;
+}
+
+/*
+ * Takes the oldest connection ready on a listener, -EAGAIN if there is
+ * none yet. A stopped listener hands out what is left in its queues.
+ */
+struct sock *tcp_accept(struct sock *sk, int *err)
+{
+    struct tcp_accept_queue *queue = &tcp_sk(sk)->accept_queue;
+    struct tcp_sock *newtsk = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (!list_empty(&queue->ready)) {
+        newtsk = list_first_entry(&queue->ready, struct tcp_sock, accept_list);
+        queue->ready_len--;
+    } else if (!list_empty(&queue->syn)) {
+        /* Only a stopped listener gives up connections in the handshake */
+        newtsk = list_first_entry(&queue->syn, struct tcp_sock, accept_list);
+        queue->syn_len--;
+    } else {
+        *err = sk->state == TCP_LISTEN ? -EAGAIN : -EINVAL;
+        goto unlock;
+    }
+
+    list_del(&newtsk->accept_list);
+    list_init(&newtsk->accept_list);
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+
+    return newtsk ? &newtsk->sk : NULL;
+}
+
+/*
+ * Moves a connection of a listener from the SYN queue to the accept
+ * queue, once established or once its handshake failed.
+ */
+void tcp_accept_enqueue(struct tcp_sock *tsk)
+{
+    struct tcp_accept_queue *queue = &tsk->parent->accept_queue;
+
+    pthread_mutex_lock(&queue->lock);
+
+    /* The listener was closed and gave the connection up meanwhile */
+    if (list_empty(&tsk->accept_list)) goto unlock;
+
+    list_del(&tsk->accept_list);
+    list_add_tail(&tsk->accept_list, &queue->ready);
+    queue->syn_len--;
+    queue->ready_len++;
+
+    socket_wake(tsk->parent->sk.sock, POLLIN);
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int tcp_can_send(struct sock *sk)
+{
     switch (sk->state) {
     case TCP_ESTABLISHED:
     case TCP_CLOSE_WAIT:
-        break;
+        return 1;
     default:
-        goto out;
+        return 0;
     }
+}
+
+int tcp_write(struct sock *sk, const void *buf, int len, struct skb_buf *owner)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+    struct tcp_write_call call = {
+        .tsk = tsk,
+        .owner = owner,
+    };
+    int sent = 0;
+    int rc;
 
-    return tcp_send(tsk, buf, len);    
+    /* Queues what fits in sndbuf, acknowledgments make room for the rest */
+    while (sent < len) {
+        if (!tcp_can_send(sk)) goto out;
+
+        call.buf = (uint8_t *)buf + sent;
+        call.len = len - sent;
+
+        if ((rc = sock_run(sk, tcp_write_call, &call)) < 0) goto out;
+        if (rc == 0) break;
+
+        sent += rc;
+    }
+
+    return sent ? sent : -EAGAIN;
 
 out: 
-    return ret;
+    if (sent) return sent;
+
+    return tsk->err ? -tsk->err : -1;
 }
 
 int tcp_read(struct sock *sk, void *buf, int len)
@@ -176,6 +454,8 @@ int tcp_read(struct sock *sk, void *buf, int len)
 
     switch (sk->state) {
     case TCP_CLOSE:
+        if (tsk->err) return -tsk->err;
+
         printf("error:  connection does not exist\n");
         goto out;
     case TCP_LISTEN:
@@ -196,8 +476,8 @@ int tcp_read(struct sock *sk, void *buf, int len)
            "error:  connection closing" response.  Otherwise, any remaining
            text can be used to satisfy the RECEIVE. */
         if (!skb_queue_empty(&tsk->sk.receive_queue)) break;
-        if (tsk->flags & TCP_FIN) {
-            tsk->flags &= ~TCP_FIN;
+        if (__atomic_load_n(&tsk->flags, __ATOMIC_ACQUIRE) & TCP_FIN) {
+            __atomic_fetch_and(&tsk->flags, ~TCP_FIN, __ATOMIC_RELAXED);
             return 0;
         }
     case TCP_CLOSING:
@@ -217,22 +497,226 @@ out:
 
 int tcp_recv_notify(struct sock *sk)
 {
-    if (&sk->recv_wait) {
-        return wait_wakeup(&sk->recv_wait);
+    socket_wake(sk->sock, POLLIN);
+
+    return 0;
+}
+
+/*
+ * Lockless, so that it can be asked under the socket's wait lock. Whoever
+ * changes what it looks at calls socket_wake() afterwards.
+ */
+int tcp_poll(struct sock *sk)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+    int mask = 0;
+
+    switch (sk->state) {
+    case TCP_LISTEN:
+        return __atomic_load_n(&tsk->accept_queue.ready_len, __ATOMIC_RELAXED) ? POLLIN : 0;
+    case TCP_SYN_SENT:
+    case TCP_SYN_RECEIVED:
+        return 0;
+    case TCP_ESTABLISHED:
+    case TCP_FIN_WAIT_1:
+    case TCP_FIN_WAIT_2:
+        if (!skb_queue_empty(&sk->receive_queue) ||
+            (__atomic_load_n(&tsk->flags, __ATOMIC_ACQUIRE) & TCP_FIN)) {
+            mask |= POLLIN;
+        }
+        break;
+    default:
+        /* Reads return what is left or fail, without waiting */
+        mask |= POLLIN;
+        break;
+    }
+
+    if (!tcp_can_send(sk) || tsk->write_seq - tsk->tcb.snd_una < tsk->sndbuf) mask |= POLLOUT;
+
+    return mask;
+}
+
+/*
+ * Sends a FIN once the data written before it went, RFC 793 3.5. The
+ * connection keeps its socket until tcp_done(). Data the user did not read
+ * is lost, which the peer learns from a reset instead, RFC 2525 2.17.
+ */
+static int tcp_close_call(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+    struct sock *sk = &tsk->sk;
+
+    if (!skb_queue_empty(&sk->receive_queue)) return -1;
+
+    switch (sk->state) {
+    case TCP_ESTABLISHED:
+        sk->state = TCP_FIN_WAIT_1;
+        break;
+    case TCP_CLOSE_WAIT:
+        sk->state = TCP_LAST_ACK;
+        break;
+    default:
+        return -1;
     }
 
-    // No recv wait lock
-    return -1;
+    socket_get(sk->sock);
+
+    return tcp_send_finack(sk);
 }
 
+/* Returns 0 when the connection closes in order, otherwise it is aborted */
 int tcp_close(struct sock *sk)
 {
-    // TODO: Properly handle TCP socket closing
-    return -1;
+    return sock_run(sk, tcp_close_call, tcp_sk(sk));
 }
 
 int tcp_abort(struct sock *sk)
+{
+    return sock_run(sk, tcp_abort_call, tcp_sk(sk));
+}
+
+/* Held back data goes out now, unless still corked */
+static int tcp_push_call(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+    struct sock *sk = &tsk->sk;
+
+    if (sk->state == TCP_ESTABLISHED || sk->state == TCP_CLOSE_WAIT) tcp_push(tsk);
+
+    return 0;
+}
+
+static int tcp_set_congestion_call(void *arg)
+{
+    struct tcp_cong_call *call = arg;
+    struct tcp_sock *tsk = call->tsk;
+    int rc;
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+    rc = tcp_set_congestion_control(tsk, call->name);
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+
+    return rc;
+}
+
+int tcp_setsockopt(struct sock *sk, int level, int optname,
+                   const void *optval, socklen_t optlen)
 {
     struct tcp_sock *tsk = tcp_sk(sk);
-    return tcp_send_reset(tsk);
+    char name[TCP_CA_NAME_MAX];
+
+    int val = 0;
+
+    if (optlen >= sizeof(int)) val = *(int *)optval;
+
+    if (level == SOL_SOCKET && optname == SO_SNDBUF) {
+        if (optlen < sizeof(int)) return -EINVAL;
+
+        pthread_mutex_lock(&tsk->write_queue.lock);
+        tsk->sndbuf = val > TCP_MIN_SNDBUF ? val : TCP_MIN_SNDBUF;
+        pthread_mutex_unlock(&tsk->write_queue.lock);
+
+        socket_wake(sk->sock, POLLOUT);
+
+        return 0;
+    }
+
+    if (level == SOL_SOCKET && optname == SO_RCVBUF) {
+        if (optlen < sizeof(int)) return -EINVAL;
+
+        if (val < TCP_MIN_RCVBUF) val = TCP_MIN_RCVBUF;
+        if (val > tcp_rmem_max) val = tcp_rmem_max;
+
+        /* A buffer set by the user is not auto-tuned */
+        __atomic_store_n(&tsk->rcvbuf, val, __ATOMIC_RELAXED);
+        tsk->rcvbuf_lock = 1;
+
+        return 0;
+    }
+
+    if (level != IPPROTO_TCP) {
+        /* Other socket level options are accepted but not acted upon yet */
+        print_debug("Setsockopt level %d option %d not supported\n", level, optname);
+        return 0;
+    }
+
+    switch (optname) {
+    case TCP_NODELAY:
+    case TCP_CORK:
+        if (optlen < sizeof(int)) return -EINVAL;
+
+        uint8_t flag = optname == TCP_NODELAY ? TCP_NAGLE_OFF : TCP_NAGLE_CORK;
+
+        pthread_mutex_lock(&tsk->write_queue.lock);
+        tsk->nonagle = val ? tsk->nonagle | flag : tsk->nonagle & ~flag;
+        pthread_mutex_unlock(&tsk->write_queue.lock);
+
+        return sock_run(sk, tcp_push_call, tsk);
+    case TCP_CONGESTION:
+        if (optlen < 1) return -EINVAL;
+        if (optlen >= TCP_CA_NAME_MAX) optlen = TCP_CA_NAME_MAX - 1;
+
+        memcpy(name, optval, optlen);
+        name[optlen] = '\0';
+
+        /* Congestion control state is the shard's */
+        struct tcp_cong_call call = { .tsk = tsk, .name = name };
+
+        return sock_run(sk, tcp_set_congestion_call, &call);
+    default:
+        return -ENOPROTOOPT;
+    }
+}
+
+int tcp_getsockopt(struct sock *sk, int level, int optname,
+                   void *optval, socklen_t *optlen)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+    socklen_t len;
+    int val;
+
+    if (level == SOL_SOCKET && optname == SO_SNDBUF) {
+        val = tsk->sndbuf;
+        goto int_opt;
+    }
+
+    if (level == SOL_SOCKET && optname == SO_RCVBUF) {
+        val = __atomic_load_n(&tsk->rcvbuf, __ATOMIC_RELAXED);
+        goto int_opt;
+    }
+
+    if (level != IPPROTO_TCP) return -ENOPROTOOPT;
+
+    switch (optname) {
+    case TCP_NODELAY:
+        val = !!(tsk->nonagle & TCP_NAGLE_OFF);
+        goto int_opt;
+    case TCP_CORK:
+        val = !!(tsk->nonagle & TCP_NAGLE_CORK);
+        goto int_opt;
+    case TCP_CONGESTION:
+        len = strlen(tsk->ca_ops->name) + 1;
+        if (len > *optlen) len = *optlen;
+
+        memcpy(optval, tsk->ca_ops->name, len);
+        *optlen = len;
+
+        return 0;
+    default:
+        return -ENOPROTOOPT;
+    }
+
+int_opt:
+    if (*optlen < sizeof(int)) return -EINVAL;
+
+    memcpy(optval, &val, sizeof(int));
+    *optlen = sizeof(int);
+
+    return 0;
+}
+
+void tcp_mem_dump()
+{
+    print_debug("TCPMEM: %lu bytes received and not read, rcvbuf ceiling %d\n",
+                __atomic_load_n(&tcp_memory_allocated, __ATOMIC_RELAXED), tcp_rmem_max);
 }
@@ -0,0 +1,140 @@
+#include "syshead.h"
+#include "utils.h"
+#include "tcp.h"
+#include "tcp_cong.h"
+
+extern char *tcp_congestion;
+
+static struct tcp_congestion_ops *tcp_cong_list[] = {
+    &tcp_newreno,
+    &tcp_cubic,
+};
+
+#define TCP_CONG_ALGS (sizeof(tcp_cong_list) / sizeof(tcp_cong_list[0]))
+
+struct tcp_congestion_ops *tcp_cong_find(const char *name)
+{
+    for (int i = 0; i < TCP_CONG_ALGS; i++) {
+        if (strncmp(tcp_cong_list[i]->name, name, TCP_CA_NAME_MAX) == 0) {
+            return tcp_cong_list[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Algorithm of new sockets, set by -c */
+struct tcp_congestion_ops *tcp_cong_default()
+{
+    struct tcp_congestion_ops *ops = tcp_cong_find(tcp_congestion);
+
+    return ops ? ops : &tcp_cubic;
+}
+
+/* RFC 6928 initial window */
+static uint32_t tcp_init_cwnd(struct tcp_sock *tsk)
+{
+    uint32_t cwnd = 14600 > 2 * tsk->mss ? 14600 : 2 * tsk->mss;
+
+    return cwnd < 10 * tsk->mss ? cwnd : 10 * tsk->mss;
+}
+
+void tcp_init_congestion_control(struct tcp_sock *tsk)
+{
+    tsk->snd_cwnd = tcp_init_cwnd(tsk);
+    tsk->snd_ssthresh = TCP_INFINITE_SSTHRESH;
+    tsk->snd_cwnd_cnt = 0;
+    tsk->ca_state = TCP_CA_OPEN;
+    tsk->dupacks = 0;
+
+    memset(tsk->ca_priv, 0, sizeof(tsk->ca_priv));
+    tsk->ca_ops->init(tsk);
+}
+
+/* Caller holds write_queue.lock, or the connection is not up yet */
+int tcp_set_congestion_control(struct tcp_sock *tsk, const char *name)
+{
+    struct tcp_congestion_ops *ops = tcp_cong_find(name);
+
+    if (!ops) return -ENOENT;
+
+    tsk->ca_ops = ops;
+    memset(tsk->ca_priv, 0, sizeof(tsk->ca_priv));
+    ops->init(tsk);
+
+    return 0;
+}
+
+/* RFC 5681 4.1, restart from at most the initial window after idling */
+void tcp_cwnd_restart(struct tcp_sock *tsk)
+{
+    uint32_t restart = tcp_init_cwnd(tsk);
+
+    if (tsk->snd_cwnd > restart) tsk->snd_cwnd = restart;
+
+    tsk->snd_cwnd_cnt = 0;
+
+    if (tsk->ca_ops->restart) tsk->ca_ops->restart(tsk);
+}
+
+/*
+ * RFC 5681 3.1 with appropriate byte counting (RFC 3465, L = 2 MSS).
+ * Returns the acked bytes left over once cwnd reaches ssthresh.
+ */
+uint32_t tcp_slow_start(struct tcp_sock *tsk, uint32_t acked)
+{
+    uint32_t inc = acked < 2 * tsk->mss ? acked : 2 * tsk->mss;
+    uint32_t room = tsk->snd_ssthresh - tsk->snd_cwnd;
+
+    if (inc > room) inc = room;
+
+    tsk->snd_cwnd += inc;
+
+    return inc < acked && tsk->snd_cwnd >= tsk->snd_ssthresh ? acked - inc : 0;
+}
+
+/* Additive increase, one MSS for every w bytes acknowledged */
+void tcp_cong_avoid_ai(struct tcp_sock *tsk, uint32_t w, uint32_t acked)
+{
+    tsk->snd_cwnd_cnt += acked;
+
+    if (tsk->snd_cwnd_cnt >= w) {
+        uint32_t delta = tsk->snd_cwnd_cnt / w;
+
+        tsk->snd_cwnd_cnt -= delta * w;
+        tsk->snd_cwnd += delta * tsk->mss;
+    }
+}
+
+/*
+ * NewReno, RFC 5681 and RFC 6582. The recovery part is common to all
+ * algorithms, what remains is slow start, additive increase and halving
+ * the flight size on loss.
+ */
+static void tcp_newreno_init(struct tcp_sock *tsk)
+{
+}
+
+static void tcp_newreno_cong_avoid(struct tcp_sock *tsk, uint32_t acked)
+{
+    if (tsk->snd_cwnd < tsk->snd_ssthresh) {
+        acked = tcp_slow_start(tsk, acked);
+        if (!acked) return;
+    }
+
+    tcp_cong_avoid_ai(tsk, tsk->snd_cwnd, acked);
+}
+
+static uint32_t tcp_newreno_ssthresh(struct tcp_sock *tsk)
+{
+    uint32_t flight = tsk->snd_max - tsk->tcb.snd_una;
+
+    return flight / 2 > 2 * tsk->mss ? flight / 2 : 2 * tsk->mss;
+}
+
+struct tcp_congestion_ops tcp_newreno = {
+    .name = "newreno",
+    .init = &tcp_newreno_init,
+    .cong_avoid = &tcp_newreno_cong_avoid,
+    .ssthresh = &tcp_newreno_ssthresh,
+};
@@ -0,0 +1,110 @@
+#include "syshead.h"
+#include "tcp.h"
+#include "tcp_cong.h"
+#include "tcp_timer.h"
+#include <math.h>
+
+/*
+ * CUBIC, RFC 9438. The window grows as a cubic function of the time since
+ * the last loss, centered on the window where that loss happened, so that
+ * it recovers quickly on paths with a large bandwidth-delay product and
+ * probes carefully around the previous maximum. Windows are in segments.
+ */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+struct cubic {
+    uint64_t epoch_start; /* ms, 0 until congestion avoidance starts */
+    double w_max; /* Window before the last reduction */
+    double k; /* s until the window is back at w_max */
+    double w_est; /* Window Reno would have, for the Reno-friendly region */
+    double cnt; /* Increase in bytes not yet applied to cwnd */
+};
+
+_Static_assert(sizeof(struct cubic) <= TCP_CA_PRIV_SIZE * sizeof(uint64_t),
+               "CUBIC state does not fit the socket");
+
+static void cubic_init(struct tcp_sock *tsk)
+{
+    memset(tcp_ca(tsk), 0, sizeof(struct cubic));
+}
+
+static void cubic_cong_avoid(struct tcp_sock *tsk, uint32_t acked)
+{
+    struct cubic *ca = tcp_ca(tsk);
+    double cwnd, target, t;
+    uint64_t now;
+
+    if (tsk->snd_cwnd < tsk->snd_ssthresh) {
+        acked = tcp_slow_start(tsk, acked);
+        if (!acked) return;
+    }
+
+    now = tcp_clock_us() / 1000;
+    cwnd = (double)tsk->snd_cwnd / tsk->mss;
+
+    if (!ca->epoch_start) {
+        ca->epoch_start = now;
+        ca->w_est = cwnd;
+        ca->cnt = 0;
+
+        if (cwnd < ca->w_max) {
+            ca->k = cbrt((ca->w_max - cwnd) / CUBIC_C);
+        } else {
+            ca->k = 0;
+            ca->w_max = cwnd;
+        }
+    }
+
+    /* Aim where the curve will be one RTT from now */
+    t = (now - ca->epoch_start + tsk->srtt / 1000) / 1000.0;
+    target = CUBIC_C * (t - ca->k) * (t - ca->k) * (t - ca->k) + ca->w_max;
+
+    if (target > 1.5 * cwnd) target = 1.5 * cwnd;
+
+    /* Never grow slower than Reno would, 4.3 */
+    ca->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / tsk->snd_cwnd;
+    if (ca->w_est > target) target = ca->w_est;
+
+    if (target <= cwnd) return;
+
+    ca->cnt += (target - cwnd) / cwnd * acked;
+
+    if (ca->cnt >= 1) {
+        tsk->snd_cwnd += (uint32_t)ca->cnt;
+        ca->cnt -= (uint32_t)ca->cnt;
+    }
+}
+
+static uint32_t cubic_ssthresh(struct tcp_sock *tsk)
+{
+    struct cubic *ca = tcp_ca(tsk);
+    double cwnd = (double)tsk->snd_cwnd / tsk->mss;
+    uint32_t ssthresh = tsk->snd_cwnd * CUBIC_BETA;
+
+    ca->epoch_start = 0;
+
+    /* Fast convergence, 4.7: yield to flows that were growing meanwhile */
+    if (cwnd < ca->w_max) {
+        ca->w_max = cwnd * (1 + CUBIC_BETA) / 2;
+    } else {
+        ca->w_max = cwnd;
+    }
+
+    return ssthresh > 2 * tsk->mss ? ssthresh : 2 * tsk->mss;
+}
+
+static void cubic_restart(struct tcp_sock *tsk)
+{
+    struct cubic *ca = tcp_ca(tsk);
+
+    ca->epoch_start = 0;
+}
+
+struct tcp_congestion_ops tcp_cubic = {
+    .name = "cubic",
+    .init = &cubic_init,
+    .cong_avoid = &cubic_cong_avoid,
+    .ssthresh = &cubic_ssthresh,
+    .restart = &cubic_restart,
+};
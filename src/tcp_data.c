@@ -1,25 +1,87 @@
 #include "syshead.h"
 #include "tcp.h"
+#include "tcp_timer.h"
+#include "shard.h"
+
+extern int tcp_rmem_max;
+
+/*
+ * Dynamic right-sizing, after Linux. Once per RTT the buffer is sized to
+ * twice what the reader took in that RTT, more while that amount grows, so
+ * that the window does not hold back a sender that the reader keeps up with.
+ */
+static void tcp_rcv_space_adjust(struct tcp_sock *tsk)
+{
+    uint32_t rtt = __atomic_load_n(&tsk->rcv_rtt_est, __ATOMIC_RELAXED);
+    uint64_t now = tcp_clock_us();
+    uint32_t copied;
+
+    if (!rtt || now - tsk->rcvq_time < rtt) return;
+
+    copied = tsk->copied_seq - tsk->rcvq_seq;
+
+    if (copied > tsk->rcvq_space) {
+        uint64_t rcvwin = 2 * (uint64_t)copied + 16 * tsk->advmss;
+
+        rcvwin += 2 * rcvwin * (copied - tsk->rcvq_space) / tsk->rcvq_space;
+        if (rcvwin > tcp_rmem_max) rcvwin = tcp_rmem_max;
+
+        if (!tsk->rcvbuf_lock && rcvwin > tsk->rcvbuf) {
+            __atomic_store_n(&tsk->rcvbuf, rcvwin, __ATOMIC_RELAXED);
+            print_debug("TCP rcvbuf grown to %u for %u bytes in %u us\n",
+                        (uint32_t)rcvwin, copied, rtt);
+        }
+
+        tsk->rcvq_space = copied;
+    }
+
+    tsk->rcvq_seq = tsk->copied_seq;
+    tsk->rcvq_time = now;
+}
+
+/*
+ * Tells the peer about a window that reading opened up, once it is twice
+ * what the peer was offered last. A sender stalled on a small window has
+ * nothing to clock out ACKs with otherwise. Runs where the connection's
+ * state lives, see sock_run.
+ */
+static int tcp_cleanup_rbuf(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+    struct tcb *tcb = &tsk->tcb;
+    uint32_t edge = tsk->last_ack_sent + tcb->rcv_wnd;
+    uint32_t cur = after(edge, tcb->rcv_nxt) ? edge - tcb->rcv_nxt : 0;
+    uint32_t space = tcp_space(tsk);
+
+    if (space >= 2 * cur && space - cur >= tsk->rcv_mss) {
+        return tcp_send_ack(&tsk->sk);
+    }
+
+    return 0;
+}
 
 int tcp_data_dequeue(struct tcp_sock *tsk, void *user_buf, int userlen)
 {
     struct sock *sk = &tsk->sk;
-    struct tcphdr *th;
     int rlen = 0;
+    int ring;
 
+    /* A ring's producer never takes the lock, it only keeps readers of the
+     * same socket from consuming the same skb */
     pthread_mutex_lock(&sk->receive_queue.lock);
 
+    ring = skb_queue_is_ring(&sk->receive_queue);
+
     while (!skb_queue_empty(&sk->receive_queue) && rlen < userlen) {
         struct sk_buff *skb = skb_peek(&sk->receive_queue);
         if (skb == NULL) break;
-        
-        th = tcp_hdr(skb);
 
         /* Guard datalen to not overflow userbuf */
         int dlen = (rlen + skb->dlen) > userlen ? (userlen - rlen) : skb->dlen;
         memcpy(user_buf, skb->payload, dlen);
 
         /* Accommodate next round of data dequeue */
+        tcp_rmem_uncharge(tsk, dlen);
         skb->dlen -= dlen;
         skb->payload += dlen;
         rlen += dlen;
@@ -27,35 +89,235 @@ int tcp_data_dequeue(struct tcp_sock *tsk, void *user_buf, int userlen)
 
         /* skb is fully eaten, process flags and drop it */
         if (skb->dlen == 0) {
-            if (th->psh) tsk->flags |= TCP_PSH;
             skb_dequeue(&sk->receive_queue);
             free_skb(skb);
         }
     }
-    
+
+    if (rlen > 0 && ring) {
+        tsk->copied_seq += rlen;
+        tcp_rcv_space_adjust(tsk);
+    }
+
     pthread_mutex_unlock(&sk->receive_queue.lock);
 
+    /* Not under the queue's lock, which the receiving side takes inside
+     * the socket's */
+    if (rlen > 0 && ring) sock_run(sk, tcp_cleanup_rbuf, tsk);
+
     return rlen;
 }
 
-int tcp_data_queue(struct tcp_sock *tsk, struct sk_buff *skb,
-                   struct tcphdr *th, struct tcp_segment *seg)
+/* Cuts len bytes that rcv_nxt already covers off the front of a segment */
+static void tcp_trim_head(struct sk_buff *skb, uint32_t len)
+{
+    skb->payload += len;
+    skb->dlen -= len;
+    skb->seq += len;
+}
+
+/*
+ * Files a segment that lies beyond rcv_nxt by sequence number. Bytes that
+ * queued segments already hold are cut from it, queued segments it covers
+ * completely are dropped.
+ */
+static void tcp_ofo_queue(struct tcp_sock *tsk, struct sk_buff *skb)
+{
+    struct sk_buff_head *ofo = &tsk->ofo_queue;
+    struct list_head *prev = ofo->head.prev;
+    struct sk_buff *next;
+
+    /* Walk back from the tail, reordered segments mostly arrive in order */
+    while (prev != &ofo->head && after(list_entry(prev, struct sk_buff, list)->seq, skb->seq)) {
+        prev = prev->prev;
+    }
+
+    if (prev != &ofo->head) {
+        struct sk_buff *p = list_entry(prev, struct sk_buff, list);
+
+        if (!before(p->end_seq, skb->end_seq)) {
+            free_skb(skb);
+            return;
+        }
+
+        if (after(p->end_seq, skb->seq)) tcp_trim_head(skb, p->end_seq - skb->seq);
+    }
+
+    list_add(&skb->list, prev);
+    ofo->qlen += 1;
+
+    while ((next = skb_queue_next(ofo, skb)) != NULL && before(next->seq, skb->end_seq)) {
+        if (after(next->end_seq, skb->end_seq)) {
+            /* Partial overlap, the next segment keeps the shared bytes */
+            skb->dlen = next->seq - skb->seq;
+            skb->end_seq = next->seq;
+            tcp_hdr(skb)->fin = 0;
+            break;
+        }
+
+        list_del(&next->list);
+        ofo->qlen -= 1;
+        tcp_rmem_uncharge(tsk, next->dlen);
+        free_skb(next);
+    }
+
+    tcp_rmem_charge(tsk, skb->dlen);
+}
+
+/* Empties the out-of-order queue and uncharges what it held */
+void tcp_ofo_purge(struct tcp_sock *tsk)
+{
+    struct sk_buff *skb;
+
+    while ((skb = skb_peek(&tsk->ofo_queue)) != NULL) {
+        skb_dequeue(&tsk->ofo_queue);
+        tcp_rmem_uncharge(tsk, skb->dlen);
+        free_skb(skb);
+    }
+}
+
+/* Keeps the block that holds seq in front, RFC 2018 4 */
+static void tcp_sack_add(struct tcp_sock *tsk, struct tcp_sack_block *blk, uint32_t seq)
+{
+    if (!before(seq, blk->start_seq) && before(seq, blk->end_seq)) {
+        int n = tsk->num_sacks < TCP_MAX_SACKS ? tsk->num_sacks : TCP_MAX_SACKS - 1;
+
+        memmove(&tsk->sacks[1], &tsk->sacks[0], n * sizeof(struct tcp_sack_block));
+        tsk->sacks[0] = *blk;
+        tsk->num_sacks = n + 1;
+    } else if (tsk->num_sacks < TCP_MAX_SACKS) {
+        tsk->sacks[tsk->num_sacks++] = *blk;
+    }
+}
+
+/* Rebuilds the SACK blocks from the out-of-order queue, seq being the
+ * latest arrival */
+static void tcp_sack_update(struct tcp_sock *tsk, uint32_t seq)
+{
+    struct tcp_sack_block blk = { 0, 0 };
+    struct list_head *item;
+    struct sk_buff *skb;
+    int open = 0;
+
+    tsk->num_sacks = 0;
+    if (!tsk->sack_ok) return;
+
+    list_for_each(item, &tsk->ofo_queue.head) {
+        skb = list_entry(item, struct sk_buff, list);
+
+        if (open && !after(skb->seq, blk.end_seq)) {
+            if (after(skb->end_seq, blk.end_seq)) blk.end_seq = skb->end_seq;
+            continue;
+        }
+
+        if (open) tcp_sack_add(tsk, &blk, seq);
+
+        blk.start_seq = skb->seq;
+        blk.end_seq = skb->end_seq;
+        open = 1;
+    }
+
+    if (open) tcp_sack_add(tsk, &blk, seq);
+}
+
+/*
+ * Hands an in-sequence segment to the reader and moves rcv_nxt up to its
+ * end, short of the FIN. Returns 1 for a FIN, -1 if the segment was dropped.
+ */
+static int tcp_queue_rcv(struct tcp_sock *tsk, struct sk_buff *skb)
 {
     struct sock *sk = &tsk->sk;
+    uint32_t end_seq = skb->end_seq;
+    int fin = tcp_hdr(skb)->fin;
+
+    if (skb->dlen == 0) {
+        free_skb(skb);
+    } else {
+        /* Charged first, the reader may take the data as soon as it is queued */
+        uint32_t dlen = skb->dlen;
+
+        tcp_rmem_charge(tsk, dlen);
+
+        if (skb_queue_tail(&sk->receive_queue, skb) != 0) {
+            /* A full receive ring drops the segment, the peer will resend it */
+            tcp_rmem_uncharge(tsk, dlen);
+            free_skb(skb);
+            return -1;
+        }
+    }
+
+    tsk->tcb.rcv_nxt = end_seq - fin;
+
+    return fin;
+}
+
+/* Moves out-of-order segments that rcv_nxt has caught up with to the reader */
+static int tcp_ofo_drain(struct tcp_sock *tsk)
+{
+    struct sk_buff_head *ofo = &tsk->ofo_queue;
     struct tcb *tcb = &tsk->tcb;
-    int rc = 0;
-    
-    /* if (seg->seq == tcb->rcv_nxt) { */
-    /*     if (!tcb->rcv_wnd) { */
-    /*         goto out; */
-    /*     } */
+    struct sk_buff *skb;
+    int rc;
+
+    while ((skb = skb_peek(ofo)) != NULL && !after(skb->seq, tcb->rcv_nxt)) {
+        skb_dequeue(ofo);
+        tcp_rmem_uncharge(tsk, skb->dlen);
 
-    /* } */
+        if (!after(skb->end_seq, tcb->rcv_nxt)) {
+            free_skb(skb);
+            continue;
+        }
+
+        if (before(skb->seq, tcb->rcv_nxt)) tcp_trim_head(skb, tcb->rcv_nxt - skb->seq);
+
+        if ((rc = tcp_queue_rcv(tsk, skb)) < 0) break;
+
+        if (rc > 0) {
+            /* Nothing follows the FIN */
+            tcp_ofo_purge(tsk);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Queues the data of an acceptable segment. Segments beyond rcv_nxt wait
+ * in the out-of-order queue until the gap before them is filled. Returns 1
+ * once the peer's FIN is in sequence and -1 if the segment was dropped.
+ */
+int tcp_data_queue(struct tcp_sock *tsk, struct sk_buff *skb,
+                   struct tcphdr *th, struct tcp_segment *seg)
+{
+    struct tcb *tcb = &tsk->tcb;
+    int rc;
 
     skb->dlen = seg->dlen;
-    skb->payload = th->data;
-        
-    skb_queue_tail(&sk->receive_queue, skb);
-    
+    skb->payload = (uint8_t *)th + tcp_hlen(th);
+    skb->seq = seg->seq;
+    skb->end_seq = seg->seq + seg->dlen + th->fin;
+
+    if (skb->seq == skb->end_seq) {
+        free_skb(skb);
+        return 0;
+    }
+
+    if (after(skb->seq, tcb->rcv_nxt)) {
+        uint32_t seq = skb->seq;
+
+        tcp_ofo_queue(tsk, skb);
+        tcp_sack_update(tsk, seq);
+        return 0;
+    }
+
+    /* The acceptability test lets in segments that start before rcv_nxt */
+    if (before(skb->seq, tcb->rcv_nxt)) tcp_trim_head(skb, tcb->rcv_nxt - skb->seq);
+
+    if ((rc = tcp_queue_rcv(tsk, skb)) != 0) return rc;
+
+    rc = tcp_ofo_drain(tsk);
+    if (tsk->num_sacks) tcp_sack_update(tsk, tcb->rcv_nxt);
+
     return rc;
 }
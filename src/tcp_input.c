@@ -3,6 +3,11 @@
 #include "tcp_data.h"
 #include "skbuff.h"
 #include "sock.h"
+#include "tcp_timer.h"
+#include "inet.h"
+#include "shard.h"
+
+extern int tcp_syncookies;
 
 static inline int tcp_drop(struct tcp_sock *tsk, struct sk_buff *skb)
 {
@@ -10,63 +15,711 @@ static inline int tcp_drop(struct tcp_sock *tsk, struct sk_buff *skb)
     return 0;
 }
 
-static int tcp_verify_segment(struct tcp_sock *tsk, struct tcphdr *th, struct tcp_segment *seg)
+/* RTO from the current estimate, without backoff */
+static void tcp_set_rto(struct tcp_sock *tsk)
+{
+    uint32_t rto = TCP_RTO_INITIAL;
+
+    if (tsk->srtt) rto = (tsk->srtt + 4 * tsk->rttvar) / 1000;
+
+    if (rto < TCP_RTO_MIN) rto = TCP_RTO_MIN;
+    if (rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+
+    tsk->rto = rto;
+}
+
+/* RFC 6298 2.2 and 2.3, r is the measured RTT in us */
+static void tcp_rtt_estimator(struct tcp_sock *tsk, uint32_t r)
+{
+    if (!tsk->srtt) {
+        tsk->srtt = r ? r : 1;
+        tsk->rttvar = r / 2;
+    } else {
+        uint32_t delta = tsk->srtt > r ? tsk->srtt - r : r - tsk->srtt;
+
+        tsk->rttvar = (3 * tsk->rttvar + delta) / 4;
+        tsk->srtt = (7 * tsk->srtt + r) / 8;
+    }
+
+    tcp_set_rto(tsk);
+}
+
+/*
+ * Drops the segments that ack covers from the write queue, takes an RTT
+ * sample and restarts or stops the retransmission timer.
+ */
+static void tcp_clean_rtx_queue(struct tcp_sock *tsk, uint32_t ack)
+{
+    struct sk_buff *skb;
+
+    while ((skb = skb_peek(&tsk->write_queue)) != NULL && !after(skb->end_seq, ack)) {
+        if (skb == tsk->send_head) tsk->send_head = skb_queue_next(&tsk->write_queue, skb);
+
+        skb_dequeue(&tsk->write_queue);
+        free_skb(skb);
+    }
+
+    /* Writers wait for sndbuf to free up */
+    socket_wake(tsk->sk.sock, POLLOUT);
+
+    if (tsk->rtt_pending && !after(tsk->rtt_seq, ack)) {
+        tcp_rtt_estimator(tsk, tcp_clock_us() - tsk->rtt_start);
+        tsk->rtt_pending = 0;
+    } else if (tsk->backoff) {
+        /* New data is acknowledged, so the backoff is over */
+        tcp_set_rto(tsk);
+    }
+
+    tsk->backoff = 0;
+
+    if (ack == tsk->snd_max) {
+        tcp_stop_rto_timer(tsk);
+    } else {
+        tcp_reset_rto_timer(tsk);
+    }
+}
+
+/*
+ * Three duplicate ACKs start fast retransmit and NewReno fast recovery,
+ * RFC 6582 3.2. Further ones each stand for a segment that left the
+ * network and inflate the window by one.
+ */
+static void tcp_dupack(struct tcp_sock *tsk)
+{
+    struct sk_buff *skb;
+
+    switch (tsk->ca_state) {
+    case TCP_CA_RECOVERY:
+        tsk->snd_cwnd += tsk->mss;
+        return;
+    case TCP_CA_LOSS:
+        return;
+    }
+
+    if (++tsk->dupacks < TCP_FASTRETRANS_THRESH) return;
+
+    /* Losses of the previous recovery's window do not count again */
+    if (!after(tsk->tcb.snd_una, tsk->high_seq)) return;
+
+    if ((skb = skb_peek(&tsk->write_queue)) == NULL) return;
+
+    tsk->snd_ssthresh = tsk->ca_ops->ssthresh(tsk);
+    tsk->snd_cwnd = tsk->snd_ssthresh + TCP_FASTRETRANS_THRESH * tsk->mss;
+    tsk->snd_cwnd_cnt = 0;
+    tsk->high_seq = tsk->snd_max;
+    tsk->ca_state = TCP_CA_RECOVERY;
+
+    tcp_retransmit_skb(&tsk->sk, skb);
+}
+
+/* New data was acknowledged, acked bytes of it */
+static void tcp_cong_control(struct tcp_sock *tsk, uint32_t ack, uint32_t acked)
 {
-    /* struct tcb *tcb = &tsk->tcb; */
+    struct sk_buff *skb;
+
+    tsk->dupacks = 0;
+
+    switch (tsk->ca_state) {
+    case TCP_CA_RECOVERY:
+        if (before(ack, tsk->high_seq)) {
+            /* Partial ACK, the next hole is lost as well */
+            if ((skb = skb_peek(&tsk->write_queue)) != NULL) {
+                tcp_retransmit_skb(&tsk->sk, skb);
+            }
+
+            tsk->snd_cwnd = tsk->snd_cwnd > acked ? tsk->snd_cwnd - acked : 0;
+            if (acked >= tsk->mss) tsk->snd_cwnd += tsk->mss;
+            if (tsk->snd_cwnd < tsk->mss) tsk->snd_cwnd = tsk->mss;
+            return;
+        }
+
+        /* Full ACK, deflate the window */
+        uint32_t flight = tsk->snd_max - ack + tsk->mss;
+
+        tsk->snd_cwnd = flight < tsk->snd_ssthresh ? flight : tsk->snd_ssthresh;
+        tsk->ca_state = TCP_CA_OPEN;
+        return;
+    case TCP_CA_LOSS:
+        if (!before(ack, tsk->high_seq)) tsk->ca_state = TCP_CA_OPEN;
+        break;
+    }
+
+    tsk->ca_ops->cong_avoid(tsk, acked);
+}
+
+/* RFC 793 window update, from segments that are not older than the last
+ * one that updated it */
+static int tcp_update_window(struct tcp_sock *tsk, struct tcp_segment *seg)
+{
+    struct tcb *tcb = &tsk->tcb;
+
+    if (before(tcb->snd_wl1, seg->seq) ||
+        (tcb->snd_wl1 == seg->seq && !after(tcb->snd_wl2, seg->ack))) {
+        int changed = tcb->snd_wnd != seg->win;
+
+        tcb->snd_wnd = seg->win;
+        tcb->snd_wl1 = seg->seq;
+        tcb->snd_wl2 = seg->ack;
+        if (seg->win > tsk->max_window) tsk->max_window = seg->win;
+
+        return changed;
+    }
 
     return 0;
 }
 
+/* Marks the segments that SACK blocks report the peer to hold, RFC 2018 */
+static void tcp_sacktag_write_queue(struct tcp_sock *tsk, struct tcp_options *opts)
+{
+    struct sk_buff *skb;
+
+    for (int i = 0; i < opts->num_sacks; i++) {
+        struct tcp_sack_block *sp = &opts->sacks[i];
+
+        /* Blocks below snd_una or beyond what was sent tell nothing */
+        if (before(sp->start_seq, tsk->tcb.snd_una) || after(sp->end_seq, tsk->snd_max) ||
+            !before(sp->start_seq, sp->end_seq)) continue;
+
+        for (skb = skb_peek(&tsk->write_queue); skb != NULL && before(skb->seq, sp->end_seq);
+             skb = skb_queue_next(&tsk->write_queue, skb)) {
+            if (!before(skb->seq, sp->start_seq) && !after(skb->end_seq, sp->end_seq)) skb->sacked = 1;
+        }
+    }
+}
+
+/*
+ * Processes the acknowledgment and window of an incoming segment: trims
+ * the write queue and feeds congestion control. What the windows allow
+ * now is sent once the segment's data is in, so it carries the ACK.
+ */
+static void tcp_ack(struct tcp_sock *tsk, struct tcp_segment *seg)
+{
+    struct tcb *tcb = &tsk->tcb;
+    uint32_t ack = seg->ack;
+    uint32_t acked;
+    int wnd_changed;
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+
+    wnd_changed = tcp_update_window(tsk, seg);
+
+    if (tsk->sack_ok && seg->opts.num_sacks) tcp_sacktag_write_queue(tsk, &seg->opts);
+
+    if (ack == tcb->snd_una) {
+        /* RFC 5681 2, a duplicate carries no data, leaves the window alone
+         * and data outstanding */
+        if (!seg->len && !wnd_changed && tsk->snd_max != tcb->snd_una) tcp_dupack(tsk);
+    } else if (after(ack, tcb->snd_una) && !after(ack, tsk->snd_max)) {
+        acked = ack - tcb->snd_una;
+        tcb->snd_una = ack;
+        tcb->seq = ack;
+
+        /* After a timeout, the peer may have had more than was resent */
+        if (before(tcb->snd_nxt, ack)) tcb->snd_nxt = ack;
+
+        tcp_clean_rtx_queue(tsk, ack);
+        tcp_cong_control(tsk, ack, acked);
+    }
+
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+}
+
+/* Takes the largest segment seen as the peer's MSS, segments offloaded
+ * in bulk count as one of ours */
+static void tcp_measure_rcv_mss(struct tcp_sock *tsk, struct tcp_segment *seg)
+{
+    if (seg->dlen > tsk->rcv_mss) {
+        tsk->rcv_mss = seg->dlen < tsk->advmss ? seg->dlen : tsk->advmss;
+    }
+}
+
+/*
+ * The receiver's RTT, which receive buffer auto-tuning runs on: the age of
+ * an echoed timestamp, or else how long a window of data takes to arrive.
+ * Timestamps tick in ms, faster paths are taken for 1 ms.
+ */
+static void tcp_rcv_rtt_measure(struct tcp_sock *tsk, struct tcp_segment *seg)
+{
+    uint64_t now = tcp_clock_us();
+    uint32_t est = tsk->rcv_rtt_est;
+    uint32_t sample;
+
+    if (tsk->tstamp_ok && seg->opts.saw_tstamp && seg->opts.tsecr) {
+        sample = (tcp_time_stamp() - seg->opts.tsecr) * 1000;
+        if (sample == 0) sample = 1000;
+    } else {
+        if (tsk->rcv_rtt_time && !after(tsk->rcv_rtt_seq, tsk->tcb.rcv_nxt)) {
+            sample = now - tsk->rcv_rtt_time;
+        } else if (tsk->rcv_rtt_time) {
+            return;
+        } else {
+            sample = 0;
+        }
+
+        tsk->rcv_rtt_seq = tsk->tcb.rcv_nxt + tsk->tcb.rcv_wnd;
+        tsk->rcv_rtt_time = now;
+
+        if (sample == 0) return;
+    }
+
+    est = est ? est - (est >> 3) + (sample >> 3) : sample;
+    __atomic_store_n(&tsk->rcv_rtt_est, est, __ATOMIC_RELAXED);
+}
+
+/*
+ * RFC 1122 4.2.3.2 and RFC 5681 4.2: an ACK goes out for at least every
+ * second full-sized segment and at once in quick-ACK mode, otherwise the
+ * delayed ACK timer sends it.
+ */
+static void tcp_ack_snd_check(struct tcp_sock *tsk)
+{
+    if (!tsk->ack_pending) return;
+
+    if (tsk->quickack || tsk->tcb.rcv_nxt - tsk->last_ack_sent > tsk->rcv_mss) {
+        tcp_send_ack(&tsk->sk);
+    } else if (!timer_pending(&tsk->delack_timer)) {
+        tcp_reset_delack_timer(tsk);
+    }
+}
+
+static inline int tcp_in_rcv_wnd(struct tcb *tcb, uint32_t seq)
+{
+    return !before(seq, tcb->rcv_nxt) && before(seq, tcb->rcv_nxt + tcb->rcv_wnd);
+}
+
+/* RFC 793 acceptability test, the segment has to overlap the receive window */
+static int tcp_verify_segment(struct tcp_sock *tsk, struct tcphdr *th, struct tcp_segment *seg)
+{
+    struct tcb *tcb = &tsk->tcb;
+
+    if (seg->len == 0) {
+        if (tcb->rcv_wnd == 0) return seg->seq == tcb->rcv_nxt ? 0 : -1;
+
+        return tcp_in_rcv_wnd(tcb, seg->seq) ? 0 : -1;
+    }
+
+    if (tcb->rcv_wnd == 0) return -1;
+
+    return tcp_in_rcv_wnd(tcb, seg->seq) || tcp_in_rcv_wnd(tcb, seg->seq_last) ? 0 : -1;
+}
+
 static inline int tcp_discard(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th)
 {
     free_skb(skb);
     return 0;
 }
 
-static int tcp_listen(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th)
+static inline uint32_t tcp_get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Options are still in network order, unlike the rest of the header */
+static void tcp_parse_options(struct tcphdr *th, struct tcp_options *opts)
+{
+    uint8_t *opt = th->data;
+    uint8_t *end = (uint8_t *)th + tcp_hlen(th);
+
+    memset(opts, 0, sizeof(struct tcp_options));
+    opts->mss = TCP_DEFAULT_MSS;
+
+    while (opt < end && *opt != TCP_OPT_END) {
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) break;
+
+        switch (opt[0]) {
+        case TCP_OPT_MSS:
+            if (opt[1] == TCP_OPTLEN_MSS && th->syn) opts->mss = (opt[2] << 8) | opt[3];
+            break;
+        case TCP_OPT_WSCALE:
+            if (opt[1] == TCP_OPTLEN_WSCALE && th->syn) {
+                opts->saw_wscale = 1;
+                opts->wscale = opt[2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : opt[2];
+            }
+            break;
+        case TCP_OPT_SACK_PERM:
+            if (opt[1] == TCP_OPTLEN_SACK_PERM && th->syn) opts->sack_ok = 1;
+            break;
+        case TCP_OPT_TIMESTAMP:
+            if (opt[1] == TCP_OPTLEN_TIMESTAMP) {
+                opts->saw_tstamp = 1;
+                opts->tsval = tcp_get_be32(opt + 2);
+                opts->tsecr = tcp_get_be32(opt + 6);
+            }
+            break;
+        case TCP_OPT_SACK:
+            if ((opt[1] - 2) % TCP_OPTLEN_SACK_BLOCK == 0) {
+                for (uint8_t *b = opt + 2; b < opt + opt[1] && opts->num_sacks < TCP_MAX_SACKS;
+                     b += TCP_OPTLEN_SACK_BLOCK) {
+                    opts->sacks[opts->num_sacks].start_seq = tcp_get_be32(b);
+                    opts->sacks[opts->num_sacks].end_seq = tcp_get_be32(b + 4);
+                    opts->num_sacks++;
+                }
+            }
+            break;
+        }
+
+        opt += opt[1];
+    }
+}
+
+/* Settles on the options both ends offered, from the SYN-ACK */
+static void tcp_negotiate_options(struct tcp_sock *tsk, struct tcp_options *opts)
+{
+    /* Our own MTU bounds the segments just as well */
+    tsk->mss = opts->mss < tsk->advmss ? opts->mss : tsk->advmss;
+    /* A tiny or zero MSS would leave no room for data */
+    if (tsk->mss < TCP_MIN_MSS) tsk->mss = TCP_MIN_MSS;
+
+    tsk->wscale_ok &= opts->saw_wscale;
+    if (tsk->wscale_ok) {
+        tsk->snd_wscale = opts->wscale;
+    } else {
+        tsk->snd_wscale = 0;
+        tsk->rcv_wscale = 0;
+    }
+
+    tsk->sack_ok &= opts->sack_ok;
+
+    tsk->tstamp_ok &= opts->saw_tstamp;
+    if (tsk->tstamp_ok) {
+        tsk->ts_recent = opts->tsval;
+        /* Every segment carries them from now on */
+        tsk->mss -= TCP_OPTLEN_TS_ALIGNED;
+    }
+}
+
+/*
+ * The peer reset the connection, RFC 793 3.9: what is left to send or
+ * receive is dropped, and the user learns of it from its next read or
+ * write. A handshake we started is refused instead.
+ */
+static void tcp_reset(struct tcp_sock *tsk)
+{
+    struct sock *sk = &tsk->sk;
+
+    tcp_clear_timers(tsk);
+    tcp_ofo_purge(tsk);
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+    skb_queue_free(&tsk->write_queue);
+    tsk->send_head = NULL;
+    tsk->err = sk->state == TCP_SYN_RECEIVED ? ECONNREFUSED : ECONNRESET;
+    sk->state = TCP_CLOSE;
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+
+    socket_wake(sk->sock, POLLIN | POLLOUT);
+}
+
+/* The handshake is complete, on either end */
+static void tcp_set_established(struct tcp_sock *tsk)
+{
+    struct tcb *tcb = &tsk->tcb;
+
+    /* The peer's MSS is known now */
+    tcp_init_congestion_control(tsk);
+
+    /* Every segment is ACKed while the peer's window grows */
+    tsk->rcv_mss = tsk->mss;
+    tsk->quickack = TCP_MAX_QUICKACKS;
+
+    /* Auto-tuning starts from what the first flight may bring */
+    tsk->copied_seq = tcb->rcv_nxt;
+    tsk->rcvq_seq = tcb->rcv_nxt;
+    tsk->rcvq_space = tcb->rcv_wnd < 10 * tsk->advmss ? tcb->rcv_wnd : 10 * tsk->advmss;
+    tsk->rcvq_time = tcp_clock_us();
+
+    /* From now on the rx thread feeds the reader without the queue lock */
+    skb_queue_ring_init(&tsk->sk.receive_queue, TCP_RCV_RING);
+
+    tsk->sk.state = TCP_ESTABLISHED;
+    tcb->seq = tcb->snd_nxt;
+}
+
+/*
+ * Opens a connection in SYN-RECEIVED for the SYN a listener got, from the
+ * options it carried, and parks it in the listener's SYN queue. The caller
+ * holds the queue's lock, and hashes the connection once it set it up.
+ */
+static struct tcp_sock *tcp_listen_child(struct tcp_sock *tsk, struct sk_buff *skb,
+                                         struct tcphdr *th, struct tcp_options *opts,
+                                         uint32_t isn)
+{
+    struct tcp_accept_queue *queue = &tsk->accept_queue;
+    struct iphdr *iph = ip_hdr(skb);
+    struct tcp_sock *newtsk;
+    struct socket *newsock;
+    struct sock *newsk;
+
+    if ((newsock = socket_new_conn(tsk->sk.sock)) == NULL) return NULL;
+
+    newsk = newsock->sk;
+    newtsk = tcp_sk(newsk);
+
+    newsk->saddr = iph->daddr;
+    newsk->daddr = iph->saddr;
+    newsk->sport = th->dport;
+    newsk->dport = th->sport;
+    /* The connection's frames are steered to the shard running this */
+    newsk->shard = shard_of(inet_flow_hash(newsk->saddr, newsk->daddr,
+                                           newsk->sport, newsk->dport));
+
+    /* Socket options carry over from the listener */
+    newtsk->sndbuf = tsk->sndbuf;
+    newtsk->rcvbuf = tsk->rcvbuf;
+    newtsk->rcvbuf_lock = tsk->rcvbuf_lock;
+    newtsk->nonagle = tsk->nonagle;
+    newtsk->ca_ops = tsk->ca_ops;
+
+    tcp_connect_init(newsk);
+    tcp_negotiate_options(newtsk, opts);
+
+    newtsk->tcb.irs = isn;
+    newtsk->tcb.rcv_nxt = isn + 1;
+    newtsk->last_ack_sent = newtsk->tcb.rcv_nxt;
+
+    newsk->state = TCP_SYN_RECEIVED;
+    /* The listener outlives the connection's use of its queue */
+    newtsk->parent = tsk;
+    socket_get(tsk->sk.sock);
+    list_add_tail(&newtsk->accept_list, &queue->syn);
+    queue->syn_len++;
+
+    return newtsk;
+}
+
+/* A segment for a new connection, processed where its state lives */
+struct tcp_child_call {
+    struct sock *sk;
+    struct sk_buff *skb;
+    struct tcp_segment *seg;
+};
+
+static int tcp_child_input_call(void *arg)
+{
+    struct tcp_child_call *call = arg;
+
+    return tcp_input_state(call->sk, call->skb, call->seg);
+}
+
+static int tcp_send_synack_call(void *arg)
+{
+    return tcp_send_synack(arg);
+}
+
+/*
+ * An ACK to a listener may complete a handshake that was answered with a
+ * SYN cookie. The connection is only opened now, as if its SYN-ACK had
+ * just been sent, and the ACK is processed on it.
+ */
+static int tcp_listen_cookie(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th,
+                             struct tcp_segment *seg)
+{
+    struct tcp_accept_queue *queue = &tsk->accept_queue;
+    struct iphdr *iph = ip_hdr(skb);
+    struct tcp_options opts = seg->opts;
+    struct tcp_sock *newtsk;
+    struct tcp_child_call call;
+    struct tcb *tcb;
+
+    pthread_mutex_lock(&queue->lock);
+
+    /* The peer repeats the ACK, along with any data, until there is room */
+    if (tsk->sk.state != TCP_LISTEN || queue->ready_len >= queue->backlog) goto unlock;
+
+    /* Not a cookie of ours, RFC 793 3.4 */
+    if (tcp_syncookie_check(iph->daddr, iph->saddr, th->dport, th->sport,
+                            seg->seq - 1, seg->ack - 1, &opts) < 0) {
+        pthread_mutex_unlock(&queue->lock);
+        tcp_v4_send_reset(skb, seg);
+        free_skb(skb);
+        return 0;
+    }
+
+    if ((newtsk = tcp_listen_child(tsk, skb, th, &opts, seg->seq - 1)) == NULL) goto unlock;
+
+    tcb = &newtsk->tcb;
+    tcb->iss = seg->ack - 1;
+    tcb->snd_una = tcb->iss;
+    tcb->snd_up = tcb->iss;
+    tcb->snd_nxt = seg->ack;
+    tcb->seq = seg->ack;
+    newtsk->write_seq = seg->ack;
+    newtsk->snd_max = seg->ack;
+    newtsk->high_seq = tcb->iss;
+    /* The ACK sets the send window */
+    tcb->snd_wl1 = seg->seq - 1;
+
+    /* Segments find the connection from here on */
+    inet_hash(&newtsk->sk);
+
+    /* The listener may be closed and take the connection with it */
+    socket_get(newtsk->sk.sock);
+    pthread_mutex_unlock(&queue->lock);
+
+    /* Once hashed, the connection is no longer the listener's alone */
+    call.sk = &newtsk->sk;
+    call.skb = skb;
+    call.seg = seg;
+    sock_run(&newtsk->sk, tcp_child_input_call, &call);
+    socket_put(newtsk->sk.sock);
+
+    return 0;
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+    free_skb(skb);
+    return 0;
+}
+
+/*
+ * A SYN on a listening socket opens a connection in SYN-RECEIVED. It
+ * answers with a SYN-ACK and waits in the listener's SYN queue for the
+ * final ACK. Once the SYN queue is full, SYNs are answered with a cookie
+ * and no state instead, RFC 4987 3.6, or dropped without cookies so that
+ * the peer repeats them.
+ */
+static int tcp_listen(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th,
+                      struct tcp_segment *seg)
 {
+    struct tcp_accept_queue *queue = &tsk->accept_queue;
+    struct iphdr *iph = ip_hdr(skb);
+    struct tcp_sock *newtsk;
+    uint32_t cookie;
+
     tcpstate_dbg("state is listen");
+
+    if (th->rst) goto discard;
+
+    /* An ACK may only complete a handshake answered with a cookie */
+    if (th->ack) {
+        if (th->syn || tcp_syncookies == TCP_SYNCOOKIES_OFF) goto reset;
+        return tcp_listen_cookie(tsk, skb, th, seg);
+    }
+
+    if (!th->syn) goto discard;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (tsk->sk.state != TCP_LISTEN || queue->ready_len >= queue->backlog) goto unlock;
+
+    if (tcp_syncookies == TCP_SYNCOOKIES_ALWAYS ||
+        (queue->syn_len >= queue->backlog && tcp_syncookies == TCP_SYNCOOKIES_ON)) {
+        pthread_mutex_unlock(&queue->lock);
+
+        cookie = tcp_syncookie_make(iph->daddr, iph->saddr, th->dport, th->sport,
+                                    seg->seq, &seg->opts);
+        tcp_send_synack_cookie(tsk, skb, seg, cookie);
+        goto discard;
+    }
+
+    if (queue->syn_len >= queue->backlog) goto unlock;
+
+    if ((newtsk = tcp_listen_child(tsk, skb, th, &seg->opts, seg->seq)) == NULL) goto unlock;
+
+    /* A SYN's window is never scaled */
+    newtsk->tcb.snd_wnd = seg->win;
+    newtsk->max_window = seg->win;
+    newtsk->tcb.snd_wl1 = seg->seq;
+    newtsk->tcb.snd_wl2 = newtsk->tcb.iss;
+
+    /* Segments find the connection from here on */
+    inet_hash(&newtsk->sk);
+
+    socket_get(newtsk->sk.sock);
+    pthread_mutex_unlock(&queue->lock);
+
+    /* Once hashed, the connection is no longer the listener's alone */
+    sock_run(&newtsk->sk, tcp_send_synack_call, &newtsk->sk);
+    socket_put(newtsk->sk.sock);
+    goto discard;
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+    goto discard;
+reset:
+    tcp_v4_send_reset(skb, seg);
+discard:
     free_skb(skb);
     return 0;
 }
 
-static int tcp_synsent(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th)
+/*
+ * PAWS, RFC 7323 5.3: a segment with a timestamp older than the last one
+ * echoed belongs to an earlier incarnation of the sequence space
+ */
+static int tcp_paws_reject(struct tcp_sock *tsk, struct tcphdr *th, struct tcp_segment *seg)
+{
+    if (!tsk->tstamp_ok || !seg->opts.saw_tstamp || th->rst) return 0;
+
+    return (int32_t)(seg->opts.tsval - tsk->ts_recent) < 0;
+}
+
+/* RFC 7323 4.3, the timestamp to echo is that of the oldest segment not
+ * acknowledged yet */
+static void tcp_store_ts_recent(struct tcp_sock *tsk, struct tcp_segment *seg)
+{
+    if (!tsk->tstamp_ok || !seg->opts.saw_tstamp) return;
+
+    if (!after(seg->seq, tsk->last_ack_sent) &&
+        (int32_t)(seg->opts.tsval - tsk->ts_recent) >= 0) {
+        tsk->ts_recent = seg->opts.tsval;
+    }
+}
+
+static int tcp_synsent(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *th,
+                       struct tcp_segment *seg)
 {
     struct tcb *tcb = &tsk->tcb;
 
     tcpstate_dbg("state is synsent");
     
     if (th->ack) {
-        if (th->ack_seq <= tcb->iss || th->ack_seq > tcb->snd_nxt) {
+        if (!after(th->ack_seq, tcb->iss) || after(th->ack_seq, tcb->snd_nxt)) {
             if (th->rst) goto discard;
 
             goto reset_and_discard;
         }
 
-        if (!(tcb->snd_una <= th->ack_seq && th->ack_seq <= tcb->snd_nxt))
+        if (!between(tcb->snd_una, th->ack_seq, tcb->snd_nxt))
             goto reset_and_discard;
     }
 
     if (th->rst) {
-        goto reset_and_discard;
+        /* The connection is refused, if the RST answers our SYN */
+        if (th->ack) {
+            tcp_clear_timers(tsk);
+            tsk->sk.state = TCP_CLOSE;
+            socket_wake(tsk->sk.sock, POLLIN | POLLOUT);
+        }
+
+        goto discard;
     }
 
     if (!th->syn) {
         goto discard;
     }
 
+    tcp_negotiate_options(tsk, &seg->opts);
+
     tcb->rcv_nxt = th->seq + 1;
     tcb->irs = th->seq;
+    /* The SYN's window is where the right edge starts */
+    tsk->last_ack_sent = tcb->rcv_nxt;
     if (th->ack) {
-        /* Any packets in RTO queue that are acknowledged here should be removed */
-        tcb->snd_una = th->ack_seq;
+        /* The SYN-ACK sets the send window in any case */
+        tcb->snd_wl1 = th->seq - 1;
+        tcp_ack(tsk, seg);
     }
 
-    if (tcb->snd_una > tcb->iss) {
-        tsk->sk.state = TCP_ESTABLISHED;
-        tcb->seq = tcb->snd_nxt;
+    if (after(tcb->snd_una, tcb->iss)) {
+        tcp_set_established(tsk);
         tcp_send_ack(&tsk->sk);
-        wait_wakeup(&tsk->sk.sock->sleep);
+        socket_wake(tsk->sk.sock, POLLOUT);
     }
     
 discard:
@@ -104,7 +757,7 @@ static int tcp_closed(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *
     tcpstate_dbg("state is closed");
 
     if (th->rst) {
-        tcp_discard(tsk, skb, th);
+        return tcp_discard(tsk, skb, th);
     }
 
     if (th->ack) {
@@ -121,6 +774,14 @@ static int tcp_closed(struct tcp_sock *tsk, struct sk_buff *skb, struct tcphdr *
     return rc;
 }
 
+/* RFC 793 3.9, the other timers are off and the time-wait timer runs */
+static void tcp_time_wait(struct tcp_sock *tsk)
+{
+    tsk->sk.state = TCP_TIME_WAIT;
+    tcp_clear_timers(tsk);
+    tcp_reset_timewait_timer(tsk, TCP_TIMEWAIT_LEN);
+}
+
 /*
  * Follows RFC793 "Segment Arrives" section closely
  */ 
@@ -129,29 +790,56 @@ int tcp_input_state(struct sock *sk, struct sk_buff *skb, struct tcp_segment *se
     struct tcphdr *th = tcp_hdr(skb);
     struct tcp_sock *tsk = tcp_sk(sk);
     struct tcb *tcb = &tsk->tcb;
+    int fin = th->fin;
+    int locked;
+    int rc;
 
     tcptcb_dbg("INPUT", tcb);
 
+    tcp_parse_options(th, &seg->opts);
+
     switch (sk->state) {
     case TCP_CLOSE:
         return tcp_closed(tsk, skb, th);
     case TCP_LISTEN:
-        return tcp_listen(tsk, skb, th);
+        return tcp_listen(tsk, skb, th, seg);
     case TCP_SYN_SENT:
-        return tcp_synsent(tsk, skb, th);
+        return tcp_synsent(tsk, skb, th, seg);
     }
 
     /* "Otherwise" section in RFC793 */
 
+    /* RFC 7323 2.3, only the window of a SYN is not scaled */
+    seg->win <<= tsk->snd_wscale;
+
     /* first check sequence number */
-    if (tcp_verify_segment(tsk, th, seg) < 0) {
+    if (tcp_paws_reject(tsk, th, seg) || tcp_verify_segment(tsk, th, seg) < 0) {
+        /* Old duplicates are answered with an ACK of what we have */
+        if (!th->rst) tcp_send_ack(&tsk->sk);
         return tcp_drop(tsk, skb);
     }
+
+    tcp_store_ts_recent(tsk, seg);
     
     /* second check the RST bit */
 
     if (th->rst) {
+        /* A refused handshake is left for accept() to reap */
+        if (sk->state == TCP_SYN_RECEIVED && tsk->parent) {
+            tcp_clear_timers(tsk);
+            sk->state = TCP_CLOSE;
+            tcp_accept_enqueue(tsk);
+            return tcp_drop(tsk, skb);
+        }
+
+        /* A closed connection has nobody left to tell */
+        if (tcp_orphan(sk)) {
+            tcp_done(tsk);
+            return tcp_drop(tsk, skb);
+        }
 
+        tcp_reset(tsk);
+        return tcp_drop(tsk, skb);
     }
     
     /* third check security and precedence */
@@ -172,49 +860,90 @@ int tcp_input_state(struct sock *sk, struct sk_buff *skb, struct tcp_segment *se
     switch (sk->state) {
     case TCP_SYN_RECEIVED:
     case TCP_ESTABLISHED:
-        if (tcb->snd_una < seg->ack && seg->ack <= tcb->snd_nxt) {
-            tcb->snd_una = seg->ack;
-            tcb->seq = tcb->snd_una;
-            /* TODO: Any segments on the retransmission queue which are thereby
-               entirely acknowledged are removed. */
+    case TCP_FIN_WAIT_1:
+    case TCP_FIN_WAIT_2:
+    case TCP_CLOSE_WAIT:
+    case TCP_CLOSING:
+    case TCP_LAST_ACK:
+        if (!after(seg->ack, tsk->snd_max)) {
+            tcp_ack(tsk, seg);
 
             /* TODO: Users should receive positive acknowledgements for buffers
                which have been sent and fully acknowledged */
         }
 
-        if (seg->ack < tcb->snd_una) {
+        if (before(seg->ack, tcb->snd_una)) {
             // If the ACK is a duplicate, it can be ignored
             return tcp_drop(tsk, skb);
         }
 
-        if (seg->ack > tcb->snd_nxt) {
+        if (after(seg->ack, tsk->snd_max)) {
             // If the ACK acks something not yet sent, then send an ACK, drop segment
             // and return
             tcp_send_ack(&tsk->sk);
             return tcp_drop(tsk, skb);
         }
 
-        if (tcb->snd_una < seg->ack && seg->ack <= tcb->snd_nxt) {
-            // Send window should be updated
+        /* The send window was updated along with snd_una */
+    }
 
+    /* Nothing is written after a FIN, so it is acknowledged with all else */
+    if (tcp_orphan(sk) && tcb->snd_una == tsk->write_seq) {
+        switch (sk->state) {
+        case TCP_FIN_WAIT_1:
+            /* A FIN of the peer may never come, Linux waits for it a while */
+            sk->state = TCP_FIN_WAIT_2;
+            tcp_clear_timers(tsk);
+            tcp_reset_timewait_timer(tsk, TCP_FIN_TIMEOUT);
+            break;
+        case TCP_CLOSING:
+            tcp_time_wait(tsk);
+            return tcp_drop(tsk, skb);
+        case TCP_LAST_ACK:
+            tcp_done(tsk);
+            return tcp_drop(tsk, skb);
         }
     }
+
+    /* The final ACK of a passive open, RFC 793 3.4 */
+    if (sk->state == TCP_SYN_RECEIVED) {
+        if (tcb->snd_una == tcb->iss) return tcp_drop(tsk, skb);
+
+        tcp_set_established(tsk);
+        if (tsk->parent) tcp_accept_enqueue(tsk);
+    }
     
     /* sixth, check the URG bit */
     if (th->urg) {
 
     }
 
-    pthread_mutex_lock(&sk->receive_queue.lock);
+    /* Established connections hand segments over through a lock-free ring */
+    locked = !skb_queue_is_ring(&sk->receive_queue);
+
+    if (locked) pthread_mutex_lock(&sk->receive_queue.lock);
     /* seventh, process the segment txt */
     switch (sk->state) {
     case TCP_ESTABLISHED:
     case TCP_FIN_WAIT_1:
     case TCP_FIN_WAIT_2:
-        tcp_data_queue(tsk, skb, th, seg);
-        tcb->rcv_nxt += seg->dlen;
-        tcp_send_ack(&tsk->sk);
-        tsk->sk.ops->recv_notify(&tsk->sk);
+        /* Data out of order, or filling a hole, is ACKed right away */
+        if (seg->seq != tcb->rcv_nxt || !skb_queue_empty(&tsk->ofo_queue)) {
+            tsk->quickack = TCP_MAX_QUICKACKS;
+        }
+
+        if ((rc = tcp_data_queue(tsk, skb, th, seg)) < 0) goto unlock;
+
+        /* An out-of-order FIN counts once the data before it is in */
+        fin = rc;
+
+        /* Pure ACKs are not ACKed */
+        if (seg->len) {
+            tcp_measure_rcv_mss(tsk, seg);
+            tcp_rcv_rtt_measure(tsk, seg);
+            tsk->ack_pending = 1;
+            tsk->sk.ops->recv_notify(&tsk->sk);
+        }
             
         break;
     case TCP_CLOSE_WAIT:
@@ -223,78 +952,70 @@ int tcp_input_state(struct sock *sk, struct sk_buff *skb, struct tcp_segment *se
     case TCP_TIME_WAIT:
         /* This should not occur, since a FIN has been received from the
            remote side.  Ignore the segment text. */
+        tcp_drop(tsk, skb);
         break;
     }
 
     /* eighth, check the FIN bit */
-    if (th->fin) {
+    if (fin) {
         switch (sk->state) {
         case TCP_CLOSE:
         case TCP_LISTEN:
         case TCP_SYN_SENT:
             // Do not process, since SEG.SEQ cannot be validated
             goto drop_and_unlock;
+        case TCP_CLOSE_WAIT:
+        case TCP_CLOSING:
+        case TCP_LAST_ACK:
+        case TCP_TIME_WAIT:
+            /* rcv_nxt is past the FIN already, the peer sends it again as
+               our ACK got lost. Remain in the state. */
+            tcp_send_ack(&tsk->sk);
+            if (sk->state == TCP_TIME_WAIT) tcp_reset_timewait_timer(tsk, TCP_TIMEWAIT_LEN);
+            goto unlock;
         }
 
         tcb->rcv_nxt += 1;
-        tcp_send_finack(&tsk->sk);
-        tsk->flags |= TCP_FIN;
-        
+        tcp_send_ack(&tsk->sk);
+        __atomic_fetch_or(&tsk->flags, TCP_FIN, __ATOMIC_RELEASE);
+
         switch (sk->state) {
         case TCP_SYN_RECEIVED:
         case TCP_ESTABLISHED:
             tsk->sk.state = TCP_CLOSE_WAIT;
             break;
         case TCP_FIN_WAIT_1:
-            /* TODO:  If our FIN has been ACKed (perhaps in this segment), then
-               enter TIME-WAIT, start the time-wait timer, turn off the other
-               timers; otherwise enter the CLOSING state. */
+            /* Our FIN is not acknowledged, or the ACK step moved on */
+            tsk->sk.state = TCP_CLOSING;
             break;
         case TCP_FIN_WAIT_2:
-            /* TODO: Enter the TIME-WAIT state.  Start the time-wait timer, turn
-               off the other timers. */
-            break;
-        case TCP_CLOSE_WAIT:
-        case TCP_CLOSING:
-        case TCP_LAST_ACK:
-            /* Remain in the state */
-            break;
-        case TCP_TIME_WAIT:
-            /* TODO: Remain in the TIME-WAIT state.  Restart the 2 MSL time-wait
-               timeout. */
+            tcp_time_wait(tsk);
             break;
         }
+
+        tsk->sk.ops->recv_notify(&tsk->sk);
     }
 
 unlock:
-    pthread_mutex_unlock(&sk->receive_queue.lock);
+    if (locked) pthread_mutex_unlock(&sk->receive_queue.lock);
+
+    /* New data goes first and takes the ACK along */
+    tcp_push(tsk);
+    tcp_ack_snd_check(tsk);
     return 0;
 drop_and_unlock:
     tcp_drop(tsk, skb);
     goto unlock;
 }
 
+/* Returns what was received so far, -EAGAIN if nothing was and no FIN */
 int tcp_receive(struct tcp_sock *tsk, void *buf, int len)
 {
-    int rlen = 0;
-    int curlen = 0;
-
-    memset(buf, 0, len);
-
-    while (rlen < len) {
-        curlen = tcp_data_dequeue(tsk, buf + rlen, len - 1 - rlen);
-
-        rlen += curlen;
+    int rlen = tcp_data_dequeue(tsk, buf, len);
 
-        if (tsk->flags & TCP_PSH) {
-            tsk->flags &= ~TCP_PSH;
-            break;
-        }
+    if (rlen > 0 || len == 0) return rlen;
 
-        if (tsk->flags & TCP_FIN) break;
+    if (__atomic_load_n(&tsk->flags, __ATOMIC_ACQUIRE) & TCP_FIN) return 0;
 
-        wait_sleep(&tsk->sk.recv_wait);
-    }
-    
-    return rlen;
+    return -EAGAIN;
 }
@@ -3,32 +3,182 @@
 #include "tcp.h"
 #include "ip.h"
 #include "skbuff.h"
+#include "inet.h"
+#include "route.h"
+#include "netdev.h"
+#include "tcp_timer.h"
+
+extern int tcp_rmem_max;
 
 static struct sk_buff *tcp_alloc_skb(int size)
 {
-    struct sk_buff *skb = alloc_skb(size + ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+    /* Options are filled in behind the header on transmit */
+    struct sk_buff *skb = alloc_skb(size + ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + TCP_MAX_OPTLEN);
     skb_reserve(skb, size + ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
     skb->protocol = IP_TCP;
 
     return skb;
 }
 
-static int tcp_transmit_skb(struct sock *sk, struct sk_buff *skb)
+static uint8_t *tcp_write_timestamp(uint32_t ts_recent, uint8_t *opt)
+{
+    uint32_t tsval = htonl(tcp_time_stamp());
+    uint32_t tsecr = htonl(ts_recent);
+
+    opt[0] = TCP_OPT_TIMESTAMP;
+    opt[1] = TCP_OPTLEN_TIMESTAMP;
+    memcpy(opt + 2, &tsval, 4);
+    memcpy(opt + 6, &tsecr, 4);
+
+    return opt + TCP_OPTLEN_TIMESTAMP;
+}
+
+/*
+ * Writes the options of a SYN, laid out in 32 bit words as Linux does,
+ * from what they offer: the MSS, the window scale if saw_wscale, SACK and
+ * timestamps echoing tsecr if saw_tstamp. Needs no socket, the SYN-ACK of
+ * a cookie is sent without one.
+ */
+static uint8_t tcp_write_syn_options(const struct tcp_options *o, uint8_t *opt)
+{
+    uint8_t *start = opt;
+
+    *opt++ = TCP_OPT_MSS;
+    *opt++ = TCP_OPTLEN_MSS;
+    *opt++ = o->mss >> 8;
+    *opt++ = o->mss & 0xff;
+
+    if (o->sack_ok && o->saw_tstamp) {
+        *opt++ = TCP_OPT_SACK_PERM;
+        *opt++ = TCP_OPTLEN_SACK_PERM;
+        opt = tcp_write_timestamp(o->tsecr, opt);
+    } else if (o->saw_tstamp) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_NOP;
+        opt = tcp_write_timestamp(o->tsecr, opt);
+    } else if (o->sack_ok) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_SACK_PERM;
+        *opt++ = TCP_OPTLEN_SACK_PERM;
+    }
+
+    if (o->saw_wscale) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_WSCALE;
+        *opt++ = TCP_OPTLEN_WSCALE;
+        *opt++ = o->wscale;
+    }
+
+    return opt - start;
+}
+
+/* All options are offered on the SYN */
+static uint8_t tcp_syn_options(struct tcp_sock *tsk, uint8_t *opt)
+{
+    struct tcp_options o = {
+        .mss = tsk->advmss,
+        .wscale = tsk->rcv_wscale,
+        .saw_wscale = tsk->wscale_ok,
+        .sack_ok = tsk->sack_ok,
+        .saw_tstamp = tsk->tstamp_ok,
+        .tsecr = tsk->ts_recent,
+    };
+
+    return tcp_write_syn_options(&o, opt);
+}
+
+/* Timestamps go on every segment once agreed on, SACK blocks on ACKs
+ * without data */
+static uint8_t tcp_established_options(struct tcp_sock *tsk, struct sk_buff *skb, uint8_t *opt)
+{
+    uint8_t *start = opt;
+    int max_sacks = TCP_MAX_SACKS;
+
+    if (tsk->tstamp_ok) {
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_NOP;
+        opt = tcp_write_timestamp(tsk->ts_recent, opt);
+        max_sacks--;
+    }
+
+    if (tsk->sack_ok && tsk->num_sacks && !skb->len) {
+        int n = tsk->num_sacks < max_sacks ? tsk->num_sacks : max_sacks;
+
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_NOP;
+        *opt++ = TCP_OPT_SACK;
+        *opt++ = 2 + n * TCP_OPTLEN_SACK_BLOCK;
+
+        for (int i = 0; i < n; i++) {
+            uint32_t start_seq = htonl(tsk->sacks[i].start_seq);
+            uint32_t end_seq = htonl(tsk->sacks[i].end_seq);
+
+            memcpy(opt, &start_seq, 4);
+            memcpy(opt + 4, &end_seq, 4);
+            opt += TCP_OPTLEN_SACK_BLOCK;
+        }
+    }
+
+    return opt - start;
+}
+
+/*
+ * The window field offers the free receive buffer. The right edge never
+ * moves back, RFC 9293 3.8.6.2.2, nor forward by less than a segment or
+ * half the buffer, which avoids the silly window syndrome, RFC 1122
+ * 4.2.3.3. It is never scaled on a SYN, RFC 7323 2.2.
+ */
+static uint16_t tcp_select_window(struct tcp_sock *tsk, struct tcphdr *th)
 {
-    struct tcp_sock *tsk = tcp_sk(sk);
     struct tcb *tcb = &tsk->tcb;
+    uint32_t cur = 0, win, edge = tsk->last_ack_sent + tcb->rcv_wnd;
+    uint8_t ws = tsk->rcv_wscale;
 
-    skb_push(skb, tsk->tcp_header_len);
+    if (th->syn) return tcb->rcv_wnd > 0xffff ? 0xffff : tcb->rcv_wnd;
+
+    if (after(edge, tcb->rcv_nxt)) cur = edge - tcb->rcv_nxt;
+
+    win = tcp_space(tsk);
+    if (win > (0xffffU << ws)) win = 0xffffU << ws;
+
+    if (win <= cur || win - cur < (tsk->rcvbuf / 2 < tsk->rcv_mss ? tsk->rcvbuf / 2 : tsk->rcv_mss)) {
+        /* Scaling must not round the offered window below cur */
+        win = ((cur + (1 << ws) - 1) >> ws) << ws;
+    } else {
+        win = (win >> ws) << ws;
+    }
+
+    tcb->rcv_wnd = win;
+
+    return win >> ws;
+}
+
+/*
+ * Puts the header in front of the options and the payload of a segment
+ * whose flags and skb->seq are set, and hands it to IP. sk only supplies
+ * the addresses and ports, so that segments are sent for connections that
+ * are not kept as well.
+ */
+static int tcp_v4_output(struct sock *sk, struct sk_buff *skb, uint32_t ack_seq, uint16_t win,
+                         const uint8_t *opts, uint8_t optlen)
+{
+    /* Options follow the header in the linear part, the payload sits in
+     * fragments behind them */
+    if (optlen) memcpy(skb_put(skb, optlen), opts, optlen);
+    if (skb->payload) skb->payload += optlen;
+
+    skb_push(skb, TCP_HDR_LEN);
 
     struct tcphdr *thdr = (struct tcphdr *)skb->data;
 
     thdr->sport = sk->sport;
     thdr->dport = sk->dport;
-    thdr->seq = tcb->seq;
-    thdr->ack_seq = tcb->rcv_nxt;
-    thdr->hl = 5;
+    thdr->seq = skb->seq;
+    thdr->ack_seq = ack_seq;
+    thdr->hl = (TCP_HDR_LEN + optlen) >> 2;
     thdr->rsvd = 0;
-    thdr->win = tcb->rcv_wnd;
+    thdr->win = win;
     thdr->csum = 0;
     thdr->urp = 0;
 
@@ -41,11 +191,315 @@ static int tcp_transmit_skb(struct sock *sk, struct sk_buff *skb)
     thdr->win = htons(thdr->win);
     thdr->csum = htons(thdr->csum);
     thdr->urp = htons(thdr->urp);
-    thdr->csum = tcp_v4_checksum(skb, htonl(sk->saddr), htonl(sk->daddr));
+
+    /* The checksum is completed by the device, or in software by netdev */
+    thdr->csum = tcp_v4_pseudo_csum(skb, htonl(sk->saddr), htonl(sk->daddr));
+    skb->ip_summed = CHECKSUM_PARTIAL;
+    skb->csum_start = skb->data - skb->head;
+    skb->csum_offset = offsetof(struct tcphdr, csum);
+
+    skb->hash = inet_flow_hash(sk->saddr, sk->daddr, sk->sport, sk->dport);
     
     return ip_output(sk, skb);
 }
 
+static int tcp_transmit_skb(struct sock *sk, struct sk_buff *skb)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+    struct tcb *tcb = &tsk->tcb;
+    struct tcphdr *th = tcp_hdr(skb);
+    uint8_t opts[TCP_MAX_OPTLEN];
+    uint8_t optlen = 0;
+    uint16_t win;
+
+    if (th->syn) {
+        optlen = tcp_syn_options(tsk, opts);
+    } else if (!th->rst) {
+        optlen = tcp_established_options(tsk, skb, opts);
+    }
+
+    win = tcp_select_window(tsk, th);
+
+    /* Any segment with an ACK on it is as good as a delayed ACK */
+    if (th->ack) {
+        if (tsk->ack_pending && tsk->quickack) tsk->quickack--;
+
+        tsk->ack_pending = 0;
+        tsk->last_ack_sent = tcb->rcv_nxt;
+    }
+
+    return tcp_v4_output(sk, skb, tcb->rcv_nxt, win, opts, optlen);
+}
+
+/*
+ * Nagle, RFC 896 and RFC 1122 4.2.3.4: new data short of a full segment
+ * waits while earlier data is unacknowledged, as more may be written
+ * meanwhile. Only the queue's last segment can be short.
+ */
+static int tcp_nagle_test(struct tcp_sock *tsk, struct sk_buff *skb, uint32_t in_flight)
+{
+    if (skb->end_seq - skb->seq >= tsk->mss) return 1;
+    if (skb_queue_next(&tsk->write_queue, skb) != NULL) return 1;
+    if (tcp_hdr(skb)->syn || tcp_hdr(skb)->fin) return 1;
+    if (before(skb->seq, tsk->snd_max)) return 1;
+
+    if (tsk->nonagle & TCP_NAGLE_CORK) return 0;
+
+    return (tsk->nonagle & TCP_NAGLE_OFF) || !in_flight;
+}
+
+/* Sends a copy of a queued segment, caller holds write_queue.lock */
+static int tcp_transmit_queued(struct sock *sk, struct sk_buff *skb)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+    struct tcb *tcb = &tsk->tcb;
+
+    /* One new segment at a time is timed for the RTT */
+    if (!tsk->rtt_pending && !before(skb->seq, tsk->snd_max)) {
+        tsk->rtt_pending = 1;
+        tsk->rtt_seq = skb->end_seq;
+        tsk->rtt_start = tcp_clock_us();
+    }
+
+    if (!timer_pending(&tsk->rto_timer)) {
+        tcp_reset_rto_timer(tsk);
+    }
+
+    tcb->snd_nxt = skb->end_seq;
+    if (before(tsk->snd_max, tcb->snd_nxt)) tsk->snd_max = tcb->snd_nxt;
+    tsk->lsndtime = tcp_clock_us() / 1000;
+
+    return tcp_transmit_skb(sk, skb_copy(skb));
+}
+
+/*
+ * Sends queued segments from send_head on, as far as the congestion
+ * window allows. Caller holds write_queue.lock.
+ */
+void tcp_write_xmit(struct sock *sk)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+    struct tcb *tcb = &tsk->tcb;
+    struct sk_buff *skb;
+
+    while ((skb = tsk->send_head) != NULL) {
+        uint32_t in_flight = tcb->snd_nxt - tcb->snd_una;
+        uint32_t len = skb->end_seq - skb->seq;
+
+        if (!in_flight && tsk->ca_state == TCP_CA_OPEN && tsk->lsndtime &&
+            tcp_clock_us() / 1000 - tsk->lsndtime > tsk->rto) {
+            tcp_cwnd_restart(tsk);
+        }
+
+        /* Going back over sent data, what the peer has SACKed is skipped */
+        if (skb->sacked && before(skb->seq, tsk->snd_max)) {
+            tcb->snd_nxt = skb->end_seq;
+            tsk->send_head = skb_queue_next(&tsk->write_queue, skb);
+            continue;
+        }
+
+        /* With nothing in flight, one segment goes however large it is */
+        if (in_flight && in_flight + len > tsk->snd_cwnd) break;
+
+        /* The peer's window, which a zero window probe has to open */
+        if (!tcp_hdr(skb)->syn && after(skb->end_seq, tcb->snd_una + tcb->snd_wnd)) {
+            if (!in_flight && !timer_pending(&tsk->persist_timer)) {
+                tcp_reset_persist_timer(tsk);
+            }
+            break;
+        }
+
+        if (!tcp_nagle_test(tsk, skb, in_flight)) break;
+
+        tsk->probes = 0;
+        skb->gso_size = len > tsk->mss ? tsk->mss : 0;
+
+        tcp_transmit_queued(sk, skb);
+        tsk->send_head = skb_queue_next(&tsk->write_queue, skb);
+    }
+}
+
+/*
+ * A segment is only sent once all of it fits in the peer's window, so it
+ * must not outgrow half the largest window offered, or it may never go.
+ * Small windows are taken whole, as in Linux's tcp_bound_to_half_wnd().
+ */
+static uint32_t tcp_bound_to_half_wnd(struct tcp_sock *tsk, uint32_t len)
+{
+    uint32_t cutoff = tsk->max_window;
+
+    if (cutoff > TCP_DEFAULT_MSS) cutoff /= 2;
+    if (cutoff == 0 || len <= cutoff) return len;
+
+    return cutoff;
+}
+
+/* The largest segment to build from written data */
+static uint32_t tcp_size_goal(struct tcp_sock *tsk)
+{
+    uint32_t goal;
+
+    if (!tsk->tso) return tcp_bound_to_half_wnd(tsk, tsk->mss);
+
+    /* Half the window, so that a segment does not wait for all the rest */
+    goal = tcp_bound_to_half_wnd(tsk, tsk->snd_cwnd / 2);
+    if (goal > TCP_MAX_TSO - IP_HDR_LEN - TCP_HDR_LEN) goal = TCP_MAX_TSO - IP_HDR_LEN - TCP_HDR_LEN;
+
+    if (goal < tsk->mss) return tcp_bound_to_half_wnd(tsk, tsk->mss);
+
+    return goal - goal % tsk->mss;
+}
+
+/* Resends a segment in place, caller holds write_queue.lock */
+void tcp_retransmit_skb(struct sock *sk, struct sk_buff *skb)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+
+    /* Karn's rule, a retransmitted segment gives no RTT sample */
+    if (tsk->rtt_pending && after(tsk->rtt_seq, skb->seq)) tsk->rtt_pending = 0;
+
+    tcp_transmit_skb(sk, skb_copy(skb));
+}
+
+/*
+ * Queues a segment that occupies len of sequence space. It stays on the
+ * write queue until acknowledged, and copies of it go out once the
+ * congestion window allows.
+ */
+static int tcp_queue_transmit_skb(struct sock *sk, struct sk_buff *skb, uint32_t len)
+{
+    struct tcp_sock *tsk = tcp_sk(sk);
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+
+    skb->seq = tsk->write_seq;
+    skb->end_seq = skb->seq + len;
+    tsk->write_seq += len;
+
+    skb_queue_tail(&tsk->write_queue, skb);
+    if (!tsk->send_head) tsk->send_head = skb;
+
+    tcp_write_xmit(sk);
+
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+
+    return 0;
+}
+
+/*
+ * Retransmission timeout, RFC 6298 5.4 to 5.6 and RFC 5681 3.1: the
+ * window collapses to one segment and sending goes back to the oldest
+ * unacknowledged segment.
+ */
+void tcp_retransmit_timer(struct tcp_sock *tsk)
+{
+    struct sock *sk = &tsk->sk;
+    struct tcb *tcb = &tsk->tcb;
+    struct sk_buff *skb;
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+
+    if (tcb->snd_una == tsk->snd_max) goto unlock;
+    if ((skb = skb_peek(&tsk->write_queue)) == NULL) goto unlock;
+
+    if (tsk->backoff >= (sk->state == TCP_SYN_RECEIVED ? TCP_SYNACK_RETRIES : TCP_MAX_RETRIES)) {
+        print_err("TCP connection timed out, sport %hu dport %hu\n", sk->sport, sk->dport);
+
+        /* Nobody is left to tell */
+        if (tcp_orphan(sk)) {
+            pthread_mutex_unlock(&tsk->write_queue.lock);
+            tcp_send_reset(tsk);
+            tcp_done(tsk);
+            return;
+        }
+
+        skb_queue_free(&tsk->write_queue);
+        tsk->send_head = NULL;
+        pthread_mutex_unlock(&tsk->write_queue.lock);
+
+        tcp_send_reset(tsk);
+
+        pthread_mutex_lock(&tsk->write_queue.lock);
+        sk->state = TCP_CLOSE;
+        pthread_mutex_unlock(&tsk->write_queue.lock);
+
+        socket_wake(sk->sock, POLLIN | POLLOUT);
+
+        /* Left for accept() to reap */
+        if (tsk->parent) tcp_accept_enqueue(tsk);
+        return;
+    }
+
+    if (tsk->ca_state != TCP_CA_LOSS) {
+        tsk->snd_ssthresh = tsk->ca_ops->ssthresh(tsk);
+    }
+
+    tsk->ca_state = TCP_CA_LOSS;
+    tsk->high_seq = tsk->snd_max;
+    tsk->snd_cwnd = tsk->mss;
+    tsk->snd_cwnd_cnt = 0;
+    tsk->dupacks = 0;
+
+    /* A receiver may drop what it SACKed, RFC 2018 8. After a second
+     * timeout in a row everything is sent again. */
+    if (tsk->backoff) {
+        for (struct sk_buff *s = skb; s != NULL; s = skb_queue_next(&tsk->write_queue, s)) {
+            s->sacked = 0;
+        }
+    }
+
+    tsk->rtt_pending = 0;
+    tsk->backoff++;
+    tsk->rto = tsk->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : tsk->rto * 2;
+
+    tcb->snd_nxt = tcb->snd_una;
+    tsk->send_head = skb;
+    tcp_write_xmit(sk);
+
+unlock:
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+}
+
+/* An ACK for a sequence number the peer has seen already, to learn its
+ * window, RFC 9293 3.8.6.1 */
+static int tcp_send_probe(struct sock *sk)
+{
+    struct sk_buff *skb;
+
+    skb = tcp_alloc_skb(0);
+    tcp_hdr(skb)->ack = 1;
+    skb->seq = tcp_sk(sk)->tcb.snd_una - 1;
+
+    return tcp_transmit_skb(sk, skb);
+}
+
+/* The persist timer, probes a zero window for as long as it stays shut */
+void tcp_probe_timer(struct tcp_sock *tsk)
+{
+    struct sock *sk = &tsk->sk;
+    struct tcb *tcb = &tsk->tcb;
+    struct sk_buff *skb;
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+
+    if ((skb = tsk->send_head) == NULL || tcb->snd_nxt != tcb->snd_una) goto unlock;
+    if (!after(skb->end_seq, tcb->snd_una + tcb->snd_wnd)) goto unlock;
+
+    tcp_send_probe(sk);
+
+    if ((tsk->rto << tsk->probes) < TCP_RTO_MAX) tsk->probes++;
+    tcp_reset_persist_timer(tsk);
+
+unlock:
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+}
+
+/* The delayed ACK timer, ACKs data that no other segment has yet */
+void tcp_delack_timer(struct tcp_sock *tsk)
+{
+    if (tsk->ack_pending) tcp_send_ack(&tsk->sk);
+}
+
 int tcp_send_finack(struct sock *sk)
 {
     struct sk_buff *skb;
@@ -57,7 +511,8 @@ int tcp_send_finack(struct sock *sk)
     th->fin = 1;
     th->ack = 1;
 
-    return tcp_transmit_skb(sk, skb);
+    /* FIN takes one sequence number */
+    return tcp_queue_transmit_skb(sk, skb, 1);
 }
 
 int tcp_send_ack(struct sock *sk)
@@ -71,6 +526,7 @@ int tcp_send_ack(struct sock *sk)
     
     th = tcp_hdr(skb);
     th->ack = 1;
+    skb->seq = tcp_sk(sk)->tcb.snd_nxt;
 
     return tcp_transmit_skb(sk, skb);
 }
@@ -91,60 +547,210 @@ static int tcp_send_syn(struct sock *sk)
     sk->state = TCP_SYN_SENT;
     th->syn = 1;
     
-    return tcp_transmit_skb(sk, skb);
+    return tcp_queue_transmit_skb(sk, skb, 1);
 }
 
-void tcp_select_initial_window(uint32_t *rcv_wnd)
+/* The scale is picked for the largest buffer auto-tuning may grow to */
+void tcp_select_initial_window(uint32_t space, uint32_t *rcv_wnd, uint8_t *rcv_wscale)
 {
-    *rcv_wnd = 29200;
+    *rcv_wnd = space > 0xffff ? 0xffff : space;
+    *rcv_wscale = 0;
+
+    space = tcp_rmem_max;
+
+    while (space > 0xffff && *rcv_wscale < TCP_MAX_WSCALE) {
+        space >>= 1;
+        (*rcv_wscale)++;
+    }
 }
 
-int tcp_connect(struct sock *sk)
+/* Sets up the sending side and the offered options, for either open */
+void tcp_connect_init(struct sock *sk)
 {
     struct tcp_sock *tsk = tcp_sk(sk);
     struct tcb *tcb = &tsk->tcb;
     
+    struct rtentry *rt = route_lookup(sk->daddr);
+    uint32_t mtu = rt ? rt->dev->mtu : NETDEV_DEFAULT_MTU;
+    
+    tsk->tso = rt && (rt->dev->features & NETDEV_F_TSO);
     tsk->tcp_header_len = sizeof(struct tcphdr);
+    tsk->advmss = mtu - IP_HDR_LEN - TCP_HDR_LEN;
+    /* Until the SYN-ACK tells otherwise */
+    tsk->mss = TCP_DEFAULT_MSS;
     tcb->iss = generate_iss();
     tcb->snd_wnd = 0;
     tcb->snd_wl1 = 0;
 
     tcb->snd_una = tcb->iss;
     tcb->snd_up = tcb->iss;
-    tcb->snd_nxt = tcb->iss + 1;
+    tcb->snd_nxt = tcb->iss;
     tcb->rcv_nxt = 0;
     tcb->seq = tcb->iss;
+    tsk->write_seq = tcb->iss;
+    tsk->snd_max = tcb->iss;
+    tsk->high_seq = tcb->iss;
+    tcp_init_congestion_control(tsk);
+
+    /* Offered in the SYN, kept if the peer's SYN carries them as well */
+    tsk->wscale_ok = 1;
+    tsk->sack_ok = 1;
+    tsk->tstamp_ok = 1;
+    tcp_select_initial_window(tsk->rcvbuf, &tsk->tcb.rcv_wnd, &tsk->rcv_wscale);
+}
 
-    tcp_select_initial_window(&tsk->tcb.rcv_wnd);
+int tcp_connect(struct sock *sk)
+{
+    tcp_connect_init(sk);
     return tcp_send_syn(sk);
 }
 
-int tcp_send(struct tcp_sock *tsk, const void *buf, int len)
+/* Queued like the SYN, so that the retransmission timer repeats it */
+int tcp_send_synack(struct sock *sk)
 {
     struct sk_buff *skb;
-    struct tcb *tcb = &tsk->tcb;
     struct tcphdr *th;
-    int ret = -1;
 
-    skb = tcp_alloc_skb(len);
-    skb_push(skb, len);
-    memcpy(skb->data, buf, len);
+    if (sk->state != TCP_SYN_RECEIVED) {
+        print_err("Socket was not in correct state (syn received)\n");
+        return 1;
+    }
 
+    skb = tcp_alloc_skb(0);
     th = tcp_hdr(skb);
+
+    th->syn = 1;
     th->ack = 1;
-    th->psh = 1;
-    tcb->seq = tcb->snd_nxt;
-    tcb->snd_nxt += len;
 
-    ret = tcp_transmit_skb(&tsk->sk, skb);
+    return tcp_queue_transmit_skb(sk, skb, 1);
+}
+
+/*
+ * Answers a SYN to a listener with a SYN cookie as ISS. Nothing is kept:
+ * the SYN-ACK is built from the SYN alone, and is not retransmitted, the
+ * peer repeats its SYN instead.
+ */
+int tcp_send_synack_cookie(struct tcp_sock *listener, struct sk_buff *syn,
+                           struct tcp_segment *seg, uint32_t cookie)
+{
+    struct iphdr *iph = ip_hdr(syn);
+    struct tcphdr *synth = tcp_hdr(syn);
+    struct sock addr = {
+        .saddr = iph->daddr,
+        .daddr = iph->saddr,
+        .sport = synth->dport,
+        .dport = synth->sport,
+    };
+    struct rtentry *rt = route_lookup(addr.daddr);
+    uint8_t opts[TCP_MAX_OPTLEN];
+    uint8_t optlen;
+    uint32_t rcv_wnd;
+    struct sk_buff *skb;
+    struct tcphdr *th;
+
+    /* Only what the SYN offered is answered, as a full connection would */
+    struct tcp_options o = {
+        .mss = (rt ? rt->dev->mtu : NETDEV_DEFAULT_MTU) - IP_HDR_LEN - TCP_HDR_LEN,
+        .saw_wscale = seg->opts.saw_wscale,
+        .sack_ok = seg->opts.sack_ok,
+        .saw_tstamp = seg->opts.saw_tstamp,
+        .tsecr = seg->opts.tsval,
+    };
+
+    tcp_select_initial_window(listener->rcvbuf, &rcv_wnd, &o.wscale);
+    optlen = tcp_write_syn_options(&o, opts);
+
+    skb = tcp_alloc_skb(0);
+    th = tcp_hdr(skb);
+
+    th->syn = 1;
+    th->ack = 1;
+    skb->seq = cookie;
+
+    /* A SYN's window is never scaled */
+    return tcp_v4_output(&addr, skb, seg->seq + 1, rcv_wnd, opts, optlen);
+}
+
+/*
+ * Appends written data to the write queue, as far as the send buffer has
+ * room, and returns how much was taken. Data fills up the last queued
+ * segment if that was not sent yet, and is cut into segments of the size
+ * goal otherwise.
+ */
+int tcp_send(struct tcp_sock *tsk, const void *buf, int len, struct skb_buf *owner)
+{
+    struct tcb *tcb = &tsk->tcb;
+    struct sk_buff *skb;
+    struct tcphdr *th;
+    uint32_t queued, goal;
+    int copied = 0;
+
+    pthread_mutex_lock(&tsk->write_queue.lock);
+
+    queued = tsk->write_seq - tcb->snd_una;
+    if (queued >= tsk->sndbuf) goto unlock;
+    if (len > tsk->sndbuf - queued) len = tsk->sndbuf - queued;
+
+    /* Payload is kept in a buffer that transmitted copies of the segments
+     * share, only headers are built per transmit */
+    if (owner) {
+        skb_buf_get(owner);
+    } else {
+        owner = skb_buf_alloc(len);
+        memcpy(owner->data, buf, len);
+        buf = owner->data;
+    }
+
+    goal = tcp_size_goal(tsk);
+
+    while (copied < len) {
+        uint32_t n = len - copied;
+
+        skb = skb_peek_tail(&tsk->write_queue);
+
+        if (skb && tsk->send_head && !before(skb->seq, tsk->snd_max) &&
+            !tcp_hdr(skb)->syn && !tcp_hdr(skb)->fin &&
+            skb->end_seq - skb->seq < goal && skb->nr_frags < SKB_MAX_FRAGS) {
+            /* Coalesce into the unsent tail */
+            if (n > goal - (skb->end_seq - skb->seq)) n = goal - (skb->end_seq - skb->seq);
+        } else {
+            if (n > goal) n = goal;
+
+            skb = tcp_alloc_skb(0);
+            skb->payload = skb->data;
 
-    ret -= (ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN);
+            th = tcp_hdr(skb);
+            th->ack = 1;
+            th->psh = 1;
 
-    if (ret != len) {
-        return -1;
+            skb->seq = tsk->write_seq;
+            skb->end_seq = tsk->write_seq;
+            skb_queue_tail(&tsk->write_queue, skb);
+            if (!tsk->send_head) tsk->send_head = skb;
+        }
+
+        skb_add_frag(skb, owner, buf + copied, n);
+        skb->end_seq += n;
+        tsk->write_seq += n;
+        copied += n;
     }
 
-    return ret;
+    skb_buf_put(owner);
+
+    tcp_write_xmit(&tsk->sk);
+
+unlock:
+    pthread_mutex_unlock(&tsk->write_queue.lock);
+
+    return copied;
+}
+
+/* Sends whatever Nagle or cork held back */
+void tcp_push(struct tcp_sock *tsk)
+{
+    pthread_mutex_lock(&tsk->write_queue.lock);
+    tcp_write_xmit(&tsk->sk);
+    pthread_mutex_unlock(&tsk->write_queue.lock);
 }
 
 int tcp_send_reset(struct tcp_sock *tsk)
@@ -159,6 +765,42 @@ int tcp_send_reset(struct tcp_sock *tsk)
 
     th->rst = 1;
     tcb->seq = tcb->snd_nxt;
+    skb->seq = tcb->snd_nxt;
     
     return tcp_transmit_skb(&tsk->sk, skb);
 }
+
+/*
+ * Resets the sender of a segment that no connection takes, RFC 793 3.4.
+ * An ACK is answered from its acknowledgment number, anything else is
+ * acknowledged instead.
+ */
+int tcp_v4_send_reset(struct sk_buff *in, struct tcp_segment *seg)
+{
+    struct iphdr *iph = ip_hdr(in);
+    struct tcphdr *inth = tcp_hdr(in);
+    struct sock addr = {
+        .saddr = iph->daddr,
+        .daddr = iph->saddr,
+        .sport = inth->dport,
+        .dport = inth->sport,
+    };
+    struct sk_buff *skb;
+    struct tcphdr *th;
+    uint32_t ack_seq = 0;
+
+    skb = tcp_alloc_skb(0);
+    th = tcp_hdr(skb);
+
+    th->rst = 1;
+
+    if (inth->ack) {
+        skb->seq = seg->ack;
+    } else {
+        th->ack = 1;
+        skb->seq = 0;
+        ack_seq = seg->seq + seg->len;
+    }
+
+    return tcp_v4_output(&addr, skb, ack_seq, 0, NULL, 0);
+}
@@ -0,0 +1,153 @@
+#include "syshead.h"
+#include "utils.h"
+#include "tcp.h"
+
+/*
+ * SYN cookies, RFC 4987 3.6. Once a listener's SYN queue is full, a SYN is
+ * answered with a SYN-ACK whose ISS encodes what the connection needs to
+ * know, and nothing is kept until the final ACK returns it. A cookie is
+ *
+ *   31..27 counter, time(NULL) / 64 modulo 32
+ *   26..24 index into msstab of the peer's MSS
+ *   23..20 peer's window scale, COOKIE_NO_WSCALE without the option
+ *   19     peer permits SACK
+ *   18..0  keyed hash of all of the above, the 4-tuple and the peer's ISN
+ */
+#define COOKIE_HASH_BITS 19
+#define COOKIE_HASH_MASK ((1U << COOKIE_HASH_BITS) - 1)
+#define COOKIE_SACK (1U << 19)
+#define COOKIE_WSCALE_SHIFT 20
+#define COOKIE_NO_WSCALE 15
+#define COOKIE_MSS_SHIFT 24
+#define COOKIE_COUNT_SHIFT 27
+#define COOKIE_PERIOD_SHIFT 6 /* 64 seconds */
+#define COOKIE_MAX_AGE 2 /* Periods a cookie is accepted in, this and the last */
+
+/* MSS values of common paths, the peer's is rounded down to one of them */
+static const uint16_t msstab[] = { 536, 1300, 1440, 1460, 4312, 8960 };
+
+static uint64_t cookie_key[2];
+
+uint64_t tcp_syncookies_sent;
+uint64_t tcp_syncookies_validated;
+uint64_t tcp_syncookies_failed;
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/* SipHash-2-4 of n 64 bit words, so that cookies cannot be forged without
+ * the key */
+static uint64_t siphash(const uint64_t *m, int n)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ cookie_key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ cookie_key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ cookie_key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ cookie_key[1];
+    uint64_t b = (uint64_t)(n * 8) << 56;
+
+    for (int i = 0; i < n; i++) {
+        v3 ^= m[i];
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m[i];
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t cookie_hash(uint32_t laddr, uint32_t raddr, uint16_t lport, uint16_t rport,
+                            uint32_t isn, uint32_t bits)
+{
+    uint64_t m[3];
+
+    m[0] = (uint64_t)laddr << 32 | raddr;
+    m[1] = (uint64_t)lport << 48 | (uint64_t)rport << 32 | isn;
+    m[2] = bits;
+
+    return siphash(m, 3) & COOKIE_HASH_MASK;
+}
+
+void tcp_syncookie_init()
+{
+    if (getrandom(cookie_key, sizeof(cookie_key), 0) != sizeof(cookie_key)) {
+        print_err("Could not seed SYN cookies from getrandom\n");
+        cookie_key[0] = (uint64_t)time(NULL) * rand();
+        cookie_key[1] = (uint64_t)rand() << 32 | rand();
+    }
+}
+
+/* The cookie to send as ISS in answer to a SYN with isn and opts */
+uint32_t tcp_syncookie_make(uint32_t laddr, uint32_t raddr, uint16_t lport, uint16_t rport,
+                            uint32_t isn, struct tcp_options *opts)
+{
+    uint32_t count = time(NULL) >> COOKIE_PERIOD_SHIFT;
+    uint32_t bits, mssind = 0;
+
+    for (int i = 1; i < sizeof(msstab) / sizeof(msstab[0]); i++) {
+        if (msstab[i] <= opts->mss) mssind = i;
+    }
+
+    bits = (count << COOKIE_COUNT_SHIFT) | (mssind << COOKIE_MSS_SHIFT);
+    bits |= (opts->saw_wscale ? opts->wscale : COOKIE_NO_WSCALE) << COOKIE_WSCALE_SHIFT;
+    if (opts->sack_ok) bits |= COOKIE_SACK;
+
+    __atomic_add_fetch(&tcp_syncookies_sent, 1, __ATOMIC_RELAXED);
+
+    return bits | cookie_hash(laddr, raddr, lport, rport, isn, bits);
+}
+
+/*
+ * Checks the cookie an ACK returns for the SYN with isn, and fills in the
+ * options that SYN carried. Returns 0 for a valid cookie.
+ */
+int tcp_syncookie_check(uint32_t laddr, uint32_t raddr, uint16_t lport, uint16_t rport,
+                        uint32_t isn, uint32_t cookie, struct tcp_options *opts)
+{
+    uint32_t count = time(NULL) >> COOKIE_PERIOD_SHIFT;
+    uint32_t bits = cookie & ~COOKIE_HASH_MASK;
+    uint32_t mssind = (cookie >> COOKIE_MSS_SHIFT) & 0x7;
+    uint32_t wscale = (cookie >> COOKIE_WSCALE_SHIFT) & 0xf;
+
+    if (((count - (cookie >> COOKIE_COUNT_SHIFT)) & 0x1f) >= COOKIE_MAX_AGE ||
+        mssind >= sizeof(msstab) / sizeof(msstab[0]) ||
+        (wscale > TCP_MAX_WSCALE && wscale != COOKIE_NO_WSCALE) ||
+        (cookie & COOKIE_HASH_MASK) != cookie_hash(laddr, raddr, lport, rport, isn, bits)) {
+        __atomic_add_fetch(&tcp_syncookies_failed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    opts->mss = msstab[mssind];
+    opts->saw_wscale = wscale != COOKIE_NO_WSCALE;
+    opts->wscale = opts->saw_wscale ? wscale : 0;
+    opts->sack_ok = !!(cookie & COOKIE_SACK);
+
+    __atomic_add_fetch(&tcp_syncookies_validated, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void tcp_syncookie_dump()
+{
+    print_debug("TCPSYNCOOKIES: %lu sent, %lu validated, %lu failed\n",
+                __atomic_load_n(&tcp_syncookies_sent, __ATOMIC_RELAXED),
+                __atomic_load_n(&tcp_syncookies_validated, __ATOMIC_RELAXED),
+                __atomic_load_n(&tcp_syncookies_failed, __ATOMIC_RELAXED));
+}
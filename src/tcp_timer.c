@@ -1,7 +1,173 @@
 #include "syshead.h"
 #include "sock.h"
+#include "tcp.h"
+#include "tcp_timer.h"
+#include "timer.h"
+#include "shard.h"
+
+static int tcp_rto_call(void *arg)
+{
+    tcp_retransmit_timer(arg);
+    return 0;
+}
+
+static int tcp_probe_call(void *arg)
+{
+    tcp_probe_timer(arg);
+    return 0;
+}
+
+static int tcp_delack_call(void *arg)
+{
+    tcp_delack_timer(arg);
+    return 0;
+}
+
+static int tcp_timewait_call(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+
+    if (tsk->sk.state == TCP_TIME_WAIT || tsk->sk.state == TCP_FIN_WAIT_2) tcp_done(tsk);
+    return 0;
+}
+
+/* On the connection's shard, or on the timer thread when not sharded */
+static void tcp_rto_work(struct shard_work *work)
+{
+    struct tcp_sock *tsk = list_entry(work, struct tcp_sock, rto_work);
+
+    sock_run(&tsk->sk, tcp_rto_call, tsk);
+    socket_put(tsk->sk.sock);
+}
+
+static void tcp_persist_work(struct shard_work *work)
+{
+    struct tcp_sock *tsk = list_entry(work, struct tcp_sock, persist_work);
+
+    sock_run(&tsk->sk, tcp_probe_call, tsk);
+    socket_put(tsk->sk.sock);
+}
+
+static void tcp_delack_work(struct shard_work *work)
+{
+    struct tcp_sock *tsk = list_entry(work, struct tcp_sock, delack_work);
+
+    sock_run(&tsk->sk, tcp_delack_call, tsk);
+    socket_put(tsk->sk.sock);
+}
+
+static void tcp_timewait_work(struct shard_work *work)
+{
+    struct tcp_sock *tsk = list_entry(work, struct tcp_sock, timewait_work);
+
+    sock_run(&tsk->sk, tcp_timewait_call, tsk);
+    socket_put(tsk->sk.sock);
+}
+
+/*
+ * Runs on the timer thread, which hands the work to the connection's shard
+ * and goes on with the wheel. An armed timer holds a reference on the
+ * socket, which the work drops once it ran. A timer that expires again
+ * before its work ran drops it right away.
+ */
+static void tcp_timer_post(struct tcp_sock *tsk, struct shard_work *work)
+{
+    if (shard_post(tsk->sk.shard, work)) socket_put(tsk->sk.sock);
+}
+
+static void tcp_rto_expired(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+
+    tcp_timer_post(tsk, &tsk->rto_work);
+}
+
+static void tcp_persist_expired(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+
+    tcp_timer_post(tsk, &tsk->persist_work);
+}
+
+static void tcp_delack_expired(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+
+    tcp_timer_post(tsk, &tsk->delack_work);
+}
+
+static void tcp_timewait_expired(void *arg)
+{
+    struct tcp_sock *tsk = arg;
+
+    tcp_timer_post(tsk, &tsk->timewait_work);
+}
+
+/* The reference is taken first, the timer may expire right away */
+static void tcp_timer_add(struct tcp_sock *tsk, struct timer *t, uint32_t ms)
+{
+    socket_get(tsk->sk.sock);
+
+    if (timer_add(t, ms)) socket_put(tsk->sk.sock);
+}
+
+static void tcp_timer_del(struct tcp_sock *tsk, struct timer *t)
+{
+    if (timer_del(t)) socket_put(tsk->sk.sock);
+}
 
 int tcp_init_timers(struct sock *sk)
 {
+    struct tcp_sock *tsk = tcp_sk(sk);
+
+    timer_init(&tsk->rto_timer, tcp_rto_expired, tsk);
+    timer_init(&tsk->persist_timer, tcp_persist_expired, tsk);
+    timer_init(&tsk->delack_timer, tcp_delack_expired, tsk);
+    timer_init(&tsk->timewait_timer, tcp_timewait_expired, tsk);
+    shard_work_init(&tsk->rto_work, tcp_rto_work);
+    shard_work_init(&tsk->persist_work, tcp_persist_work);
+    shard_work_init(&tsk->delack_work, tcp_delack_work);
+    shard_work_init(&tsk->timewait_work, tcp_timewait_work);
+
     return 0;
 }
+
+/* Arms the retransmission timer to fire one RTO from now */
+void tcp_reset_rto_timer(struct tcp_sock *tsk)
+{
+    tcp_timer_add(tsk, &tsk->rto_timer, tsk->rto);
+}
+
+void tcp_stop_rto_timer(struct tcp_sock *tsk)
+{
+    tcp_timer_del(tsk, &tsk->rto_timer);
+}
+
+/* Arms the zero window probe, backing off like the RTO */
+void tcp_reset_persist_timer(struct tcp_sock *tsk)
+{
+    uint32_t when = tsk->rto << tsk->probes;
+
+    if (when > TCP_RTO_MAX) when = TCP_RTO_MAX;
+
+    tcp_timer_add(tsk, &tsk->persist_timer, when);
+}
+
+void tcp_reset_delack_timer(struct tcp_sock *tsk)
+{
+    tcp_timer_add(tsk, &tsk->delack_timer, TCP_DELACK_TIME);
+}
+
+/* Restarts the timer that ends TIME-WAIT, or an orphan's FIN-WAIT-2 */
+void tcp_reset_timewait_timer(struct tcp_sock *tsk, uint32_t ms)
+{
+    tcp_timer_add(tsk, &tsk->timewait_timer, ms);
+}
+
+void tcp_clear_timers(struct tcp_sock *tsk)
+{
+    tcp_timer_del(tsk, &tsk->rto_timer);
+    tcp_timer_del(tsk, &tsk->persist_timer);
+    tcp_timer_del(tsk, &tsk->delack_timer);
+    tcp_timer_del(tsk, &tsk->timewait_timer);
+}
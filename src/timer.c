@@ -0,0 +1,236 @@
+#include "syshead.h"
+#include "utils.h"
+#include "timer.h"
+#include <sys/timerfd.h>
+
+/*
+ * Timers are armed from any thread and expire on the timer thread, which
+ * sleeps on a timerfd until the next level 0 slot with timers in it, or
+ * the next cascade of level 1.
+ */
+static struct list_head wheel[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t wheel_now; /* Ticks processed so far */
+static uint64_t wheel_base; /* Clock at tick 0 */
+static uint64_t wheel_wakeup; /* Tick the timerfd is armed for, 0 if none */
+static int timer_fd = -1;
+
+void timers_init()
+{
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        for (int j = 0; j < TIMER_LEVEL_SIZE; j++) {
+            list_init(&wheel[i][j]);
+        }
+    }
+
+    wheel_base = timer_clock_ms();
+    wheel_now = 0;
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        perror("ERR: Could not create timerfd");
+        exit(1);
+    }
+}
+
+void timer_init(struct timer *t, void (*handler) (void *arg), void *arg)
+{
+    list_init(&t->list);
+    t->expires = 0;
+    t->handler = handler;
+    t->arg = arg;
+}
+
+/* Caller holds wheel_lock */
+static void timer_wheel_insert(struct timer *t)
+{
+    uint64_t delta = t->expires > wheel_now ? t->expires - wheel_now : 0;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 &&
+           delta >= (1ULL << ((level + 1) * TIMER_LEVEL_BITS))) {
+        level++;
+    }
+
+    list_add_tail(&t->list,
+                  &wheel[level][(t->expires >> (level * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK]);
+}
+
+/* Caller holds wheel_lock */
+static void timer_program(uint64_t tick)
+{
+    struct itimerspec its = { 0 };
+    uint64_t at = wheel_base + tick;
+
+    its.it_value.tv_sec = at / 1000;
+    its.it_value.tv_nsec = (at % 1000) * 1000000;
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        perror("ERR: timerfd_settime");
+        return;
+    }
+
+    wheel_wakeup = tick;
+}
+
+/* (Re)arms the timer to expire ms from now, returns whether it was armed */
+int timer_add(struct timer *t, uint32_t ms)
+{
+    uint64_t now = timer_clock_ms() - wheel_base;
+    uint64_t delta = ms > TIMER_MAX_TICKS ? TIMER_MAX_TICKS : ms;
+    int pending;
+
+    pthread_mutex_lock(&wheel_lock);
+
+    pending = !list_empty(&t->list);
+    if (pending) list_del(&t->list);
+
+    /* An idle wheel skips ahead instead of ticking through the gap */
+    if (!wheel_wakeup) wheel_now = now;
+
+    /* The wheel may lag behind the clock while the timer thread works */
+    t->expires = (now > wheel_now ? now : wheel_now) + (delta ? delta : 1);
+    timer_wheel_insert(t);
+
+    if (!wheel_wakeup || t->expires < wheel_wakeup) {
+        timer_program(t->expires);
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+
+    return pending;
+}
+
+/* An expiry already underway on the timer thread is not stopped. Returns
+ * whether the timer was armed. */
+int timer_del(struct timer *t)
+{
+    int pending;
+
+    pthread_mutex_lock(&wheel_lock);
+
+    pending = !list_empty(&t->list);
+    if (pending) {
+        list_del(&t->list);
+        list_init(&t->list);
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+
+    return pending;
+}
+
+int timer_pending(struct timer *t)
+{
+    int pending;
+
+    pthread_mutex_lock(&wheel_lock);
+    pending = !list_empty(&t->list);
+    pthread_mutex_unlock(&wheel_lock);
+
+    return pending;
+}
+
+/* Redistributes a slot of a higher level over the levels below */
+static void timer_cascade(int level)
+{
+    struct list_head *slot = &wheel[level][(wheel_now >> (level * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK];
+    struct list_head *item, *tmp;
+
+    list_for_each_safe(item, tmp, slot) {
+        list_del(item);
+        timer_wheel_insert(list_entry(item, struct timer, list));
+    }
+}
+
+/* Advances the wheel by one tick, moving what expires onto expired */
+static void timer_tick(struct list_head *expired)
+{
+    struct list_head *slot, *item, *tmp;
+
+    wheel_now++;
+
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        if (wheel_now & ((1ULL << (level * TIMER_LEVEL_BITS)) - 1)) break;
+
+        timer_cascade(level);
+    }
+
+    slot = &wheel[0][wheel_now & TIMER_LEVEL_MASK];
+
+    list_for_each_safe(item, tmp, slot) {
+        list_del(item);
+        list_add_tail(item, expired);
+    }
+}
+
+/* Next tick worth waking up for, caller holds wheel_lock */
+static uint64_t timer_next_wakeup()
+{
+    for (uint64_t tick = wheel_now + 1; tick < wheel_now + TIMER_LEVEL_SIZE; tick++) {
+        if (!list_empty(&wheel[0][tick & TIMER_LEVEL_MASK])) return tick;
+
+        /* Level 1 cascades into level 0 here */
+        if (!(tick & TIMER_LEVEL_MASK)) return tick;
+    }
+
+    return (wheel_now | TIMER_LEVEL_MASK) + 1;
+}
+
+static int timer_wheel_empty()
+{
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        for (int j = 0; j < TIMER_LEVEL_SIZE; j++) {
+            if (!list_empty(&wheel[i][j])) return 0;
+        }
+    }
+
+    return 1;
+}
+
+void *timer_loop(void *arg)
+{
+    uint64_t expirations;
+
+    while (1) {
+        struct list_head expired;
+        uint64_t now;
+
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR) {
+            perror("ERR: Read from timerfd");
+            return NULL;
+        }
+
+        list_init(&expired);
+        now = timer_clock_ms() - wheel_base;
+
+        pthread_mutex_lock(&wheel_lock);
+
+        while (wheel_now < now) {
+            timer_tick(&expired);
+        }
+
+        if (timer_wheel_empty()) {
+            wheel_wakeup = 0;
+        } else {
+            timer_program(timer_next_wakeup());
+        }
+
+        /* Handlers run unlocked so that they can arm timers again. One
+         * that is re-armed or cancelled meanwhile leaves the list. */
+        while (!list_empty(&expired)) {
+            struct timer *t = list_first_entry(&expired, struct timer, list);
+
+            list_del(&t->list);
+            list_init(&t->list);
+            pthread_mutex_unlock(&wheel_lock);
+
+            t->handler(t->arg);
+
+            pthread_mutex_lock(&wheel_lock);
+        }
+
+        pthread_mutex_unlock(&wheel_lock);
+    }
+
+    return NULL;
+}
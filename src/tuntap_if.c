@@ -1,9 +1,51 @@
 #include "syshead.h"
 #include "utils.h"
 #include "basic.h"
+#include "netdev.h"
+#include "skbuff.h"
+#include "tuntap_if.h"
+#include "uring.h"
+#include <linux/virtio_net.h>
 
-static int tun_fd;
-static char* dev;
+#define TAP_URING_RX_SLOTS 64
+#define TAP_URING_TX_ENTRIES 64
+#define TAP_TX_IOVECS (2 + SKB_MAX_FRAGS)
+
+/* Receive buffer kept posted on the io_uring engine */
+struct tap_rx_slot {
+    struct sk_buff *skb;
+    struct virtio_net_hdr vh;
+    struct iovec iov[2];
+};
+
+/* Frame being written by the io_uring engine, kept until the write is done */
+struct tap_tx_slot {
+    struct sk_buff *skb;
+    struct virtio_net_hdr vh;
+    struct iovec iov[TAP_TX_IOVECS];
+};
+
+/*
+ * io_uring engine of a queue. The rx ring is only touched by the queue's rx
+ * thread and the tx ring only under the queue's txq lock, so both have a
+ * single submitter.
+ */
+struct tap_uring {
+    struct uring rx;
+    struct uring tx;
+    struct tap_rx_slot slots[TAP_URING_RX_SLOTS];
+    struct tap_tx_slot tx_slots[TAP_URING_TX_ENTRIES];
+    int tx_free[TAP_URING_TX_ENTRIES]; /* Stack of the idle tx slots */
+    int tx_nfree;
+};
+
+struct tap_priv {
+    int fds[NETDEV_MAX_QUEUES];
+    char name[IFNAMSIZ];
+    struct tap_uring *uring[NETDEV_MAX_QUEUES]; /* NULL for read/write engine */
+};
+
+extern char *tap_engine;
 
 char *tapaddr = "10.0.0.5";
 char *taproute = "10.0.0.0/24";
@@ -23,10 +65,15 @@ static int set_if_up(char *dev)
     return run_cmd("ip link set dev %s up", dev);
 }
 
+static int set_if_mtu(char *dev, uint32_t mtu)
+{
+    return run_cmd("ip link set dev %s mtu %u", dev, mtu);
+}
+
 /*
  * Taken from Kernel Documentation/networking/tuntap.txt
  */
-static int tun_alloc(char *dev)
+static int tun_alloc(char *dev, int multiqueue, int vnet_hdr, int nonblock)
 {
     struct ifreq ifr;
     int fd, err;
@@ -44,8 +91,18 @@ static int tun_alloc(char *dev)
      *        IFF_TAP   - TAP device
      *
      *        IFF_NO_PI - Do not provide packet information
+     *        IFF_MULTI_QUEUE - Attach another queue to the same device
+     *        IFF_VNET_HDR - Prefix frames with a struct virtio_net_hdr
      */
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (multiqueue) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+
+    if (vnet_hdr) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    
     if( *dev ) {
         strncpy(ifr.ifr_name, dev, IFNAMSIZ);
     }
@@ -56,39 +113,466 @@ static int tun_alloc(char *dev)
         return err;
     }
 
+    /* Let the kernel hand us checksum-partial frames and TCP super-frames */
+    if (vnet_hdr && (err = ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4)) < 0) {
+        perror("ERR: Could not set tun offloads");
+        close(fd);
+        return err;
+    }
+
+    /* Bursts are read until the queue runs dry */
+    if (nonblock) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
     strcpy(dev, ifr.ifr_name);
     return fd;
 }
 
-int tun_read(char *buf, int len)
+/*
+ * With offloads on, every frame is preceded by a virtio_net_hdr describing
+ * its checksum and segmentation state.
+ */
+static void tap_vnet_rx(struct sk_buff *skb, struct virtio_net_hdr *vh)
+{
+    if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        /* Frame never left the host, the checksum was not filled in */
+        skb->ip_summed = CHECKSUM_PARTIAL;
+    } else if (vh->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+        skb->ip_summed = CHECKSUM_UNNECESSARY;
+    }
+
+    skb->gso_size = vh->gso_size;
+}
+
+static void tap_vnet_tx(struct sk_buff *skb, struct virtio_net_hdr *vh)
+{
+    memset(vh, 0, sizeof(struct virtio_net_hdr));
+
+    if (skb->ip_summed == CHECKSUM_PARTIAL) {
+        vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh->csum_start = skb->head + skb->csum_start - skb->data;
+        vh->csum_offset = skb->csum_offset;
+    }
+
+    if (skb->gso_size) {
+        vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vh->gso_size = skb->gso_size;
+        vh->hdr_len = skb->payload - skb->data;
+    }
+}
+
+static int tap_read(struct netdev *dev, int fd, struct sk_buff *skb, int len)
+{
+    struct virtio_net_hdr vh;
+    struct iovec iov[2] = {
+        { .iov_base = &vh, .iov_len = sizeof(struct virtio_net_hdr) },
+        { .iov_base = skb->data, .iov_len = len },
+    };
+    int rc;
+
+    if (!(dev->features & NETDEV_F_VNET_HDR)) return read(fd, skb->data, len);
+
+    if ((rc = readv(fd, iov, 2)) < 0) return rc;
+
+    tap_vnet_rx(skb, &vh);
+
+    return rc < sizeof(struct virtio_net_hdr) ? 0 : rc - sizeof(struct virtio_net_hdr);
+}
+
+/* Gathers the vnet header, if any, and the frame with its fragments */
+static int tap_tx_iovec(struct netdev *dev, struct sk_buff *skb,
+                        struct virtio_net_hdr *vh, struct iovec *iov)
+{
+    int cnt = 0;
+
+    if (dev->features & NETDEV_F_VNET_HDR) {
+        tap_vnet_tx(skb, vh);
+        iov[cnt].iov_base = vh;
+        iov[cnt++].iov_len = sizeof(struct virtio_net_hdr);
+    }
+
+    return cnt + skb_fill_iovec(skb, &iov[cnt]);
+}
+
+static int tap_write(struct netdev *dev, int fd, struct sk_buff *skb)
+{
+    struct virtio_net_hdr vh;
+    struct iovec iov[TAP_TX_IOVECS];
+
+    if (!(dev->features & NETDEV_F_VNET_HDR) && !skb->nr_frags) {
+        return write(fd, skb->data, skb->len);
+    }
+
+    return writev(fd, iov, tap_tx_iovec(dev, skb, &vh, iov));
+}
+
+static int tap_buflen(struct netdev *dev)
+{
+    /* Offloading devices may hand us TCP super-frames */
+    return (dev->features & NETDEV_F_TSO) ? GSO_BUFLEN : netdev_frame_len(dev);
+}
+
+/*
+ * Takes a frame that is no super-frame out of a 64KB offload buffer, into
+ * an skb sized for the MTU. Small frames would otherwise hold on to the
+ * big buffers, which are few, and to memory far beyond what is charged for
+ * them while they wait for a reader. Returns NULL if skb is to be handed
+ * up itself, buf is left for the caller to reuse otherwise.
+ */
+static struct sk_buff *tap_rx_copy(struct netdev *dev, struct sk_buff *buf, int len)
+{
+    struct sk_buff *skb;
+
+    if (!(dev->features & NETDEV_F_TSO) || len > netdev_frame_len(dev)) return NULL;
+
+    skb = alloc_skb(netdev_frame_len(dev));
+    memcpy(skb->data, buf->data, len);
+    skb->len = len;
+    skb->ip_summed = buf->ip_summed;
+    skb->gso_size = buf->gso_size;
+
+    buf->ip_summed = CHECKSUM_NONE;
+    buf->gso_size = 0;
+
+    return skb;
+}
+
+static void tap_uring_post(struct netdev *dev, int fd, struct tap_uring *u, int i)
+{
+    struct tap_rx_slot *slot = &u->slots[i];
+    /* Every slot has at most one read in flight, so an SQE is always free */
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->rx);
+    int buflen = tap_buflen(dev);
+
+    /* A slot keeps its buffer unless the buffer was handed up */
+    if (!slot->skb) slot->skb = alloc_skb(buflen);
+
+    if (dev->features & NETDEV_F_VNET_HDR) {
+        slot->iov[0].iov_base = &slot->vh;
+        slot->iov[0].iov_len = sizeof(struct virtio_net_hdr);
+        slot->iov[1].iov_base = slot->skb->data;
+        slot->iov[1].iov_len = buflen;
+
+        uring_prep_rw(sqe, IORING_OP_READV, fd, slot->iov, 2, i);
+    } else {
+        uring_prep_rw(sqe, IORING_OP_READ, fd, slot->skb->data, buflen, i);
+    }
+}
+
+static struct tap_uring *tap_uring_open(struct netdev *dev, int fd, int sqpoll)
+{
+    struct tap_uring *u = calloc(1, sizeof(struct tap_uring));
+
+    if (uring_init(&u->rx, TAP_URING_RX_SLOTS, sqpoll) != 0 ||
+        uring_init(&u->tx, TAP_URING_TX_ENTRIES, sqpoll) != 0) {
+        free(u);
+        return NULL;
+    }
+
+    for (int i = 0; i < TAP_URING_RX_SLOTS; i++) {
+        tap_uring_post(dev, fd, u, i);
+    }
+
+    for (int i = 0; i < TAP_URING_TX_ENTRIES; i++) {
+        u->tx_free[u->tx_nfree++] = i;
+    }
+
+    uring_submit(&u->rx, 0);
+
+    return u;
+}
+
+static void tap_uring_close(struct tap_uring *u)
+{
+    uring_free(&u->rx);
+    uring_free(&u->tx);
+
+    for (int i = 0; i < TAP_URING_RX_SLOTS; i++) {
+        if (u->slots[i].skb) free_skb(u->slots[i].skb);
+    }
+
+    for (int i = 0; i < TAP_URING_TX_ENTRIES; i++) {
+        if (u->tx_slots[i].skb) free_skb(u->tx_slots[i].skb);
+    }
+
+    free(u);
+}
+
+static int tap_uring_rx_burst(struct netdev *dev, int queue, struct sk_buff **skbs, int n)
+{
+    struct tap_priv *tap = dev->priv;
+    struct tap_uring *u = tap->uring[queue];
+    struct io_uring_cqe *cqe;
+    int count = 0;
+
+    /* Reads are already submitted, poll the ring to stay cancellable */
+    while (!uring_peek_cqe(&u->rx)) {
+        struct pollfd pfd = { .fd = u->rx.fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+    }
+
+    /* Reap everything that completed and repost the slots in one go */
+    while (count < n && (cqe = uring_peek_cqe(&u->rx))) {
+        int i = cqe->user_data;
+        int res = cqe->res;
+        struct tap_rx_slot *slot = &u->slots[i];
+        struct sk_buff *skb;
+
+        uring_cqe_seen(&u->rx);
+
+        if (dev->features & NETDEV_F_VNET_HDR) {
+            res -= sizeof(struct virtio_net_hdr);
+        }
+
+        if (res > 0) {
+            if (dev->features & NETDEV_F_VNET_HDR) tap_vnet_rx(slot->skb, &slot->vh);
+
+            if ((skb = tap_rx_copy(dev, slot->skb, res)) == NULL) {
+                skb = slot->skb;
+                skb->len = res;
+                slot->skb = NULL;
+            }
+
+            skbs[count++] = skb;
+        } else if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+            print_err("ERR: io_uring read from tap: %s\n", strerror(-cqe->res));
+        }
+
+        tap_uring_post(dev, tap->fds[queue], u, i);
+    }
+
+    uring_submit(&u->rx, 0);
+
+    return count;
+}
+
+/* Frees the frames whose writes completed, returns how many failed */
+static int tap_uring_tx_reap(struct tap_uring *u)
 {
-    return read(tun_fd, buf, len);
+    struct io_uring_cqe *cqe;
+    int failed = 0;
+
+    while ((cqe = uring_peek_cqe(&u->tx))) {
+        struct tap_tx_slot *slot = &u->tx_slots[cqe->user_data];
+
+        if (cqe->res < 0) {
+            print_err("ERR: io_uring write to tap: %s\n", strerror(-cqe->res));
+            failed++;
+        }
+
+        uring_cqe_seen(&u->tx);
+
+        free_skb(slot->skb);
+        slot->skb = NULL;
+        u->tx_free[u->tx_nfree++] = slot - u->tx_slots;
+    }
+
+    return failed;
 }
 
-int tun_write(char *buf, int len)
+/*
+ * Submits the frames without waiting for their writes. The engine keeps
+ * them until the writes complete, which are reaped by the next burst.
+ * Writes are not linked, so that a failed one does not cancel the rest.
+ */
+static int tap_uring_tx_burst(struct netdev *dev, int queue, struct sk_buff **skbs, int n,
+                              int *dropped)
 {
-    return write(tun_fd, buf, len);
+    struct tap_priv *tap = dev->priv;
+    struct tap_uring *u = tap->uring[queue];
+    struct uring *r = &u->tx;
+    int used[TAP_URING_TX_ENTRIES];
+    int count = 0, back, failed = 0;
+
+    /* Failed writes of earlier bursts are reported with this one */
+    *dropped += tap_uring_tx_reap(u);
+
+    while (count < n && u->tx_nfree) {
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        struct sk_buff *skb = skbs[count];
+        struct tap_tx_slot *slot;
+        int i;
+
+        if (!sqe) break;
+
+        i = u->tx_free[--u->tx_nfree];
+        slot = &u->tx_slots[i];
+
+        if ((dev->features & NETDEV_F_VNET_HDR) || skb->nr_frags) {
+            int cnt = tap_tx_iovec(dev, skb, &slot->vh, slot->iov);
+
+            uring_prep_rw(sqe, IORING_OP_WRITEV, tap->fds[queue], slot->iov, cnt, i);
+        } else {
+            uring_prep_rw(sqe, IORING_OP_WRITE, tap->fds[queue], skb->data, skb->len, i);
+        }
+
+        slot->skb = skb;
+        skbs[count] = NULL;
+        used[count++] = i;
+    }
+
+    if (count && uring_submit(r, 0) < 0 && errno != EAGAIN && errno != EBUSY) {
+        print_err("ERR: io_uring write to tap: %s\n", strerror(errno));
+        failed = 1;
+    }
+
+    /* What the kernel did not pick up is the caller's again, to retry
+     * unless submitting failed for good */
+    back = uring_unsubmit(r);
+
+    for (int j = count - back; j < count; j++) {
+        struct tap_tx_slot *slot = &u->tx_slots[used[j]];
+
+        skbs[j] = slot->skb;
+        slot->skb = NULL;
+        u->tx_free[u->tx_nfree++] = used[j];
+    }
+
+    if (failed) {
+        *dropped += back;
+    } else {
+        count -= back;
+    }
+
+    return count;
 }
 
-void tun_init()
+static int tap_open(struct netdev *dev)
 {
-    dev = calloc(10, 1);
-    tun_fd = tun_alloc(dev);
+    struct tap_priv *tap = calloc(1, sizeof(struct tap_priv));
+    int vnet_hdr = dev->features & NETDEV_F_VNET_HDR;
+    int uring = 0;
+    int sqpoll = 0;
+
+    if (strcmp(tap_engine, "uring") == 0) {
+        uring = 1;
+    } else if (strcmp(tap_engine, "sqpoll") == 0) {
+        uring = 1;
+        sqpoll = 1;
+    } else if (strcmp(tap_engine, "rw") != 0) {
+        print_err("No such tap I/O engine: %s\n", tap_engine);
+        return -1;
+    }
+
+    /* The first queue names the device, the rest attach to it */
+    for (int i = 0; i < dev->queues; i++) {
+        if ((tap->fds[i] = tun_alloc(tap->name, dev->queues > 1, vnet_hdr, !uring)) < 0) {
+            print_err("ERROR when allocating tap queue %d\n", i);
+            return -1;
+        }
+    }
+
+    if (vnet_hdr) {
+        dev->features |= NETDEV_F_CSUM | NETDEV_F_TSO;
+    }
 
-    if (set_if_up(dev) != 0) {
+    /* Receive buffers are posted right away, so offloads must be known */
+    for (int i = 0; uring && i < dev->queues; i++) {
+        if ((tap->uring[i] = tap_uring_open(dev, tap->fds[i], sqpoll)) == NULL) {
+            print_err("ERROR when setting up io_uring for tap queue %d\n", i);
+            return -1;
+        }
+    }
+
+    dev->priv = tap;
+    dev->ifname = tap->name;
+
+    if (set_if_mtu(tap->name, dev->mtu) != 0) {
+        print_err("ERROR when setting mtu for if\n");
+    }
+
+    if (set_if_up(tap->name) != 0) {
         print_err("ERROR when setting up if\n");
     }
 
-    if (set_if_route(dev, taproute) != 0) {
+    if (set_if_route(tap->name, taproute) != 0) {
         print_err("ERROR when setting route for if\n");
     }
 
-    if (set_if_address(dev, tapaddr) != 0) {
+    if (set_if_address(tap->name, tapaddr) != 0) {
         print_err("ERROR when setting addr for if\n");
     }
+
+    return 0;
+}
+
+static int tap_rx_burst(struct netdev *dev, int queue, struct sk_buff **skbs, int n)
+{
+    struct tap_priv *tap = dev->priv;
+    struct pollfd pfd = { .fd = tap->fds[queue], .events = POLLIN };
+    int buflen = tap_buflen(dev);
+    int count = 0;
+
+    if (tap->uring[queue]) return tap_uring_rx_burst(dev, queue, skbs, n);
+
+    while (count < n) {
+        struct sk_buff *skb = alloc_skb(buflen);
+        struct sk_buff *copy;
+        int rc = tap_read(dev, tap->fds[queue], skb, buflen);
+
+        if (rc >= 0) {
+            if ((copy = tap_rx_copy(dev, skb, rc)) != NULL) {
+                /* The buffer goes back to the pool for the next read */
+                free_skb(skb);
+                skb = copy;
+            }
+
+            skb->len = rc;
+            skbs[count++] = skb;
+            continue;
+        }
+
+        free_skb(skb);
+
+        if (errno != EAGAIN) return count ? count : -1;
+        if (count) break;
+
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+    }
+
+    return count;
 }
 
-void free_tun()
+static int tap_tx_burst(struct netdev *dev, int queue, struct sk_buff **skbs, int n,
+                        int *dropped)
 {
-    free(dev);
+    struct tap_priv *tap = dev->priv;
+    int count;
+
+    if (tap->uring[queue]) return tap_uring_tx_burst(dev, queue, skbs, n, dropped);
+
+    for (count = 0; count < n; count++) {
+        if (tap_write(dev, tap->fds[queue], skbs[count]) >= 0) continue;
+
+        /* The device is backed up, the rest waits for the next flush */
+        if (errno == EAGAIN || errno == ENOBUFS || errno == EINTR) break;
+
+        perror("ERR: Write to tap");
+        (*dropped)++;
+    }
+
+    return count;
+}
+
+static void tap_close(struct netdev *dev)
+{
+    struct tap_priv *tap = dev->priv;
+
+    for (int i = 0; i < dev->queues; i++) {
+        if (tap->uring[i]) tap_uring_close(tap->uring[i]);
+        close(tap->fds[i]);
+    }
+
+    free(tap);
+    dev->priv = NULL;
 }
+
+struct netdev_ops tap_ops = {
+    .name = "tap",
+    .open = &tap_open,
+    .rx_burst = &tap_rx_burst,
+    .tx_burst = &tap_tx_burst,
+    .close = &tap_close,
+};
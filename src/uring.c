@@ -0,0 +1,188 @@
+#include "syshead.h"
+#include "utils.h"
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * See https://kernel.dk/io_uring.pdf for the ring layout and protocol
+ */
+
+#define URING_SQ_IDLE_MS 2000
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(struct uring *r, unsigned entries, int sqpoll)
+{
+    struct io_uring_params p;
+    unsigned *sq_array;
+
+    memset(r, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(struct io_uring_params));
+
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = URING_SQ_IDLE_MS;
+    }
+
+    if ((r->fd = io_uring_setup(entries, &p)) < 0) {
+        perror("ERR: io_uring_setup");
+        return -1;
+    }
+
+    r->sqpoll = sqpoll;
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len) r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+    if (r->sq_ring == MAP_FAILED) goto err_mmap;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+        if (r->cq_ring == MAP_FAILED) goto err_mmap;
+    }
+
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+    if (r->sqes == MAP_FAILED) goto err_mmap;
+
+    r->sq_head = r->sq_ring + p.sq_off.head;
+    r->sq_tail = r->sq_ring + p.sq_off.tail;
+    r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+    r->sq_flags = r->sq_ring + p.sq_off.flags;
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+
+    /* SQEs are always consumed in order, so the indirection array is fixed */
+    sq_array = r->sq_ring + p.sq_off.array;
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    r->cq_head = r->cq_ring + p.cq_off.head;
+    r->cq_tail = r->cq_ring + p.cq_off.tail;
+    r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+    r->cqes = r->cq_ring + p.cq_off.cqes;
+
+    return 0;
+
+err_mmap:
+    perror("ERR: io_uring mmap");
+    uring_free(r);
+    return -1;
+}
+
+void uring_free(struct uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_len);
+    }
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_len);
+    if (r->fd > 0) close(r->fd);
+
+    memset(r, 0, sizeof(struct uring));
+}
+
+/*
+ * Returns the next free SQE, or NULL when the submission queue is full and
+ * uring_submit() has to be called first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sqe_tail - head >= r->sq_entries) return NULL;
+
+    return &r->sqes[r->sqe_tail++ & *r->sq_mask];
+}
+
+/*
+ * Publishes the prepared SQEs and waits for at least wait_nr completions.
+ * With SQPOLL, the kernel thread picks the SQEs up on its own and a syscall
+ * is only needed to wake it up or to wait.
+ */
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    unsigned submitted = r->sqe_tail - *r->sq_tail;
+    unsigned flags = 0;
+    int rc;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    if (r->sqpoll) {
+        /* Order the tail store before reading the wakeup flag */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+
+        if (!flags && !wait_nr) return submitted;
+    } else if (!submitted && !wait_nr) {
+        return 0;
+    }
+
+    if (wait_nr) flags |= IORING_ENTER_GETEVENTS;
+
+    do {
+        rc = io_uring_enter(r->fd, submitted, wait_nr, flags);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
+
+/*
+ * Takes back the SQEs the kernel has not picked up yet and returns how
+ * many, after uring_submit() failed. Without SQPOLL the kernel only reads
+ * the SQ ring within io_uring_enter(), a polling thread may read it any
+ * time and nothing can be taken back.
+ */
+unsigned uring_unsubmit(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned n = r->sqe_tail - head;
+
+    if (r->sqpoll) return 0;
+
+    r->sqe_tail = head;
+    __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,89 @@
+#!/usr/bin/env python2
+#
+# Minimal server for the suites, run with liblevelip preloaded.
+#
+# usage: listen.py PORT BACKLOG serve|hold|late|keep|send|sink|chunks|drip [N] [nodelay|cork]
+#
+# serve accepts every connection and writes "hello\n" to it; hold never
+# accepts, so connections pile up in the accept queue; late serves only
+# after N seconds, so they pile up until then; keep writes "hello\n"
+# and reads on, printing the error the read fails with; send writes N bytes
+# of pattern(), in one call, to every connection; sink reads until the
+# peer closes and answers with the amount and the sum of bytes read, from
+# N threads at once if given; chunks writes the N chunks of chunks(), one
+# call each; drip writes 10 bytes N times, with TCP_NODELAY on or inside a
+# TCP_CORK if asked to.
+
+import errno
+import socket
+from socket import IPPROTO_TCP, TCP_NODELAY, TCP_CORK
+import sys
+import threading
+import time
+
+def pattern(n):
+    return "".join(chr(i % 251) for i in range(n))
+
+# Of sizes that do and do not fill a segment or a shared memory slot
+def chunks(n):
+    return [chr(i % 256) * ((i * 7919) % 20000 + 1) for i in range(n)]
+
+# Readers after the first to see the end fail, as the connection is closing
+def drain(conn, total, lock):
+    while True:
+        try:
+            b = conn.recv(65536)
+        except socket.error:
+            break
+        if not b: break
+        with lock:
+            total[0] += len(b)
+            total[1] += sum(bytearray(b))
+
+port, backlog, mode = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+
+s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+s.bind(("0.0.0.0", port))
+s.listen(backlog)
+
+if mode == "hold":
+    time.sleep(3600)
+elif mode == "late":
+    time.sleep(int(sys.argv[4]))
+
+if mode == "send":
+    data = pattern(int(sys.argv[4]))
+elif mode == "chunks":
+    data = chunks(int(sys.argv[4]))
+
+while True:
+    conn, peer = s.accept()
+    if mode == "send":
+        conn.sendall(data)
+    elif mode == "chunks":
+        for chunk in data:
+            conn.sendall(chunk)
+    elif mode == "drip":
+        opt = sys.argv[5] if len(sys.argv) > 5 else None
+        if opt == "nodelay": conn.setsockopt(IPPROTO_TCP, TCP_NODELAY, 1)
+        if opt == "cork": conn.setsockopt(IPPROTO_TCP, TCP_CORK, 1)
+        for i in range(int(sys.argv[4])):
+            conn.send(chr(ord("a") + i % 26) * 10)
+        if opt == "cork": conn.setsockopt(IPPROTO_TCP, TCP_CORK, 0)
+    elif mode == "sink":
+        total, lock = [0, 0], threading.Lock()
+        n = int(sys.argv[4]) if len(sys.argv) > 4 else 1
+        readers = [threading.Thread(target=drain, args=(conn, total, lock)) for i in range(n)]
+        [t.start() for t in readers]
+        [t.join() for t in readers]
+        conn.sendall("%d %d\n" % tuple(total))
+    elif mode == "keep":
+        conn.send("hello\n")
+        try:
+            while conn.recv(65536): pass
+        except socket.error as e:
+            print errno.errorcode[e.errno]
+            sys.stdout.flush()
+    else:
+        conn.send("hello\n")
+    conn.close()
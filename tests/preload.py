@@ -0,0 +1,28 @@
+#!/usr/bin/env python2
+#
+# Programs that the suites run on the stack, with liblevelip preloaded.
+# Servers are listen.py, see there for their modes; clients are the code
+# a suite gives, with args in their sys.argv.
+#
+# usage, from a suite: sys.path.insert(0, "."); from preload import *
+
+import os
+import subprocess
+import time
+
+ENV = dict(os.environ, LD_PRELOAD=os.path.abspath("../tools/liblevelip.so"))
+
+# Returns once the server had the time to listen, unless given a delay
+def start_server(port, backlog, mode, *args, **kwargs):
+    delay = kwargs.pop("delay", 1)
+    argv = ["python2.7", "listen.py", str(port), str(backlog), mode] + [str(a) for a in args]
+    srv = subprocess.Popen(argv, env=ENV, **kwargs)
+    time.sleep(delay)
+    return srv
+
+def start_client(code, *args, **kwargs):
+    return subprocess.Popen(["python2.7", "-c", code] + [str(a) for a in args], env=ENV, **kwargs)
+
+# Returns what the client printed
+def run_client(code, *args):
+    return subprocess.check_output(["python2.7", "-c", code] + [str(a) for a in args], env=ENV)
@@ -0,0 +1,56 @@
+#!/usr/bin/env python2
+#
+# Connections that the suites drive segment by segment with scapy. The
+# host's own stack knows nothing of them, so its resets are dropped while
+# one is open.
+#
+# usage, from a suite: sys.path.insert(0, "."); from rawtcp import *
+
+import os
+import threading
+import time
+from scapy.all import *
+
+STACK = "10.0.0.4"
+RST_RULE = "OUTPUT -p tcp --tcp-flags RST RST -d %s -j DROP" % STACK
+
+class RawConn(object):
+    def __init__(self, dport, sport, options=[("MSS", 1460)]):
+        os.system("iptables -I " + RST_RULE)
+        self.sport, self.dport = sport, dport
+        self.seq = 1000
+        self.synack = sr1(self.segment("S", options=options), timeout=3)
+        self.seq += 1
+        self.ack = self.synack[TCP].seq + 1
+        send(self.segment("A"))
+
+    def segment(self, flags="A", seq=None, data=None, options=[]):
+        tcp = TCP(sport=self.sport, dport=self.dport, flags=flags, options=options, window=65535,
+                  seq=self.seq if seq is None else seq, ack=self.ack if "A" in flags else 0)
+        p = IP(dst=STACK)/tcp
+        return p/data if data else p
+
+    # Sends data at seq, or right after what was sent so far
+    def send(self, data, seq=None):
+        send(self.segment("PA", seq, data))
+        if seq is None: self.seq += len(data)
+
+    def close(self):
+        send(self.segment("R"))
+        os.system("iptables -D " + RST_RULE)
+
+# Segments of the stack's end of a connection, captured in the background
+# while the caller goes on. join() returns them.
+class Capture(object):
+    def __init__(self, sport, timeout):
+        iface = conf.route.route(STACK)[0]
+        self.segs = []
+        self.thread = threading.Thread(target=lambda: self.segs.extend(
+            sniff(iface=iface, timeout=timeout,
+                  lfilter=lambda p: TCP in p and p[IP].src == STACK and p[TCP].sport == sport)))
+        self.thread.start()
+        time.sleep(0.5)
+
+    def join(self):
+        self.thread.join()
+        return self.segs
@@ -11,6 +11,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include "liblevelip.h"
 
 #define LVLIP_FD_BOUNDARY 4096
@@ -28,6 +31,10 @@ static int (*_getsockopt)(int fd, int level, int optname,
 static int (*_read)(int sockfd, void *buf, size_t len) = NULL;
 static int (*_write)(int sockfd, const void *buf, size_t len) = NULL;
 static int (*_connect)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = NULL;
+static int (*_bind)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = NULL;
+static int (*_listen)(int sockfd, int backlog) = NULL;
+static int (*_accept)(int sockfd, struct sockaddr *addr, socklen_t *addrlen) = NULL;
+static int (*_accept4)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) = NULL;
 static int (*_socket)(int domain, int type, int protocol) = NULL;
 static int (*_close)(int fildes) = NULL;
 static int (*_poll)(struct pollfd fds[], nfds_t nfds, int timeout) = NULL;
@@ -39,8 +46,20 @@ static ssize_t (*_recvfrom)(int sockfd, void *buf, size_t len,
                             socklen_t *restrict addrlen) = NULL;
 
 static int lvlfd = 0;
+static pid_t lvlpid = 0;
 #define BUFLEN 4096
 
+/* Shared memory transport, NULL while requests go over lvlfd */
+static struct ipc_shm *shm = NULL;
+static int shm_sq_event = -1;
+static int shm_cq_event = -1;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shm_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t shm_free = (1U << IPC_SHM_SLOTS) - 1;
+static uint32_t shm_done = 0;
+static int shm_reaping = 0;
+static int shm_spins = 0;
+
 static int is_fd_ours(int sockfd)
 {
     return sockfd > LVLIP_FD_BOUNDARY;
@@ -95,9 +114,185 @@ static int init_socket(char *sockname)
     return data_socket;
 }
 
-static int transmit_lvlip(struct ipc_msg *msg, int msglen)
+static void free_shm()
+{
+    munmap(shm, sizeof(struct ipc_shm));
+    _close(shm_sq_event);
+    _close(shm_cq_event);
+    shm = NULL;
+}
+
+/*
+ * Offers lvl-ip a shared memory region and eventfds for requests to go
+ * through. Requests stay on the socket if it declines.
+ */
+static void init_shm()
+{
+    int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_shm_setup);
+    int rlen = sizeof(struct ipc_msg) + sizeof(struct ipc_err);
+    struct ipc_msg *msg = alloca(msglen);
+    struct ipc_setup_fds {
+        struct cmsghdr hdr;
+        int fds[3];
+    } control;
+    struct iovec iov = { .iov_base = msg, .iov_len = msglen };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = &control,
+        .msg_controllen = CMSG_SPACE(sizeof(control.fds)),
+    };
+    char rbuf[rlen];
+    int memfd;
+
+    if ((memfd = memfd_create("lvlip", MFD_CLOEXEC)) == -1) return;
+
+    /* Spinning on the only CPU keeps lvl-ip from running */
+    shm_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? IPC_SHM_SPIN : 0;
+
+    if (ftruncate(memfd, sizeof(struct ipc_shm)) == -1) goto close;
+
+    shm = mmap(NULL, sizeof(struct ipc_shm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm == MAP_FAILED) {
+        shm = NULL;
+        goto close;
+    }
+
+    shm_sq_event = eventfd(0, EFD_CLOEXEC);
+    shm_cq_event = eventfd(0, EFD_CLOEXEC);
+
+    msg->type = IPC_SHM;
+    msg->pid = lvlpid;
+
+    struct ipc_shm_setup setup = {
+        .slots = IPC_SHM_SLOTS,
+        .slot_size = IPC_SHM_SLOT_SIZE
+    };
+
+    memcpy(msg->data, &setup, sizeof(struct ipc_shm_setup));
+
+    memset(&control, 0, sizeof(control));
+    control.hdr.cmsg_level = SOL_SOCKET;
+    control.hdr.cmsg_type = SCM_RIGHTS;
+    control.hdr.cmsg_len = CMSG_LEN(sizeof(control.fds));
+    control.fds[0] = memfd;
+    control.fds[1] = shm_sq_event;
+    control.fds[2] = shm_cq_event;
+
+    if (shm_sq_event == -1 || shm_cq_event == -1 || sendmsg(lvlfd, &mh, 0) == -1 ||
+        _read(lvlfd, rbuf, rlen) != rlen ||
+        ((struct ipc_err *)((struct ipc_msg *)rbuf)->data)->rc != 0) {
+        free_shm();
+    }
+
+close:
+    _close(memfd);
+}
+
+/* Waits for completions until the slot's is among them. One thread reaps
+ * the completion ring at a time, the others wait for it to hand over. */
+static void shm_wait(int slot)
+{
+    uint64_t n;
+    int done, spin;
+
+    pthread_mutex_lock(&shm_lock);
+
+    while (!(shm_done & (1U << slot))) {
+        if (shm_reaping) {
+            pthread_cond_wait(&shm_cond, &shm_lock);
+            continue;
+        }
+
+        shm_reaping = 1;
+        pthread_mutex_unlock(&shm_lock);
+
+        for (spin = 0; ipc_ring_empty(&shm->cq); spin++) {
+            if (spin < shm_spins) {
+                ipc_cpu_relax();
+            } else if (ipc_ring_sleep(&shm->cq)) {
+                if (_read(shm_cq_event, &n, sizeof(n)) == -1 && errno != EINTR) {
+                    perror("Could not wait for IPC completion");
+                }
+                __atomic_store_n(&shm->cq.idle, 0, __ATOMIC_RELAXED);
+            }
+        }
+
+        pthread_mutex_lock(&shm_lock);
+
+        while ((done = ipc_ring_pop(&shm->cq)) >= 0) shm_done |= 1U << done;
+
+        shm_reaping = 0;
+        pthread_cond_broadcast(&shm_cond);
+    }
+
+    shm_done &= ~(1U << slot);
+
+    pthread_mutex_unlock(&shm_lock);
+}
+
+static int shm_slot_get()
+{
+    int slot;
+
+    pthread_mutex_lock(&shm_lock);
+
+    while (!shm_free) pthread_cond_wait(&shm_cond, &shm_lock);
+
+    slot = __builtin_ctz(shm_free);
+    shm_free &= ~(1U << slot);
+
+    pthread_mutex_unlock(&shm_lock);
+
+    return slot;
+}
+
+static void shm_slot_put(int slot)
 {
-    char *buf[RCBUF_LEN];
+    pthread_mutex_lock(&shm_lock);
+
+    shm_free |= 1U << slot;
+    pthread_cond_broadcast(&shm_cond);
+
+    pthread_mutex_unlock(&shm_lock);
+}
+
+/* Hands the request in the slot to lvl-ip and waits for its response,
+ * which is then in the slot */
+static void shm_call(int slot)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&shm_lock);
+    ipc_ring_push(&shm->sq, slot);
+    pthread_mutex_unlock(&shm_lock);
+
+    if (ipc_ring_wake(&shm->sq) && _write(shm_sq_event, &one, sizeof(one)) == -1) {
+        perror("Could not signal IPC submission");
+    }
+
+    shm_wait(slot);
+}
+
+/* Sends msg to lvl-ip and reads the response into resp, of at most resplen bytes */
+static int call_lvlip(struct ipc_msg *msg, int msglen, void *resp, int resplen)
+{
+    int slot;
+
+    if (shm) {
+        if (msglen > IPC_SHM_SLOT_SIZE || resplen > IPC_SHM_SLOT_SIZE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        slot = shm_slot_get();
+        memcpy(shm->slots[slot], msg, msglen);
+        shm_call(slot);
+        memcpy(resp, shm->slots[slot], resplen);
+        shm_slot_put(slot);
+
+        return 0;
+    }
 
     // Send mocked syscall to lvl-ip
     if (_write(lvlfd, (char *)msg, msglen) == -1) {
@@ -105,10 +300,21 @@ static int transmit_lvlip(struct ipc_msg *msg, int msglen)
     }
 
     // Read return value from lvl-ip
-    if (_read(lvlfd, buf, RCBUF_LEN) == -1) {
+    if (_read(lvlfd, resp, resplen) == -1) {
         perror("Could not read IPC response");
     }
-    
+
+    return 0;
+}
+
+static int transmit_lvlip(struct ipc_msg *msg, int msglen)
+{
+    char buf[RCBUF_LEN];
+
+    if (call_lvlip(msg, msglen, buf, sizeof(struct ipc_msg) + sizeof(struct ipc_err)) == -1) {
+        return -1;
+    }
+
     struct ipc_msg *response = (struct ipc_msg *) buf;
 
     if (response->type != msg->type || response->pid != msg->pid) {
@@ -133,7 +339,7 @@ int socket(int domain, int type, int protocol)
         return _socket(domain, type, protocol);
     }
     
-    int pid = getpid();
+    int pid = lvlpid;
     int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_socket);
 
     struct ipc_msg *msg = alloca(msglen);
@@ -155,7 +361,7 @@ int close(int fd)
 {
     if (!is_fd_ours(fd)) return _close(fd);
 
-    int pid = getpid();
+    int pid = lvlpid;
     int msglen = sizeof(struct ipc_msg) + sizeof(int);
 
     struct ipc_msg *msg = alloca(msglen);
@@ -172,7 +378,7 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     if (!is_fd_ours(sockfd)) return _connect(sockfd, addr, addrlen);
 
     int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_connect);
-    int pid = getpid();
+    int pid = lvlpid;
     
     struct ipc_msg *msg = alloca(msglen);
     msg->type = IPC_CONNECT;
@@ -189,12 +395,189 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     return transmit_lvlip(msg, msglen);
 }
 
+int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (!is_fd_ours(sockfd)) return _bind(sockfd, addr, addrlen);
+
+    int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_bind);
+    int pid = lvlpid;
+    
+    struct ipc_msg *msg = alloca(msglen);
+    msg->type = IPC_BIND;
+    msg->pid = pid;
+
+    struct ipc_bind payload = {
+        .sockfd = sockfd,
+        .addr = *addr,
+        .addrlen = addrlen
+    };
+
+    memcpy(msg->data, &payload, sizeof(struct ipc_bind));
+
+    return transmit_lvlip(msg, msglen);
+}
+
+int listen(int sockfd, int backlog)
+{
+    if (!is_fd_ours(sockfd)) return _listen(sockfd, backlog);
+
+    int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_listen);
+    int pid = lvlpid;
+    
+    struct ipc_msg *msg = alloca(msglen);
+    msg->type = IPC_LISTEN;
+    msg->pid = pid;
+
+    struct ipc_listen payload = {
+        .sockfd = sockfd,
+        .backlog = backlog
+    };
+
+    memcpy(msg->data, &payload, sizeof(struct ipc_listen));
+
+    return transmit_lvlip(msg, msglen);
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    if (!is_fd_ours(sockfd)) return _accept(sockfd, addr, addrlen);
+
+    int pid = lvlpid;
+    int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_accept);
+
+    struct ipc_msg *msg = alloca(msglen);
+    msg->type = IPC_ACCEPT;
+    msg->pid = pid;
+
+    struct ipc_accept payload = {
+        .sockfd = sockfd,
+        .addrlen = addr && addrlen ? *addrlen : 0
+    };
+
+    memcpy(msg->data, &payload, sizeof(struct ipc_accept));
+
+    int rlen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) + sizeof(struct ipc_accept);
+    char rbuf[rlen];
+    memset(rbuf, 0, rlen);
+
+    if (call_lvlip(msg, msglen, rbuf, rlen) == -1) return -1;
+
+    struct ipc_msg *response = (struct ipc_msg *) rbuf;
+
+    if (response->type != IPC_ACCEPT || response->pid != pid) {
+        printf("ERR: IPC accept response type %d, pid %d\n",
+               response->type, response->pid);
+        return -1;
+    }
+
+    struct ipc_err *error = (struct ipc_err *) response->data;
+    if (error->rc < 0) {
+        errno = error->err;
+        return error->rc;
+    }
+
+    struct ipc_accept *actual = (struct ipc_accept *) error->data;
+    if (addr && addrlen) {
+        memcpy(addr, &actual->addr, actual->addrlen);
+        *addrlen = actual->addrlen;
+    }
+
+    return error->rc;
+}
+
+/* The flags are not supported, lvl-ip sockets have no file status */
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    if (!is_fd_ours(sockfd)) return _accept4(sockfd, addr, addrlen, flags);
+
+    return accept(sockfd, addr, addrlen);
+}
+
+/* Writes are cut into requests that fit a slot, the payload is copied
+ * into the slot and lvl-ip takes it from there */
+static ssize_t shm_write(int sockfd, const void *buf, size_t len)
+{
+    int hdrlen = sizeof(struct ipc_msg) + sizeof(struct ipc_write);
+    size_t sent = 0;
+
+    do {
+        size_t n = len - sent;
+        int slot = shm_slot_get();
+        struct ipc_msg *msg = (struct ipc_msg *) shm->slots[slot];
+        struct ipc_write *payload = (struct ipc_write *) msg->data;
+        struct ipc_err *error = (struct ipc_err *) msg->data;
+        int rc;
+
+        if (n > IPC_SHM_SLOT_SIZE - hdrlen) n = IPC_SHM_SLOT_SIZE - hdrlen;
+
+        msg->type = IPC_WRITE;
+        msg->pid = lvlpid;
+        payload->sockfd = sockfd;
+        payload->len = n;
+        memcpy(payload->buf, (const char *)buf + sent, n);
+
+        shm_call(slot);
+
+        rc = error->rc;
+        if (rc < 0) errno = error->err;
+
+        shm_slot_put(slot);
+
+        if (rc < 0) return sent ? sent : -1;
+
+        sent += rc;
+        if (rc < n) break;
+    } while (sent < len);
+
+    return sent;
+}
+
+/* lvl-ip reads into the slot, so only what was read is copied out */
+static ssize_t shm_read(int sockfd, void *buf, size_t len)
+{
+    int hdrlen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) + sizeof(struct ipc_read);
+    int slot = shm_slot_get();
+    struct ipc_msg *msg = (struct ipc_msg *) shm->slots[slot];
+    struct ipc_read *payload = (struct ipc_read *) msg->data;
+    struct ipc_err *error = (struct ipc_err *) msg->data;
+    struct ipc_read *data = (struct ipc_read *) error->data;
+    int rc;
+
+    if (len > IPC_SHM_SLOT_SIZE - hdrlen) len = IPC_SHM_SLOT_SIZE - hdrlen;
+
+    msg->type = IPC_READ;
+    msg->pid = lvlpid;
+    payload->sockfd = sockfd;
+    payload->len = len;
+
+    shm_call(slot);
+
+    if (msg->type != IPC_READ || msg->pid != lvlpid) {
+        printf("ERR: IPC read response type %d, pid %d\n", msg->type, msg->pid);
+        rc = -1;
+    } else if ((rc = error->rc) < 0) {
+        errno = error->err;
+    } else if (len < data->len) {
+        printf("IPC read received len error: %lu\n", data->len);
+        rc = -1;
+    } else {
+        memcpy(buf, data->buf, data->len);
+        rc = data->len;
+    }
+
+    shm_slot_put(slot);
+
+    return rc;
+}
+
 ssize_t write(int sockfd, const void *buf, size_t len)
 {
     if (!is_fd_ours(sockfd)) return _write(sockfd, buf, len);
 
+    if (shm) return shm_write(sockfd, buf, len);
+
     int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_write) + len;
-    int pid = getpid();
+    int pid = lvlpid;
 
     struct ipc_msg *msg = alloca(msglen);
     msg->type = IPC_WRITE;
@@ -215,7 +598,9 @@ ssize_t read(int sockfd, void *buf, size_t len)
 {
     if (!is_fd_ours(sockfd)) return _read(sockfd, buf, len);
 
-    int pid = getpid();
+    if (shm) return shm_read(sockfd, buf, len);
+
+    int pid = lvlpid;
     int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_read);
 
     struct ipc_msg *msg = alloca(msglen);
@@ -234,7 +619,8 @@ ssize_t read(int sockfd, void *buf, size_t len)
         perror("Error on writing IPC read");
     }
 
-    int rlen = msglen + len;
+    /* The response carries the error code ahead of the data */
+    int rlen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) + sizeof(struct ipc_read) + len;
     char rbuf[rlen];
     memset(rbuf, 0, rlen);
 
@@ -308,8 +694,24 @@ int setsockopt(int fd, int level, int optname,
 {
     if (!is_fd_ours(fd)) return _setsockopt(fd, level, optname, optval, optlen);
 
-    printf("Setsockopt not supported yet\n");
-    return 0;
+    int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_sockopt) + optlen;
+    int pid = lvlpid;
+
+    struct ipc_msg *msg = alloca(msglen);
+    msg->type = IPC_SETSOCKOPT;
+    msg->pid = pid;
+
+    struct ipc_sockopt payload = {
+        .sockfd = fd,
+        .level = level,
+        .optname = optname,
+        .optlen = optlen
+    };
+
+    memcpy(msg->data, &payload, sizeof(struct ipc_sockopt));
+    memcpy(((struct ipc_sockopt *)msg->data)->optval, optval, optlen);
+
+    return transmit_lvlip(msg, msglen);
 }
 
 int getsockopt(int fd, int level, int optname,
@@ -317,8 +719,53 @@ int getsockopt(int fd, int level, int optname,
 {
     if (!is_fd_ours(fd)) return _getsockopt(fd, level, optname, optval, optlen);
 
-    printf("Getsockopt not supported yet\n");
-    return 0;
+    int pid = lvlpid;
+    int msglen = sizeof(struct ipc_msg) + sizeof(struct ipc_sockopt);
+
+    struct ipc_msg *msg = alloca(msglen);
+    msg->type = IPC_GETSOCKOPT;
+    msg->pid = pid;
+
+    struct ipc_sockopt payload = {
+        .sockfd = fd,
+        .level = level,
+        .optname = optname,
+        .optlen = *optlen
+    };
+
+    memcpy(msg->data, &payload, sizeof(struct ipc_sockopt));
+
+    int rlen = sizeof(struct ipc_msg) + sizeof(struct ipc_err) +
+        sizeof(struct ipc_sockopt) + *optlen;
+    char rbuf[rlen];
+    memset(rbuf, 0, rlen);
+
+    if (call_lvlip(msg, msglen, rbuf, rlen) == -1) return -1;
+
+    struct ipc_msg *response = (struct ipc_msg *) rbuf;
+
+    if (response->type != IPC_GETSOCKOPT || response->pid != pid) {
+        printf("ERR: IPC getsockopt response type %d, pid %d\n",
+               response->type, response->pid);
+        return -1;
+    }
+
+    struct ipc_err *error = (struct ipc_err *) response->data;
+    if (error->rc < 0) {
+        errno = error->err;
+        return error->rc;
+    }
+
+    struct ipc_sockopt *actual = (struct ipc_sockopt *) error->data;
+    if (actual->optlen > *optlen) {
+        printf("IPC getsockopt received len error: %d\n", actual->optlen);
+        return -1;
+    }
+
+    memcpy(optval, actual->optval, actual->optlen);
+    *optlen = actual->optlen;
+
+    return error->rc;
 }
 
 int fcntl(int fildes, int cmd, ...)
@@ -338,6 +785,24 @@ int fcntl(int fildes, int cmd, ...)
     return 0;
 }
 
+/* A child gets a connection and rings of its own, its parent's requests
+ * are none of its business */
+static void init_child()
+{
+    pthread_mutex_init(&shm_lock, NULL);
+    pthread_cond_init(&shm_cond, NULL);
+    shm_free = (1U << IPC_SHM_SLOTS) - 1;
+    shm_done = 0;
+    shm_reaping = 0;
+
+    if (shm) free_shm();
+    _close(lvlfd);
+
+    lvlpid = getpid();
+    lvlfd = init_socket("/tmp/lvlip.socket");
+    init_shm();
+}
+
 int __libc_start_main(int (*main) (int, char * *, char * *), int argc,
                       char * * ubp_av, void (*init) (void), void (*fini) (void),
                       void (*rtld_fini) (void), void (* stack_end))
@@ -353,10 +818,18 @@ int __libc_start_main(int (*main) (int, char * *, char * *), int argc,
     _read = dlsym(RTLD_NEXT, "read");
     _write = dlsym(RTLD_NEXT, "write");
     _connect = dlsym(RTLD_NEXT, "connect");
+    _bind = dlsym(RTLD_NEXT, "bind");
+    _listen = dlsym(RTLD_NEXT, "listen");
+    _accept = dlsym(RTLD_NEXT, "accept");
+    _accept4 = dlsym(RTLD_NEXT, "accept4");
     _socket = dlsym(RTLD_NEXT, "socket");
     _close = dlsym(RTLD_NEXT, "close");
  
+    lvlpid = getpid();
     lvlfd = init_socket("/tmp/lvlip.socket");
+    init_shm();
+
+    pthread_atfork(NULL, NULL, init_child);
 
     return __start_main(main, argc, ubp_av, init, fini, rtld_fini, stack_end);
 }